@@ -24,11 +24,21 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <math.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "instrumentation.h"
 
@@ -39,6 +49,17 @@
 // The other field is a pointer to an array that stores the pointers
 // to the RLE compressed image rows.
 //
+// Usually each row is allocated on its own, but the rows may also be
+// stored in a single block of memory (for instance, a file mapped with
+// mmap, or the rows built by a concatenation, where a row may appear
+// several times). Rows inside that block are not freed one by one.
+// Uniform rows may all share one of two constant rows (all WHITE or all
+// BLACK) of the image, which are not freed one by one either.
+//
+// An occupancy summary (where the BLACK pixels are) may also be kept, so
+// that blank regions can be skipped.  It is computed when an image is
+// created or loaded, or on demand, and dropped when the image changes.
+//
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
 // structure fields directly.
@@ -48,12 +69,26 @@
 // const uint8 WHITE = 0;  // White pixel value, defined on .h
 const int EOR = -1; // Stored as the last element of a RLE row
 
+/// Occupancy summary of an image
+typedef struct {
+    uint32 x0, y0, x1, y1; // caixa [x0, x1[ x [y0, y1[ dos pixels pretos
+                           // (vazia, com todos a 0, se não há nenhum)
+    uint32 nblank;         // número de intervalos de linhas brancas
+    uint32 (*blank)[2];    // intervalos [first, last[ de linhas brancas
+} Occupancy;
+
 // Internal structure for storing RLE BW images
 struct image {
     uint32 width;
     uint32 height;
     int *
         *row; // pointer to an array of pointers referencing the compressed rows
+    void *block;       // block of memory storing some rows, or NULL
+    size_t block_size; // size of the block in bytes
+    int block_mapped;  // the block was mapped with mmap (else malloc'ed)
+    int *spare;        // scratch row reused by the Into operations, or NULL
+    int *constant;     // shared rows all WHITE and all BLACK, or NULL
+    _Atomic(Occupancy *) occupancy; // occupancy summary, or NULL
 };
 
 // This module follows "design-by-contract" principles.
@@ -102,42 +137,196 @@ void ImageInit(void) { ///
 /// And allocate the array of pointers to RLE rows
 static Image AllocateImageHeader(uint32 width, uint32 height) {
     assert(width > 0 && height > 0);
-    Image newHeader = malloc(sizeof(struct image));
+    Image newHeader = InstrMalloc(sizeof(struct image));
     check(newHeader != NULL, "malloc");
 
     newHeader->width = width;
     newHeader->height = height;
 
     // Allocating the array of pointers to RLE rows
-    newHeader->row = malloc(height * sizeof(int *));
+    newHeader->row = InstrMalloc(height * sizeof(int *));
     check(newHeader->row != NULL, "malloc");
 
+    newHeader->block = NULL;
+    newHeader->block_size = 0;
+    newHeader->block_mapped = 0;
+    newHeader->spare = NULL;
+    newHeader->constant = NULL;
+    atomic_init(&newHeader->occupancy, NULL);
+
     return newHeader;
 }
 
-/// Allocate an array to store a RLE row with n elements
-static int *AllocateRLERowArray(uint32 n) {
-    assert(n > 2);
-    int *newArray = malloc(n * sizeof(int));
-    check(newArray != NULL, "malloc");
+/// Is the RLE row stored in the block of the image,
+/// or is it one of the shared constant rows?
+/// (If so, it must not be freed or changed on its own.)
+static int RowInBlock(const Image img, const int *RLE_row) {
+    const char *p = (const char *)RLE_row;
+    const char *start = img->block;
+    if (img->constant != NULL &&
+        (RLE_row == img->constant || RLE_row == img->constant + 3))
+        return 1;
+    return start != NULL && p >= start && p < start + img->block_size;
+}
 
-    return newArray;
+/// Get the shared row of an image with a single run of the given color.
+/// Uniform rows of an image may all point to these rows, so a blank image
+/// takes constant memory.  They are allocated on first use, so this must
+/// be called once before rows are built by parallel bands.
+static int *ConstantRow(Image img, int color) {
+    assert(color == WHITE || color == BLACK);
+    if (img->constant == NULL) {
+        int *rows = InstrMalloc(6 * sizeof(int));
+        check(rows != NULL, "malloc");
+        rows[0] = WHITE;
+        rows[1] = (int)img->width;
+        rows[2] = EOR;
+        rows[3] = BLACK;
+        rows[4] = (int)img->width;
+        rows[5] = EOR;
+        img->constant = rows;
+    }
+    return img->constant + 3 * color;
 }
 
-/// Compute the number of runs of a non-compressed (RAW) image row
-static uint32 GetNumRunsInRAWRow(uint32 image_width, const uint8 *RAW_row) {
-    assert(image_width > 0);
-    assert(RAW_row != NULL);
+/// Occupancy summaries
+
+/// Compute the occupancy summary of an image, scanning all its runs
+static Occupancy *ComputeOccupancy(const Image img) {
+    Occupancy *occ = InstrMalloc(sizeof(Occupancy));
+    check(occ != NULL, "malloc");
+    occ->x0 = img->width;
+    occ->y0 = img->height;
+    occ->x1 = occ->y1 = 0;
+    occ->nblank = 0;
+    occ->blank = NULL;
+    uint32 cap = 0;
+
+    for (uint32 i = 0; i < img->height; i++) {
+        // extensão [first, last[ dos pixels pretos da linha
+        const int *row = img->row[i];
+        uint32 x = 0, first = img->width, last = 0;
+        int color = row[0];
+        for (uint32 j = 1; row[j] != EOR; j++) {
+            if (color == BLACK && row[j] > 0) {
+                if (first > x)
+                    first = x;
+                last = x + row[j];
+            }
+            x += row[j];
+            color ^= 1;
+        }
 
-    // How many runs?
-    uint32 num_runs = 1;
-    for (uint32 i = 1; i < image_width; i++) {
-        if (RAW_row[i] != RAW_row[i - 1]) {
-            num_runs++;
+        if (last > 0) {
+            if (first < occ->x0)
+                occ->x0 = first;
+            if (last > occ->x1)
+                occ->x1 = last;
+            if (i < occ->y0)
+                occ->y0 = i;
+            occ->y1 = i + 1;
+        } else if (occ->nblank > 0 && occ->blank[occ->nblank - 1][1] == i) {
+            occ->blank[occ->nblank - 1][1] = i + 1; // continua o intervalo
+        } else {
+            if (occ->nblank == cap) {
+                cap = (cap > 0) ? 2 * cap : 4;
+                occ->blank = InstrRealloc(occ->blank, cap * 2 * sizeof(uint32));
+                check(occ->blank != NULL, "realloc");
+            }
+            occ->blank[occ->nblank][0] = i;
+            occ->blank[occ->nblank][1] = i + 1;
+            occ->nblank++;
         }
     }
+    if (occ->x1 == 0)
+        occ->x0 = occ->y0 = 0; // imagem em branco: caixa vazia
+    return occ;
+}
+
+static void FreeOccupancy(Occupancy *occ) {
+    if (occ != NULL) {
+        InstrFree(occ->blank);
+        InstrFree(occ);
+    }
+}
 
-    return num_runs;
+/// Get the occupancy summary of an image, if it has already been computed,
+/// or else NULL.
+static const Occupancy *PeekOccupancy(const Image img) {
+    return atomic_load(&img->occupancy);
+}
+
+/// Get the occupancy summary of an image, computing it if needed.
+/// (Safe if called by several threads: only one summary is kept.)
+static const Occupancy *GetOccupancy(Image img) {
+    Occupancy *occ = atomic_load(&img->occupancy);
+    if (occ == NULL) {
+        Occupancy *expected = NULL;
+        occ = ComputeOccupancy(img);
+        if (!atomic_compare_exchange_strong(&img->occupancy, &expected, occ)) {
+            FreeOccupancy(occ);
+            occ = expected;
+        }
+    }
+    return occ;
+}
+
+/// Drop the occupancy summary of an image whose rows are being changed
+static void InvalidateOccupancy(Image img) {
+    FreeOccupancy(atomic_exchange(&img->occupancy, NULL));
+}
+
+/// Rows [*first, *last[ outside which an image is surely blank
+static void ContentRows(const Image img, uint32 *first, uint32 *last) {
+    const Occupancy *occ = PeekOccupancy(img);
+    *first = (occ != NULL) ? occ->y0 : 0;
+    *last = (occ != NULL) ? occ->y1 : img->height;
+}
+
+/// Rows [*first, *last[ outside which the result of a boolean operation
+/// (see OP_AND, OP_OR, OP_XOR) on img1 and img2 is surely WHITE,
+/// according to the summaries of the images that have one.
+static void OpRowRange(uint8 op, const Image img1, const Image img2,
+                       uint32 *first, uint32 *last) {
+    const Occupancy *o1 = PeekOccupancy(img1);
+    const Occupancy *o2 = PeekOccupancy(img2);
+    *first = 0;
+    *last = img1->height;
+    if (op & 1)
+        return; // WHITE op WHITE é BLACK: nada a saltar
+    // linhas em branco numa imagem que tornam o resultado WHITE
+    int white1 = o1 != NULL && (op & 0x3) == 0;
+    int white2 = o2 != NULL && (op & 0x5) == 0;
+    if (o1 != NULL && o2 != NULL && !white1 && !white2) {
+        // só as linhas em branco nas duas imagens são WHITE
+        if (o1->y1 == 0 || o2->y1 == 0) {
+            const Occupancy *o = (o1->y1 == 0) ? o2 : o1;
+            *first = o->y0;
+            *last = o->y1;
+        } else {
+            *first = (o1->y0 < o2->y0) ? o1->y0 : o2->y0;
+            *last = (o1->y1 > o2->y1) ? o1->y1 : o2->y1;
+        }
+    }
+    if (white1) {
+        *first = (o1->y0 > *first) ? o1->y0 : *first;
+        *last = (o1->y1 < *last) ? o1->y1 : *last;
+    }
+    if (white2) {
+        *first = (o2->y0 > *first) ? o2->y0 : *first;
+        *last = (o2->y1 < *last) ? o2->y1 : *last;
+    }
+    if (*first >= *last)
+        *first = *last = 0;
+}
+
+/// Allocate an array to store a RLE row with n elements
+static int *AllocateRLERowArray(uint32 n) {
+    assert(n > 2);
+    int *newArray = InstrMalloc(n * sizeof(int));
+    check(newArray != NULL, "malloc");
+
+    return newArray;
 }
 
 /// Get the number of runs of a compressed RLE image row
@@ -170,33 +359,50 @@ static uint32 GetSizeRLERowArray(const int *RLE_row) {
     return (i + 1);
 }
 
-/// Compress into RLE format a RAW image row
+/// Find the end of the run of pixels of the given color that starts at
+/// column i of a RAW image row: the first column >= i with another color,
+/// or image_width.  With SSE2, 16 pixels are compared at once and the
+/// first different one is found in the comparison mask.
+static uint32 FindRunEnd(uint32 image_width, const uint8 *RAW_row, uint32 i,
+                         uint8 color) {
+#ifdef __SSE2__
+    const __m128i same = _mm_set1_epi8((char)color);
+    while (i + 16 <= image_width) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(RAW_row + i));
+        uint32 diff =
+            ~(uint32)_mm_movemask_epi8(_mm_cmpeq_epi8(pixels, same)) & 0xFFFF;
+        if (diff != 0)
+            return i + __builtin_ctz(diff);
+        i += 16;
+    }
+#endif
+    while (i < image_width && RAW_row[i] == color)
+        i++;
+    return i;
+}
+
+/// Compress into RLE format a RAW image row, in a single pass.
+/// The runs are written to temp_row, which must have space for
+/// (image_width + 2) elements, and then copied to an array of the
+/// exact size.
 /// Allocates and returns the array storing the image row in RLE format
-static int *CompressRow(uint32 image_width, const uint8 *RAW_row) {
+static int *CompressRow(uint32 image_width, const uint8 *RAW_row,
+                        int *temp_row) {
     assert(image_width > 0);
-    assert(RAW_row != NULL);
+    assert(RAW_row != NULL && temp_row != NULL);
 
-    // How many runs?
-    uint32 num_runs = GetNumRunsInRAWRow(image_width, RAW_row);
-
-    // Allocate the RLE row array
-    int *RLE_row = malloc((num_runs + 2) * sizeof(int));
-    check(RLE_row != NULL, "malloc");
-
-    // Go through the RAW_row
-    RLE_row[0] = (int)RAW_row[0]; // Initial pixel value
-    uint32 index = 1;
-    int num_pixels = 1;
-    for (uint32 i = 1; i < image_width; i++) {
-        if (RAW_row[i] != RAW_row[i - 1]) {
-            RLE_row[index++] = num_pixels;
-            num_pixels = 0;
-        }
-        num_pixels++;
+    temp_row[0] = (int)RAW_row[0]; // Initial pixel value
+    uint32 size = 1;
+    uint32 i = 0;
+    while (i < image_width) {
+        uint32 end = FindRunEnd(image_width, RAW_row, i, RAW_row[i]);
+        temp_row[size++] = (int)(end - i);
+        i = end;
     }
-    RLE_row[index++] = num_pixels;
-    RLE_row[index] = EOR; // Reached the end of the row
+    temp_row[size++] = EOR; // Reached the end of the row
 
+    int *RLE_row = AllocateRLERowArray(size);
+    memcpy(RLE_row, temp_row, size * sizeof(int));
     return RLE_row;
 }
 
@@ -205,20 +411,15 @@ static uint8 *UncompressRow(uint32 image_width, const int *RLE_row) {
     assert(RLE_row != NULL);
 
     // The uncompressed row
-    uint8 *row = (uint8 *)malloc(image_width * sizeof(uint8));
+    uint8 *row = (uint8 *)InstrMalloc(image_width * sizeof(uint8));
     check(row != NULL, "malloc");
 
-    // Go through the RLE_row until EOR is found
+    // Go through the RLE_row until EOR is found, filling each run at once
     int pixel_value = RLE_row[0];
-    uint32 i = 1;
-    uint32 dest_i = 0;
-    while (RLE_row[i] != EOR) {
-        // For each run
-        for (int aux = 0; aux < RLE_row[i]; aux++) {
-            row[dest_i++] = (uint8)pixel_value;
-        }
-        // Next run
-        i++;
+    uint8 *dest = row;
+    for (uint32 i = 1; RLE_row[i] != EOR; i++) {
+        memset(dest, pixel_value, RLE_row[i]);
+        dest += RLE_row[i];
         pixel_value ^= 1;
     }
 
@@ -227,6 +428,469 @@ static uint8 *UncompressRow(uint32 image_width, const int *RLE_row) {
 
 // Add your auxiliary functions here...
 
+/// Cursor to walk the runs of a RLE row, pixel span by pixel span
+typedef struct {
+    const int *row; // the RLE row
+    uint32 i;       // index of the current run in row
+    int color;      // color of the current run
+    int left;       // pixels still left in the current run
+} RunCursor;
+
+/// Advance the cursor n pixels (n must not exceed c->left)
+static void RunCursorSkip(RunCursor *c, int n) {
+    assert(n <= c->left);
+    c->left -= n;
+    // passar à próxima run (ignorando runs vazias)
+    while (c->left == 0 && c->row[c->i] != EOR) {
+        c->i++;
+        if (c->row[c->i] != EOR) {
+            c->color ^= 1;
+            c->left = c->row[c->i];
+        }
+    }
+}
+
+static void RunCursorInit(RunCursor *c, const int *row) {
+    assert(row != NULL);
+    c->row = row;
+    c->i = 1;
+    c->color = row[0];
+    c->left = row[1];
+    RunCursorSkip(c, 0);
+}
+
+/// Cursor to walk the runs of a RLE row inside the columns [x, x + width[,
+/// trimming the runs that cross the edges of the window
+typedef struct {
+    RunCursor c; // cursor na linha completa
+    int remain;  // pixels da janela ainda por percorrer
+    int color;   // cor do troço atual
+    int left;    // pixels do troço atual dentro da janela (0 no fim)
+} WindowCursor;
+
+/// Advance the cursor n pixels (n must not exceed w->left)
+static void WindowCursorSkip(WindowCursor *w, int n) {
+    assert(n <= w->left);
+    RunCursorSkip(&w->c, n);
+    w->remain -= n;
+    w->color = w->c.color;
+    w->left = (w->c.left < w->remain) ? w->c.left : w->remain;
+}
+
+static void WindowCursorInit(WindowCursor *w, const int *row, uint32 x,
+                             uint32 width) {
+    RunCursorInit(&w->c, row);
+    // saltar as runs (e o início da run) à esquerda da janela
+    int skip = (int)x;
+    while (skip > w->c.left) {
+        skip -= w->c.left;
+        RunCursorSkip(&w->c, w->c.left);
+    }
+    RunCursorSkip(&w->c, skip);
+    w->remain = (int)width;
+    w->left = 0;
+    WindowCursorSkip(w, 0);
+}
+
+/// Buffer to build a RLE row run by run.
+/// Adjacent runs of the same color are merged, so the result is canonical.
+/// The buffer must have space for (width + 2) elements.
+typedef struct {
+    int *buf;    // the row being built
+    uint32 size; // number of elements used in buf
+    int last;    // color of the last run, -1 if there is none yet
+} RowBuilder;
+
+static void RowBuilderInit(RowBuilder *rb, int *buf) {
+    assert(buf != NULL);
+    rb->buf = buf;
+    rb->size = 1;
+    rb->last = -1;
+}
+
+/// Append a run of len pixels with the given color
+static void RowBuilderPush(RowBuilder *rb, int color, int len) {
+    if (len <= 0)
+        return;
+    if (color == rb->last) {
+        rb->buf[rb->size - 1] += len;
+        return;
+    }
+    if (rb->last == -1)
+        rb->buf[0] = color;
+    rb->buf[rb->size++] = len;
+    rb->last = color;
+}
+
+/// Terminate the row and return a copy of it with the exact size
+static int *RowBuilderFinish(RowBuilder *rb) {
+    assert(rb->last != -1);
+    rb->buf[rb->size++] = EOR;
+    int *row = AllocateRLERowArray(rb->size);
+    memcpy(row, rb->buf, rb->size * sizeof(int));
+    return row;
+}
+
+/// Terminate the row built by rb and store it in img: a single run becomes
+/// one of the shared constant rows, otherwise an exact copy is allocated.
+static int *RowBuilderFinishIn(RowBuilder *rb, Image img) {
+    if (rb->size == 2)
+        return ConstantRow(img, rb->buf[0]);
+    return RowBuilderFinish(rb);
+}
+
+/// Copy a RLE row into img, negating it if neg is set.
+/// A single run becomes one of the shared constant rows.
+static int *CopyRowIn(Image img, const int *row, int neg) {
+    if (row[2] == EOR)
+        return ConstantRow(img, row[0] ^ neg);
+    uint32 num_elems = GetSizeRLERowArray(row);
+    int *copy = AllocateRLERowArray(num_elems);
+    memcpy(copy, row, num_elems * sizeof(int));
+    copy[0] ^= neg;
+    return copy;
+}
+
+/// Results of SingleRunShortcut, besides the constant colors
+#define SHORTCUT_NONE -1 // as linhas têm de ser percorridas
+#define SHORTCUT_COPY 2  // o resultado é a outra linha
+#define SHORTCUT_NEG 3   // o resultado é a negação da outra linha
+
+/// Shortcut of a boolean operation (see OP_AND, OP_OR, OP_XOR) when row1
+/// or row2 is a single run: the result is then a constant row, or the
+/// other row (*other), possibly negated, without scanning any run.
+/// Returns the color of a constant result, SHORTCUT_COPY, SHORTCUT_NEG,
+/// or SHORTCUT_NONE if neither row is a single run.
+static int SingleRunShortcut(uint8 op, const int *row1, const int *row2,
+                             const int **other) {
+    int t0, t1; // cor do resultado se a outra linha for WHITE e BLACK
+    if (row1[2] == EOR) {
+        t0 = (op >> (2 * row1[0])) & 1;
+        t1 = (op >> (2 * row1[0] + 1)) & 1;
+        *other = row2;
+    } else if (row2[2] == EOR) {
+        t0 = (op >> row2[0]) & 1;
+        t1 = (op >> (2 + row2[0])) & 1;
+        *other = row1;
+    } else {
+        return SHORTCUT_NONE;
+    }
+    if (t0 == t1)
+        return t0;
+    return t1 ? SHORTCUT_COPY : SHORTCUT_NEG;
+}
+
+/// Combine two RLE rows with a boolean function, given as a truth table
+/// (see OP_AND, OP_OR, OP_XOR), appending the resulting runs to rb.
+/// The result has at most (runs of row1 + runs of row2 - 1) runs.
+static void MergeRLERows(uint8 op, const int *row1, const int *row2,
+                         RowBuilder *rb) {
+    RunCursor c1, c2;
+    RunCursorInit(&c1, row1);
+    RunCursorInit(&c2, row2);
+    while (c1.left > 0) {
+        // o troço até à próxima mudança de cor em alguma das linhas
+        int len = (c1.left < c2.left) ? c1.left : c2.left;
+        RowBuilderPush(rb, (op >> (2 * c1.color + c2.color)) & 1, len);
+        BOL_OPS++;
+        RunCursorSkip(&c1, len);
+        RunCursorSkip(&c2, len);
+    }
+}
+
+/// Get an array with space for n elements, reusing row if it is big enough.
+/// Otherwise, row is released (if not NULL) and a new array is allocated.
+/// The contents of the array are undefined.
+static int *ReuseRLERowArray(int *row, uint32 n) {
+    if (row != NULL && InstrAllocSize(row) >= n * sizeof(int))
+        return row;
+    InstrFree(row);
+    return AllocateRLERowArray(n);
+}
+
+/// Apply a boolean operation to img1 and img2, storing the result in dst.
+/// The arrays of the rows of dst are reused whenever they have enough space,
+/// so that repeating operations with a similar number of runs allocates no
+/// memory.  dst may be one of the operands.
+static void ImageOpInto(uint8 op, Image dst, const Image img1,
+                        const Image img2) {
+    assert(dst != NULL && img1 != NULL && img2 != NULL);
+    check(img1->height == img2->height && img1->width == img2->width, "size");
+    check(dst->height == img1->height && dst->width == img1->width, "size");
+
+    // fora de [first, last[ o resultado é branco, sem olhar para as linhas
+    // (calculado antes de se descartar o resumo de dst, que pode ser um
+    // dos operandos)
+    uint32 first, last;
+    OpRowRange(op, img1, img2, &first, &last);
+    InvalidateOccupancy(dst);
+
+    for (uint32 i = 0; i < dst->height; i++) {
+        const int *row1 = img1->row[i];
+        const int *row2 = img2->row[i];
+        // linha dentro do bloco (ou constante): não pode ser alterada,
+        // escreve-se numa cópia (copy-on-write)
+        int *row = RowInBlock(dst, dst->row[i]) ? NULL : dst->row[i];
+
+        // fora de [first, last[ o resultado é branco, sem ver os operandos
+        const int *other = NULL;
+        int shortcut = (i < first || i >= last)
+                           ? WHITE
+                           : SingleRunShortcut(op, row1, row2, &other);
+
+        if (shortcut == WHITE || shortcut == BLACK) {
+            if (row == NULL) {
+                // partilha-se a linha constante, em vez de a copiar
+                dst->row[i] = ConstantRow(dst, shortcut);
+            } else {
+                row[0] = shortcut;
+                row[1] = (int)dst->width;
+                row[2] = EOR;
+            }
+        } else if (shortcut != SHORTCUT_NONE) {
+            // o resultado é a outra linha, talvez negada
+            if (other != row) {
+                uint32 size = GetSizeRLERowArray(other);
+                dst->row[i] = ReuseRLERowArray(row, size);
+                memmove(dst->row[i], other, size * sizeof(int));
+            }
+            dst->row[i][0] ^= (shortcut == SHORTCUT_NEG);
+        } else {
+            if (row != NULL && (row == row1 || row == row2)) {
+                // a linha de destino é um operando: guarda-se uma cópia dele
+                uint32 size = GetSizeRLERowArray(row);
+                dst->spare = ReuseRLERowArray(dst->spare, size);
+                memcpy(dst->spare, row, size * sizeof(int));
+                if (row1 == row)
+                    row1 = dst->spare;
+                if (row2 == row)
+                    row2 = dst->spare;
+            }
+            uint32 n = GetNumRunsInRLERow(row1) + GetNumRunsInRLERow(row2) + 2;
+            dst->row[i] = ReuseRLERowArray(row, n);
+            RowBuilder rb;
+            RowBuilderInit(&rb, dst->row[i]);
+            MergeRLERows(op, row1, row2, &rb);
+            rb.buf[rb.size++] = EOR;
+        }
+    }
+}
+
+/// Apply a boolean operation to img1 and img2, returning a new image.
+static Image ImageOp(uint8 op, const Image img1, const Image img2) {
+    assert(img1 != NULL && img2 != NULL);
+    check(img1->height == img2->height && img1->width == img2->width, "size");
+
+    Image result = AllocateImageHeader(img1->width, img1->height);
+    int *temp_row = InstrMalloc((img1->width + 2) * sizeof(int));
+    check(temp_row != NULL, "malloc");
+    // fora de [first, last[ o resultado é branco, sem olhar para as linhas
+    uint32 first, last;
+    OpRowRange(op, img1, img2, &first, &last);
+    for (uint32 i = 0; i < img1->height; i++) {
+        if (i < first || i >= last) {
+            result->row[i] = ConstantRow(result, WHITE);
+            continue;
+        }
+        const int *other;
+        int shortcut = SingleRunShortcut(op, img1->row[i], img2->row[i],
+                                         &other);
+        if (shortcut == WHITE || shortcut == BLACK) {
+            result->row[i] = ConstantRow(result, shortcut);
+        } else if (shortcut != SHORTCUT_NONE) {
+            result->row[i] =
+                CopyRowIn(result, other, shortcut == SHORTCUT_NEG);
+        } else {
+            RowBuilder rb;
+            RowBuilderInit(&rb, temp_row);
+            MergeRLERows(op, img1->row[i], img2->row[i], &rb);
+            result->row[i] = RowBuilderFinishIn(&rb, result);
+        }
+    }
+    InstrFree(temp_row);
+    return result;
+}
+
+/// Simultaneous sweep of k RLE rows of the same width, from left to right,
+/// by segments where none of the rows changes color.
+/// A min-heap keeps the rows ordered by the position of their next color
+/// change, so each change costs O(log k).
+typedef struct {
+    int x;    // posição da próxima mudança de cor
+    uint32 r; // índice da linha
+} SweepEvent;
+
+typedef struct {
+    const int *const *rows; // as k linhas
+    uint32 *run;            // índice da run atual de cada linha
+    SweepEvent *heap;       // mínimo em heap[0]
+    uint32 n;               // linhas ainda no monte
+    uint32 k;               // número de linhas
+    int x;                  // posição atual
+    uint32 count;           // linhas com cor BLACK na posição atual
+    uint32 mask;            // cores na posição atual: bit k-1-r da linha r
+                            // (só se k <= 32)
+} RowSweep;
+
+/// Allocate a sweep for up to k rows
+static void RowSweepInit(RowSweep *sw, uint32 k) {
+    sw->run = InstrMalloc(k * sizeof(uint32));
+    sw->heap = InstrMalloc(k * sizeof(SweepEvent));
+    check(sw->run != NULL && sw->heap != NULL, "malloc");
+}
+
+static void RowSweepClose(RowSweep *sw) {
+    InstrFree(sw->run);
+    InstrFree(sw->heap);
+}
+
+static void RowSweepSiftDown(RowSweep *sw, uint32 i) {
+    SweepEvent e = sw->heap[i];
+    for (;;) {
+        uint32 c = 2 * i + 1;
+        if (c >= sw->n)
+            break;
+        if (c + 1 < sw->n && sw->heap[c + 1].x < sw->heap[c].x)
+            c++;
+        if (sw->heap[c].x >= e.x)
+            break;
+        sw->heap[i] = sw->heap[c];
+        i = c;
+    }
+    sw->heap[i] = e;
+}
+
+/// Apply all the color changes at position x (the minimum of the heap)
+static void RowSweepAdvance(RowSweep *sw, int x) {
+    while (sw->n > 0 && sw->heap[0].x == x) {
+        uint32 r = sw->heap[0].r;
+        const int *row = sw->rows[r];
+        uint32 i = ++sw->run[r];
+        if (row[i] == EOR) {
+            // a linha terminou: sai do monte
+            sw->heap[0] = sw->heap[--sw->n];
+        } else {
+            // a run i tem a cor row[0] se i for ímpar
+            int color = row[0] ^ !(i & 1);
+            sw->count += color ? 1 : -1;
+            if (sw->k <= 32)
+                sw->mask ^= 1u << (sw->k - 1 - r);
+            sw->heap[0].x = x + row[i];
+        }
+        RowSweepSiftDown(sw, 0);
+    }
+    sw->x = x;
+}
+
+/// Start sweeping rows[0..k-1]
+static void RowSweepStart(RowSweep *sw, const int *const *rows, uint32 k) {
+    sw->rows = rows;
+    sw->n = sw->k = k;
+    sw->count = 0;
+    sw->mask = 0;
+    for (uint32 r = 0; r < k; r++) {
+        sw->run[r] = 1;
+        sw->count += rows[r][0];
+        if (k <= 32)
+            sw->mask |= (uint32)rows[r][0] << (k - 1 - r);
+        sw->heap[r].x = rows[r][1];
+        sw->heap[r].r = r;
+    }
+    for (uint32 i = k / 2; i-- > 0;)
+        RowSweepSiftDown(sw, i);
+    RowSweepAdvance(sw, 0); // runs vazias no início
+}
+
+/// Get the next segment: returns its length and stores in *count the number
+/// of rows that are BLACK in it, and in *mask (if not NULL) their colors.
+/// Returns 0 at the end of the rows.
+static int RowSweepNext(RowSweep *sw, uint32 *count, uint32 *mask) {
+    if (sw->n == 0)
+        return 0;
+    int len = sw->heap[0].x - sw->x;
+    *count = sw->count;
+    if (mask != NULL)
+        *mask = sw->mask;
+    RowSweepAdvance(sw, sw->heap[0].x);
+    return len;
+}
+
+/// Row-parallel execution
+
+// Operations where rows are independent split the image in bands of
+// consecutive rows and process each band in its own thread.
+// The number of threads is set by ImageSetThreads, or else read from
+// environment variable IMAGEBW_THREADS, or else is the number of online
+// processors.
+
+#define MIN_BAND_ROWS 64 // bands smaller than this are not worth a thread
+
+/// Function applied to the rows [first, last) of band number band
+typedef void (*BandFunc)(void *arg, uint32 band, uint32 first, uint32 last);
+
+typedef struct {
+    BandFunc fn;
+    void *arg;
+    uint32 band, first, last;
+} BandTask;
+
+static void *BandThread(void *p) {
+    BandTask *t = p;
+    InstrTraceBegin("band");
+    t->fn(t->arg, t->band, t->first, t->last);
+    InstrTraceEnd("band");
+    return NULL;
+}
+
+// Number of threads for the bands (set once, then read by any thread)
+static atomic_uint BandThreads;
+static pthread_once_t BandThreadsOnce = PTHREAD_ONCE_INIT;
+
+static void BandThreadsInit(void) {
+    char *val = getenv("IMAGEBW_THREADS");
+    long n = (val != NULL) ? atol(val) : sysconf(_SC_NPROCESSORS_ONLN);
+    atomic_init(&BandThreads, (n > 0) ? (uint32)n : 1);
+}
+
+/// Set the number of threads used by each row-parallel operation
+/// (at least 1).  Overrides IMAGEBW_THREADS.
+void ImageSetThreads(uint32 n) { ///
+    pthread_once(&BandThreadsOnce, BandThreadsInit);
+    atomic_store(&BandThreads, (n > 0) ? n : 1);
+}
+
+/// Maximum number of bands used for an image with the given height
+static uint32 NumBands(uint32 height) {
+    pthread_once(&BandThreadsOnce, BandThreadsInit);
+    uint32 nthreads = atomic_load(&BandThreads);
+    uint32 nbands = height / MIN_BAND_ROWS;
+    if (nbands > nthreads)
+        nbands = nthreads;
+    return (nbands > 0) ? nbands : 1;
+}
+
+/// Apply fn to nbands bands of rows of an image with the given height.
+/// Band 0 runs in the calling thread.
+static void ParallelRows(uint32 height, uint32 nbands, BandFunc fn,
+                         void *arg) {
+    assert(nbands > 0);
+    BandTask task[nbands];
+    pthread_t tid[nbands];
+    for (uint32 b = 0; b < nbands; b++) {
+        task[b].fn = fn;
+        task[b].arg = arg;
+        task[b].band = b;
+        task[b].first = (uint32)((uint64_t)height * b / nbands);
+        task[b].last = (uint32)((uint64_t)height * (b + 1) / nbands);
+    }
+    for (uint32 b = 1; b < nbands; b++)
+        check(pthread_create(&tid[b], NULL, BandThread, &task[b]) == 0,
+              "pthread_create");
+    BandThread(&task[0]);
+    for (uint32 b = 1; b < nbands; b++)
+        pthread_join(tid[b], NULL);
+}
+
 /// Image management functions
 
 /// Create a new BW image, either BLACK or WHITE.
@@ -241,20 +905,37 @@ Image ImageCreate(uint32 width, uint32 height, uint8 val) {
     assert(width > 0 && height > 0);
     assert(val == WHITE || val == BLACK);
 
+    InstrTraceBegin("ImageCreate");
     Image newImage = AllocateImageHeader(width, height);
 
     // All image pixels have the same value
     int pixel_value = (int)val;
 
     // Creating the image rows, each row has just 1 run of pixels
-    // Each row is represented by an array of 3 elements [value,length,EOR]
+    // Each row is represented by an array of 3 elements [value,length,EOR],
+    // shared by all the rows
+    int *row = ConstantRow(newImage, pixel_value);
     for (uint32 i = 0; i < height; i++) {
-        newImage->row[i] = AllocateRLERowArray(3);
-        newImage->row[i][0] = pixel_value;
-        newImage->row[i][1] = (int)width;
-        newImage->row[i][2] = EOR;
+        newImage->row[i] = row;
+    }
+
+    // The occupancy summary is known: all blank or all BLACK
+    Occupancy *occ = InstrMalloc(sizeof(Occupancy));
+    check(occ != NULL, "malloc");
+    occ->x0 = occ->y0 = 0;
+    occ->x1 = (val == BLACK) ? width : 0;
+    occ->y1 = (val == BLACK) ? height : 0;
+    occ->nblank = (val == BLACK) ? 0 : 1;
+    occ->blank = NULL;
+    if (val == WHITE) {
+        occ->blank = InstrMalloc(2 * sizeof(uint32));
+        check(occ->blank != NULL, "malloc");
+        occ->blank[0][0] = 0;
+        occ->blank[0][1] = height;
     }
+    atomic_store(&newImage->occupancy, occ);
 
+    InstrTraceEnd("ImageCreate");
     return newImage;
 }
 
@@ -276,19 +957,15 @@ Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
     assert(width > 0 && height > 0);
     assert(width % square_edge == 0 && height % square_edge == 0);
 
+    InstrTraceBegin("ImageCreateChessboard");
     // determina o número de colunas e linhas do tabuleiro
     uint32 num_cols = width / square_edge;
 
     Image chessboard = AllocateImageHeader(width, height);
 
-    size_t board_size = sizeof(chessboard->row); // espaço que um quadrado ocupa
-
     for (uint32_t i = 0; i < height; i++) {
         chessboard->row[i] = AllocateRLERowArray(num_cols + 2);
         chessboard->row[i][num_cols + 1] = EOR;
-        board_size += sizeof(chessboard->row[i]);
-        board_size += sizeof(chessboard->row[i][0]);
-        board_size += sizeof(chessboard->row[i][num_cols + 1]);
         // inicializa o primeiro elemento pixel
         if (i == 0)
             chessboard->row[0][0] = first_value;
@@ -304,16 +981,196 @@ Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
         // adiciona o adiciona as runs à linha
         for (uint32 j = 1; j < num_cols + 1; j++) {
             chessboard->row[i][j] = square_edge;
-            board_size += sizeof(chessboard->row[i][j]);
         }
     }
     // descomente para usar na função ChessTable()
+    /*size_t board_size = ImageMemoryUsage(chessboard);*/
     /*printf("|%13zu|%10d|%18d|%17d|\n", board_size, num_cols * height, width,*/
     /*       square_edge);*/
 
+    InstrTraceEnd("ImageCreateChessboard");
     return chessboard;
 }
 
+/// Synthetic images
+
+// Gerador pseudo-aleatório splitmix64: rápido e reprodutível.
+// Cada bloco de GEN_CHUNK_ROWS linhas tem o seu próprio estado, derivado da
+// semente, para que os blocos sejam gerados em paralelo e a imagem não
+// dependa do número de threads.
+#define GEN_CHUNK_ROWS 256
+#define GEN_ZIPF_MAX 65536 // comprimento máximo das runs de Zipf
+
+typedef struct {
+    uint64 state;
+} GenRandom;
+
+static uint64 GenNext(GenRandom *r) {
+    uint64 z = (r->state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/// Uniform in (0, 1]
+static double GenUniform(GenRandom *r) {
+    return (double)((GenNext(r) >> 11) + 1) * 0x1.0p-53;
+}
+
+typedef struct {
+    Image img;
+    uint8 dist;
+    double param;
+    double scale[2];   // escala das runs WHITE e BLACK, para a densidade
+    double density;
+    double coherence;
+    uint64 seed;
+    double *zipf_cdf;  // distribuição acumulada de Zipf (ou NULL)
+    uint32 zipf_max;
+} GenArgs;
+
+/// Draw the length of a run of the given color
+static uint32 GenRun(const GenArgs *a, GenRandom *r, int color) {
+    double len;
+    switch (a->dist) {
+    case GEN_GEOMETRIC:
+        len = (a->param > 1.0)
+                  ? 1.0 + floor(log(GenUniform(r)) / log(1.0 - 1.0 / a->param))
+                  : 1.0;
+        break;
+    case GEN_ZIPF: {
+        // pesquisa binária na distribuição acumulada
+        double u = GenUniform(r) * a->zipf_cdf[a->zipf_max - 1];
+        uint32 lo = 0, hi = a->zipf_max - 1;
+        while (lo < hi) {
+            uint32 mid = lo + (hi - lo) / 2;
+            if (a->zipf_cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        len = lo + 1;
+        break;
+    }
+    default: // GEN_FIXED
+        len = a->param;
+    }
+    // arredondamento aleatório, para não enviesar a densidade
+    len = floor(len * a->scale[color] + GenUniform(r) - 0x1.0p-53);
+    if (len < 1.0)
+        return 1;
+    return (len > a->img->width) ? a->img->width : (uint32)len;
+}
+
+/// Generate a new row, with runs drawn from the distribution
+static int *GenFreshRow(const GenArgs *a, GenRandom *r, RowBuilder *rb) {
+    uint32 width = a->img->width;
+    int color = (GenUniform(r) <= a->density) ? BLACK : WHITE;
+    for (uint32 x = 0; x < width; color ^= 1) {
+        uint32 len = GenRun(a, r, color);
+        if (len > width - x)
+            len = width - x;
+        RowBuilderPush(rb, color, len);
+        x += len;
+    }
+    return RowBuilderFinish(rb);
+}
+
+/// Generate a row similar to prev, moving each color transition by -1, 0 or
+/// +1 pixels.  (Runs that vanish are merged with their neighbours.)
+static int *GenCoherentRow(const GenArgs *a, GenRandom *r, RowBuilder *rb,
+                           const int *prev) {
+    int width = a->img->width;
+    int color = prev[0];
+    int x = 0;   // fim da run anterior na linha nova
+    int end = 0; // fim da run atual na linha anterior
+    for (uint32 i = 1; prev[i] != EOR; i++, color ^= 1) {
+        end += prev[i];
+        int t = end;
+        if (end < width)
+            t += (int)(GenNext(r) % 3) - 1;
+        if (t < x)
+            t = x;
+        if (t > width)
+            t = width;
+        RowBuilderPush(rb, color, t - x);
+        x = t;
+    }
+    return RowBuilderFinish(rb);
+}
+
+static void GenerateBand(void *arg, uint32 band, uint32 first, uint32 last) {
+    (void)band;
+    GenArgs *a = arg;
+    Image img = a->img;
+    int *temp_row = InstrMalloc((img->width + 2) * sizeof(int));
+    check(temp_row != NULL, "malloc");
+
+    // os blocos que começam nesta banda
+    uint32 chunk = (first + GEN_CHUNK_ROWS - 1) / GEN_CHUNK_ROWS;
+    for (; chunk * GEN_CHUNK_ROWS < last; chunk++) {
+        GenRandom r = {a->seed ^ (chunk * 0xD1B54A32D192ED03ull)};
+        GenNext(&r);
+        uint32 start = chunk * GEN_CHUNK_ROWS;
+        uint32 stop = start + GEN_CHUNK_ROWS;
+        if (stop > img->height)
+            stop = img->height;
+        for (uint32 i = start; i < stop; i++) {
+            RowBuilder rb;
+            RowBuilderInit(&rb, temp_row);
+            if (i > start && GenUniform(&r) <= a->coherence)
+                img->row[i] = GenCoherentRow(a, &r, &rb, img->row[i - 1]);
+            else
+                img->row[i] = GenFreshRow(a, &r, &rb);
+        }
+    }
+    InstrFree(temp_row);
+}
+
+/// Generate a synthetic image, directly in RLE form.
+/// See imageBW.h for the meaning of the parameters.
+Image ImageGenerate(uint32 width, uint32 height, uint8 dist, double param,
+                    double density, double coherence, uint64 seed) {
+    assert(width > 0 && height > 0);
+    assert(dist == GEN_GEOMETRIC || dist == GEN_ZIPF || dist == GEN_FIXED);
+    assert(dist == GEN_ZIPF ? param > 0.0 : param >= 1.0);
+    assert(density >= 0.0 && density <= 1.0);
+    assert(coherence >= 0.0 && coherence <= 1.0);
+
+    if (density == 0.0 || density == 1.0)
+        return ImageCreate(width, height, (density == 1.0) ? BLACK : WHITE);
+
+    GenArgs args = {.img = AllocateImageHeader(width, height),
+                    .dist = dist,
+                    .param = param,
+                    .scale = {2.0 * (1.0 - density), 2.0 * density},
+                    .density = density,
+                    .coherence = coherence,
+                    .seed = seed,
+                    .zipf_cdf = NULL,
+                    .zipf_max = 0};
+    if (dist == GEN_ZIPF) {
+        args.zipf_max = (width < GEN_ZIPF_MAX) ? width : GEN_ZIPF_MAX;
+        args.zipf_cdf = InstrMalloc(args.zipf_max * sizeof(double));
+        check(args.zipf_cdf != NULL, "malloc");
+        double sum = 0.0;
+        for (uint32 k = 0; k < args.zipf_max; k++) {
+            sum += pow(k + 1.0, -param);
+            args.zipf_cdf[k] = sum;
+        }
+    }
+
+    // blocos de linhas independentes, repartidos pelas bandas
+    uint32 nchunks = (height + GEN_CHUNK_ROWS - 1) / GEN_CHUNK_ROWS;
+    uint32 nbands = NumBands(height);
+    if (nbands > nchunks)
+        nbands = nchunks;
+    ParallelRows(height, nbands, GenerateBand, &args);
+
+    InstrFree(args.zipf_cdf);
+    return args.img;
+}
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -325,10 +1182,19 @@ void ImageDestroy(Image *imgp) {
     Image img = *imgp;
 
     for (uint32 i = 0; i < img->height; i++) {
-        free(img->row[i]);
+        if (!RowInBlock(img, img->row[i]))
+            InstrFree(img->row[i]);
     }
-    free(img->row);
-    free(img);
+    if (img->block_mapped) {
+        munmap(img->block, img->block_size);
+        InstrMemAccount(-(long)img->block_size);
+    } else
+        InstrFree(img->block);
+    InstrFree(img->spare);
+    InstrFree(img->constant);
+    FreeOccupancy(atomic_load(&img->occupancy));
+    InstrFree(img->row);
+    InstrFree(img);
 
     *imgp = NULL;
 }
@@ -424,42 +1290,97 @@ static int skipComments(FILE *f) {
     return i;
 }
 
+/// Destroy an image whose loading failed after rows [0, nrows) were set.
+/// (The other rows were never set, so they are cleared first.)
+/// (errno is kept.)
+static void DestroyPartialImage(Image img, uint32 nrows) {
+    int e = errno;
+    for (uint32 i = nrows; i < img->height; i++)
+        img->row[i] = NULL;
+    ImageDestroy(&img);
+    errno = e;
+}
+
 /// Load a raw PBM file.
 /// Only binary PBM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
+/// If the file cannot be read or is not a valid PBM file,
+/// returns NULL and sets errno (EINVAL for invalid contents).
 Image ImageLoad(const char *filename) { ///
+    InstrTraceBegin("ImageLoad");
     int w, h;
     char c;
     FILE *f = NULL;
     Image img = NULL;
+    uint8 *bytes = NULL, *raw_row = NULL;
+    int *temp_row = NULL;
+    uint32 i = 0;
 
-    check((f = fopen(filename, "rb")) != NULL, "Open failed");
+    if ((f = fopen(filename, "rb")) == NULL)
+        goto fail;
     // Parse PBM header
-    check(fscanf(f, "P%c ", &c) == 1 && c == '4', "Invalid file format");
+    if (fscanf(f, "P%c ", &c) != 1 || c != '4')
+        goto invalid;
     skipComments(f);
-    check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width");
+    if (fscanf(f, "%d ", &w) != 1 || w <= 0)
+        goto invalid;
     skipComments(f);
-    check(fscanf(f, "%d", &h) == 1 && h >= 0, "Invalid height");
-    check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
+    if (fscanf(f, "%d", &h) != 1 || h <= 0)
+        goto invalid;
+    if (fscanf(f, "%c", &c) != 1 || !isspace(c))
+        goto invalid;
+    // o ficheiro tem de ter os pixels todos, antes de reservar memória
+    size_t nbytes = ((size_t)w + 8 - 1) / 8; // number of bytes for each row
+    struct stat st;
+    long pos = ftell(f);
+    if (pos < 0 || fstat(fileno(f), &st) != 0)
+        goto fail;
+    if ((uint64)h * nbytes > (uint64)(st.st_size - pos))
+        goto invalid;
 
     // Allocate image
     img = AllocateImageHeader(w, h);
 
     // Read pixels
-    int nbytes = (w + 8 - 1) / 8; // number of bytes for each row
-    // using VLAs...
-    uint8 bytes[nbytes];
-    uint8 raw_row[nbytes * 8];
-    for (uint32 i = 0; i < img->height; i++) {
-        check(fread(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes,
-              "Reading pixels");
+    bytes = InstrMalloc(nbytes);
+    raw_row = InstrMalloc(nbytes * 8);
+    temp_row = InstrMalloc(((size_t)w + 2) * sizeof(int));
+    check(bytes != NULL && raw_row != NULL && temp_row != NULL, "malloc");
+    for (; i < img->height; i++) {
+        if (fread(bytes, sizeof(uint8), nbytes, f) != nbytes)
+            goto invalid;
         unpackBits(nbytes, bytes, raw_row);
-        img->row[i] = CompressRow(w, raw_row);
+        // as linhas uniformes (margens, páginas em branco) são partilhadas
+        if (memchr(raw_row, raw_row[0] ^ 1, w) == NULL)
+            img->row[i] = ConstantRow(img, raw_row[0]);
+        else
+            img->row[i] = CompressRow(w, raw_row, temp_row);
     }
+    InstrFree(temp_row);
+    InstrFree(raw_row);
+    InstrFree(bytes);
 
     fclose(f);
+    GetOccupancy(img);
+    InstrTraceEnd("ImageLoad");
     return img;
+
+invalid:
+    errno = EINVAL;
+fail:
+    InstrFree(temp_row);
+    InstrFree(raw_row);
+    InstrFree(bytes);
+    if (img != NULL)
+        DestroyPartialImage(img, i);
+    if (f != NULL) {
+        int e = errno;
+        fclose(f);
+        errno = e;
+    }
+    InstrTraceEnd("ImageLoad");
+    return NULL;
 }
 
 /// Save image to PBM file.
@@ -467,6 +1388,7 @@ Image ImageLoad(const char *filename) { ///
 /// On failure, does not return, EXITS program!
 int ImageSave(const Image img, const char *filename) { ///
     assert(img != NULL);
+    InstrTraceBegin("ImageSave");
     int w = img->width;
     int h = img->height;
     FILE *f = NULL;
@@ -479,7 +1401,18 @@ int ImageSave(const Image img, const char *filename) { ///
     // using VLAs...
     uint8 bytes[nbytes];
     // unit8 raw_row[nbytes*8];
+    // Rows outside [y0, y1[ are blank: just write zeros
+    uint32 y0, y1;
+    ContentRows(img, &y0, &y1);
+    uint8 zeros[nbytes];
+    memset(zeros, 0, nbytes);
     for (uint32 i = 0; i < img->height; i++) {
+        if (i < y0 || i >= y1 || (img->row[i][0] == WHITE &&
+                                   img->row[i][2] == EOR)) {
+            check(fwrite(zeros, sizeof(uint8), nbytes, f) == (size_t)nbytes,
+                  "Writing pixels failed");
+            continue;
+        }
         // UncompressRow...
         uint8 *raw_row = UncompressRow(nbytes * 8, img->row[i]);
         // Fill padding pixels with WHITE
@@ -487,14 +1420,207 @@ int ImageSave(const Image img, const char *filename) { ///
         packBits(nbytes, bytes, raw_row);
         size_t written = fwrite(bytes, sizeof(uint8), nbytes, f);
         check(written == (size_t)nbytes, "Writing pixels failed");
-        free(raw_row);
+        InstrFree(raw_row);
     }
 
     // Cleanup
     fclose(f);
+    InstrTraceEnd("ImageSave");
+    return 0;
+}
+
+/// Native RLE file format
+//
+// Layout (all fields in the native byte order of the host):
+//   offset 0:   char   magic[4] = "RLEB"
+//   offset 4:   uint32 version (RLE_FILE_VERSION)
+//   offset 8:   uint32 width
+//   offset 12:  uint32 height
+//   offset 16:  uint64 number of ints in the run data
+//   offset 24:  uint64 checksum of everything after the header
+//   offset 32:  uint64 row offsets[height] (index of each row in the data)
+//   then:       int    run data (the RLE rows, each one ending with EOR)
+//
+// Identical consecutive rows are stored only once.
+// The file is loaded with a single mmap: the rows are used in place.
+
+#define RLE_FILE_MAGIC "RLEB"
+#define RLE_FILE_VERSION 1
+#define RLE_FILE_HEADER_SIZE 32
+
+/// Fletcher-64 checksum of n 32-bit words
+static uint64 Checksum(const uint32 *words, size_t n) {
+    uint64 a = 0, b = 0;
+    for (size_t i = 0; i < n; i++) {
+        a = (a + words[i]) % 0xFFFFFFFFu;
+        b = (b + a) % 0xFFFFFFFFu;
+    }
+    return (b << 32) | a;
+}
+
+/// Save image to a file in the native RLE format.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSaveRLE(const Image img, const char *filename) { ///
+    assert(img != NULL);
+    InstrTraceBegin("ImageSaveRLE");
+    uint32 height = img->height;
+
+    // calcular os offsets das linhas (linhas iguais seguidas são partilhadas)
+    uint64 *offset = InstrMalloc(height * sizeof(uint64));
+    check(offset != NULL, "malloc");
+    uint64 num_ints = 0;
+    for (uint32 i = 0; i < height; i++) {
+        uint32 size = GetSizeRLERowArray(img->row[i]);
+        if (i > 0 && (img->row[i] == img->row[i - 1] ||
+                      (size == GetSizeRLERowArray(img->row[i - 1]) &&
+                       memcmp(img->row[i], img->row[i - 1],
+                              size * sizeof(int)) == 0))) {
+            offset[i] = offset[i - 1];
+        } else {
+            offset[i] = num_ints;
+            num_ints += size;
+        }
+    }
+
+    // juntar offsets e runs num só bloco, para calcular o checksum
+    size_t body_size = height * sizeof(uint64) + num_ints * sizeof(int);
+    uint8 *body = InstrMalloc(body_size);
+    check(body != NULL, "malloc");
+    memcpy(body, offset, height * sizeof(uint64));
+    int *data = (int *)(body + height * sizeof(uint64));
+    for (uint32 i = 0; i < height; i++) {
+        if (i == 0 || offset[i] != offset[i - 1])
+            memcpy(data + offset[i], img->row[i],
+                   GetSizeRLERowArray(img->row[i]) * sizeof(int));
+    }
+
+    uint8 header[RLE_FILE_HEADER_SIZE];
+    uint32 version = RLE_FILE_VERSION;
+    uint64 checksum = Checksum((const uint32 *)body, body_size / 4);
+    memcpy(header, RLE_FILE_MAGIC, 4);
+    memcpy(header + 4, &version, 4);
+    memcpy(header + 8, &img->width, 4);
+    memcpy(header + 12, &img->height, 4);
+    memcpy(header + 16, &num_ints, 8);
+    memcpy(header + 24, &checksum, 8);
+
+    FILE *f = NULL;
+    check((f = fopen(filename, "wb")) != NULL, "Open failed");
+    check(fwrite(header, 1, RLE_FILE_HEADER_SIZE, f) == RLE_FILE_HEADER_SIZE,
+          "Writing header failed");
+    check(fwrite(body, 1, body_size, f) == body_size, "Writing runs failed");
+    check(fclose(f) == 0, "Closing file failed");
+
+    InstrFree(body);
+    InstrFree(offset);
+    InstrTraceEnd("ImageSaveRLE");
     return 0;
 }
 
+/// Is the RLE row, with at most avail ints, valid for the given width?
+/// (Color WHITE or BLACK, runs > 0 adding up to width, and EOR.)
+static int ValidRLERow(const int *RLE_row, uint64 avail, uint32 width) {
+    if (avail < 3 || (RLE_row[0] != WHITE && RLE_row[0] != BLACK))
+        return 0;
+    uint64 x = 0;
+    uint64 j = 1;
+    while (j < avail && RLE_row[j] != EOR) {
+        if (RLE_row[j] <= 0 || (uint64)RLE_row[j] > width - x)
+            return 0;
+        x += (uint64)RLE_row[j++];
+    }
+    return j < avail && j > 1 && x == width;
+}
+
+/// Load an image from a file in the native RLE format.
+/// The file is mapped in memory (copy-on-write) and the rows are used
+/// directly from there, without any per-row allocation.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// If the file cannot be read or is not a valid RLE file,
+/// returns NULL and sets errno (EINVAL for invalid contents).
+Image ImageLoadRLE(const char *filename) { ///
+    InstrTraceBegin("ImageLoadRLE");
+    int fd;
+    struct stat st;
+    uint8 *map = NULL;
+    size_t file_size = 0;
+    Image img = NULL;
+    uint32 i = 0;
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        goto fail;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        goto fail;
+    }
+    file_size = (size_t)st.st_size;
+    if (file_size < RLE_FILE_HEADER_SIZE) {
+        close(fd);
+        goto invalid;
+    }
+
+    map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    check(map != MAP_FAILED, "mmap failed");
+    close(fd);
+    InstrMemAccount((long)file_size);
+
+    // Parse header
+    uint32 version, width, height;
+    uint64 num_ints, checksum;
+    memcpy(&version, map + 4, 4);
+    memcpy(&width, map + 8, 4);
+    memcpy(&height, map + 12, 4);
+    memcpy(&num_ints, map + 16, 8);
+    memcpy(&checksum, map + 24, 8);
+    if (memcmp(map, RLE_FILE_MAGIC, 4) != 0 || version != RLE_FILE_VERSION)
+        goto invalid;
+    if (width == 0 || width > INT32_MAX || height == 0)
+        goto invalid;
+    // sem overflow: compara num_ints com o espaço que resta no ficheiro
+    uint64 offsets_size = (uint64)height * sizeof(uint64);
+    if (offsets_size > file_size - RLE_FILE_HEADER_SIZE)
+        goto invalid;
+    uint64 data_size = file_size - RLE_FILE_HEADER_SIZE - offsets_size;
+    if (num_ints == 0 || data_size % sizeof(int) != 0 ||
+        num_ints != data_size / sizeof(int))
+        goto invalid;
+
+    const uint64 *offset = (const uint64 *)(map + RLE_FILE_HEADER_SIZE);
+    int *data = (int *)(map + RLE_FILE_HEADER_SIZE + offsets_size);
+    size_t body_size = file_size - RLE_FILE_HEADER_SIZE;
+    if (Checksum((const uint32 *)offset, body_size / 4) != checksum ||
+        data[num_ints - 1] != EOR)
+        goto invalid;
+
+    img = AllocateImageHeader(width, height);
+    img->block = map;
+    img->block_size = file_size;
+    img->block_mapped = 1;
+    for (; i < height; i++) {
+        if (offset[i] >= num_ints - 1 ||
+            !ValidRLERow(data + offset[i], num_ints - offset[i], width))
+            goto invalid;
+        img->row[i] = data + offset[i];
+    }
+    GetOccupancy(img);
+    InstrTraceEnd("ImageLoadRLE");
+    return img;
+
+invalid:
+    errno = EINVAL;
+fail:
+    if (img != NULL) // o bloco é libertado com a imagem
+        DestroyPartialImage(img, i);
+    else if (map != NULL) {
+        munmap(map, file_size);
+        InstrMemAccount(-(long)file_size);
+    }
+    InstrTraceEnd("ImageLoadRLE");
+    return NULL;
+}
+
 /// Information queries
 
 /// Get image width
@@ -509,33 +1635,260 @@ int ImageHeight(const Image img) {
     return img->height;
 }
 
-/// Image comparison
+/// Get the bytes of memory used by an image:
+/// the header, the array of rows, the rows and the block, if any.
+/// (Rows inside the block are counted once, as part of the block.)
+size_t ImageMemoryUsage(const Image img) {
+    assert(img != NULL);
+    size_t total = InstrAllocSize(img) + InstrAllocSize(img->row);
+    for (uint32 i = 0; i < img->height; i++) {
+        if (!RowInBlock(img, img->row[i]))
+            total += InstrAllocSize(img->row[i]);
+    }
+    if (img->spare != NULL)
+        total += InstrAllocSize(img->spare);
+    if (img->constant != NULL)
+        total += InstrAllocSize(img->constant);
+    const Occupancy *occ = PeekOccupancy(img);
+    if (occ != NULL) {
+        total += InstrAllocSize(occ);
+        if (occ->blank != NULL)
+            total += InstrAllocSize(occ->blank);
+    }
+    return total + img->block_size;
+}
 
-int ImageIsEqual(const Image img1, const Image img2) {
-    assert(img1 != NULL && img2 != NULL);
+/// Get the bounding box of the BLACK pixels of an image:
+/// the columns [*x0, *x1[ and the rows [*y0, *y1[.
+/// Returns 0 (and an empty box, with all 0) if there are no BLACK pixels.
+int ImageBoundingBox(const Image img, uint32 *x0, uint32 *y0, uint32 *x1,
+                     uint32 *y1) {
+    assert(img != NULL);
+    assert(x0 != NULL && y0 != NULL && x1 != NULL && y1 != NULL);
+    const Occupancy *occ = GetOccupancy(img);
+    *x0 = occ->x0;
+    *y0 = occ->y0;
+    *x1 = occ->x1;
+    *y1 = occ->y1;
+    return occ->x1 > occ->x0;
+}
 
-    // verificar se dimensões das imagens são diferentes
-    if (img1->width != img2->width || img1->height != img2->height) {
-        return 0; // imagens diferentes
-    }
+/// Get the number of rows of an image without BLACK pixels.
+uint32 ImageBlankRows(const Image img) {
+    assert(img != NULL);
+    const Occupancy *occ = GetOccupancy(img);
+    uint32 count = 0;
+    for (uint32 k = 0; k < occ->nblank; k++)
+        count += occ->blank[k][1] - occ->blank[k][0];
+    return count;
+}
 
-    // itera pelas linhas (pixels em altura) das imagens
-    for (uint32 i = 0; i < img1->height; i++) {
-        // arrays das linhas codificadas de ambas as imagens
-        int *row1 = img1->row[i];
-        int *row2 = img2->row[i];
+/// Pixel counts and projection profiles
 
-        // verificar se tamanho dos arrays RLE das linhas é diferente
-        if (GetSizeRLERowArray(row1) != GetSizeRLERowArray(row2)) {
-            return 0; // diferentes
-        }
+// Todas estas funções percorrem apenas as runs das linhas RLE,
+// em paralelo por bandas de linhas.
 
-        // itera pelos elementos (pixels codificados) nas linhas até encontrar o
-        // marcador EOR (end of row)
-        for (uint32 j = 0; row1[j] != EOR; j++) {
-            if (row1[j] != row2[j]) {
-                return 0; // diferentes
+/// Number of BLACK pixels of a RLE row
+static uint32 CountBlackInRLERow(const int *RLE_row) {
+    uint32 count = 0;
+    int pixel_value = RLE_row[0];
+    for (uint32 j = 1; RLE_row[j] != EOR; j++) {
+        if (pixel_value == BLACK)
+            count += RLE_row[j];
+        pixel_value ^= 1;
+    }
+    return count;
+}
+
+typedef struct {
+    const Image img;
+    uint32 *counts;  // contagens por linha (ou NULL)
+    uint64 *partial; // contagem total de cada banda
+    uint32 y0;       // primeira linha com pixels pretos
+} RowCountArgs;
+
+static void RowCountBand(void *arg, uint32 band, uint32 first, uint32 last) {
+    RowCountArgs *a = arg;
+    uint64 total = 0;
+    for (uint32 i = a->y0 + first; i < a->y0 + last; i++) {
+        uint32 count = CountBlackInRLERow(a->img->row[i]);
+        if (a->counts != NULL)
+            a->counts[i] = count;
+        total += count;
+    }
+    a->partial[band] = total;
+}
+
+/// Count the BLACK pixels of an image.
+uint64 ImageCountBlack(const Image img) {
+    assert(img != NULL);
+
+    InstrTraceBegin("ImageCountBlack");
+    // só as linhas com pixels pretos (segundo o resumo de ocupação)
+    uint32 y0, y1;
+    ContentRows(img, &y0, &y1);
+    uint32 nbands = NumBands(y1 - y0);
+    uint64 partial[nbands];
+    RowCountArgs args = {img, NULL, partial, y0};
+    ParallelRows(y1 - y0, nbands, RowCountBand, &args);
+
+    uint64 total = 0;
+    for (uint32 b = 0; b < nbands; b++)
+        total += partial[b];
+    InstrTraceEnd("ImageCountBlack");
+    return total;
+}
+
+/// Count the BLACK pixels of each row of an image.
+/// Requires: counts has space for height elements.
+void ImageRowProfile(const Image img, uint32 counts[]) {
+    assert(img != NULL && counts != NULL);
+
+    InstrTraceBegin("ImageRowProfile");
+    uint32 y0, y1;
+    ContentRows(img, &y0, &y1);
+    memset(counts, 0, img->height * sizeof(uint32));
+    uint32 nbands = NumBands(y1 - y0);
+    uint64 partial[nbands];
+    RowCountArgs args = {img, counts, partial, y0};
+    ParallelRows(y1 - y0, nbands, RowCountBand, &args);
+    InstrTraceEnd("ImageRowProfile");
+}
+
+typedef struct {
+    const Image img;
+    int *diff; // um array de diferenças com (width + 1) elementos por banda
+    uint32 y0; // primeira linha com pixels pretos
+} ColumnCountArgs;
+
+static void ColumnCountBand(void *arg, uint32 band, uint32 first,
+                            uint32 last) {
+    ColumnCountArgs *a = arg;
+    int *diff = a->diff + (size_t)band * (a->img->width + 1);
+    memset(diff, 0, (a->img->width + 1) * sizeof(int));
+
+    // cada run preta [x, x+len) soma 1 em diff[x] e subtrai 1 em diff[x+len]
+    for (uint32 i = a->y0 + first; i < a->y0 + last; i++) {
+        const int *row = a->img->row[i];
+        int pixel_value = row[0];
+        uint32 x = 0;
+        for (uint32 j = 1; row[j] != EOR; j++) {
+            if (pixel_value == BLACK) {
+                diff[x]++;
+                diff[x + row[j]]--;
+            }
+            x += row[j];
+            pixel_value ^= 1;
+        }
+    }
+}
+
+/// Count the BLACK pixels of each column of an image.
+/// Requires: counts has space for width elements.
+void ImageColumnProfile(const Image img, uint32 counts[]) {
+    assert(img != NULL && counts != NULL);
+
+    InstrTraceBegin("ImageColumnProfile");
+    uint32 width = img->width;
+    uint32 y0, y1;
+    ContentRows(img, &y0, &y1);
+    uint32 nbands = NumBands(y1 - y0);
+    int *diff = InstrMalloc((size_t)nbands * (width + 1) * sizeof(int));
+    check(diff != NULL, "malloc");
+    ColumnCountArgs args = {img, diff, y0};
+    ParallelRows(y1 - y0, nbands, ColumnCountBand, &args);
+
+    // juntar as diferenças das bandas e fazer a soma acumulada
+    int sum = 0;
+    for (uint32 x = 0; x < width; x++) {
+        for (uint32 b = 0; b < nbands; b++)
+            sum += diff[(size_t)b * (width + 1) + x];
+        counts[x] = (uint32)sum;
+    }
+    InstrFree(diff);
+    InstrTraceEnd("ImageColumnProfile");
+}
+
+typedef struct {
+    const Image img;
+    int color;
+    uint32 nbins;
+    uint64 *hist; // um histograma com nbins elementos por banda
+} HistogramArgs;
+
+static void HistogramBand(void *arg, uint32 band, uint32 first, uint32 last) {
+    HistogramArgs *a = arg;
+    uint64 *hist = a->hist + (size_t)band * a->nbins;
+    memset(hist, 0, a->nbins * sizeof(uint64));
+
+    for (uint32 i = first; i < last; i++) {
+        const int *row = a->img->row[i];
+        int pixel_value = row[0];
+        for (uint32 j = 1; row[j] != EOR; j++) {
+            if (pixel_value == a->color) {
+                uint32 len = (uint32)row[j];
+                hist[(len < a->nbins) ? len : a->nbins - 1]++;
+            }
+            pixel_value ^= 1;
+        }
+    }
+}
+
+/// Histogram of the lengths of the runs of a given color.
+/// hist[len] counts the runs with len pixels,
+/// and hist[nbins-1] also counts all longer runs.
+/// Requires: nbins > 0 and hist has space for nbins elements.
+void ImageRunHistogram(const Image img, uint8 color, uint32 nbins,
+                       uint64 hist[]) {
+    assert(img != NULL && hist != NULL);
+    assert(color == WHITE || color == BLACK);
+    assert(nbins > 0);
+
+    InstrTraceBegin("ImageRunHistogram");
+    uint32 nbands = NumBands(img->height);
+    uint64 *band_hist = InstrMalloc((size_t)nbands * nbins * sizeof(uint64));
+    check(band_hist != NULL, "malloc");
+    HistogramArgs args = {img, color, nbins, band_hist};
+    ParallelRows(img->height, nbands, HistogramBand, &args);
+
+    for (uint32 l = 0; l < nbins; l++) {
+        hist[l] = 0;
+        for (uint32 b = 0; b < nbands; b++)
+            hist[l] += band_hist[(size_t)b * nbins + l];
+    }
+    InstrFree(band_hist);
+    InstrTraceEnd("ImageRunHistogram");
+}
+
+/// Image comparison
+
+int ImageIsEqual(const Image img1, const Image img2) {
+    assert(img1 != NULL && img2 != NULL);
+
+    // verificar se dimensões das imagens são diferentes
+    if (img1->width != img2->width || img1->height != img2->height) {
+        return 0; // imagens diferentes
+    }
+
+    // itera pelas linhas (pixels em altura) das imagens
+    for (uint32 i = 0; i < img1->height; i++) {
+        // arrays das linhas codificadas de ambas as imagens
+        int *row1 = img1->row[i];
+        int *row2 = img2->row[i];
+
+        // a mesma linha (partilhada) é igual a si própria
+        if (row1 == row2)
+            continue;
+
+        // itera pelos elementos (pixels codificados) nas linhas até encontrar o
+        // marcador EOR (end of row), parando na primeira diferença
+        // (uma linha com uma só run é decidida em 3 comparações)
+        for (uint32 j = 0;; j++) {
+            if (row1[j] != row2[j]) {
+                return 0; // diferentes
             }
+            if (row1[j] == EOR)
+                break;
         }
     }
 
@@ -561,6 +1914,7 @@ int ImageIsDifferent(const Image img1, const Image img2) {
 Image ImageNEG(const Image img) {
     assert(img != NULL);
 
+    InstrTraceBegin("ImageNEG");
     uint32 width = img->width;
     uint32 height = img->height;
 
@@ -570,13 +1924,12 @@ Image ImageNEG(const Image img) {
     // And changing the value of row[i][0]
 
     for (uint32 i = 0; i < height; i++) {
-        uint32 num_elems = GetSizeRLERowArray(img->row[i]);
-        newImage->row[i] = AllocateRLERowArray(num_elems);
-        memcpy(newImage->row[i], img->row[i], num_elems * sizeof(int));
-        newImage->row[i][0] ^=
-            1; // Just negate the value of the first pixel run
+        // Just negate the value of the first pixel run
+        // (Rows with a single run become the shared constant rows)
+        newImage->row[i] = CopyRowIn(newImage, img->row[i], 1);
     }
 
+    InstrTraceEnd("ImageNEG");
     return newImage;
 }
 
@@ -592,7 +1945,9 @@ Image ImageAND_Uncompressed(const Image img1, const Image img2) {
     // inicializar as linhas necessárias
     uint8 *row1;
     uint8 *row2;
-    uint8 *new_row = (uint8 *)malloc(sizeof(uint8) * width);
+    uint8 *new_row = (uint8 *)InstrMalloc(sizeof(uint8) * width);
+    int *temp_row = InstrMalloc((width + 2) * sizeof(int));
+    check(new_row != NULL && temp_row != NULL, "malloc");
     int *comp_row;
     InstrReset();
     for (int i = 0; i < height; i++) {
@@ -609,15 +1964,16 @@ Image ImageAND_Uncompressed(const Image img1, const Image img2) {
         }
 
         // comprimir para poder adicionar à nova imagem
-        comp_row = CompressRow(width, new_row);
+        comp_row = CompressRow(width, new_row, temp_row);
         new_image->row[i] = comp_row;
         PIXMEM += sizeof(new_image->row[i]);
         // liberta o espaço alocado para cada linha
-        free(row1);
-        free(row2);
+        InstrFree(row1);
+        InstrFree(row2);
     }
     PIXMEM += sizeof(new_image->row);
-    free(new_row);
+    InstrFree(new_row);
+    InstrFree(temp_row);
 
     // descomentar para dar os prints da tabela da função ANDTable()
     /*printf("|%19lu|%12d|%11d|\n", BOL_OPS, height, width);*/
@@ -638,7 +1994,7 @@ Image ImageAND_Without_Uncompress(const Image img1, const Image img2) {
     int run1 = 0, run2 = 0, min_run;
     int num_runs1 = 0;
     int num_runs2 = 0;
-    int *temp_row = (int *)malloc(
+    int *temp_row = (int *)InstrMalloc(
         sizeof(int) * (width + 2)); // run temporária com o tamanho do pior caso
 
     if (temp_row == NULL) {
@@ -649,7 +2005,29 @@ Image ImageAND_Without_Uncompress(const Image img1, const Image img2) {
     // reseta os contadores
     InstrReset();
 
+    // fora de [first, last[ uma das imagens está em branco
+    uint32 first, last;
+    OpRowRange(OP_AND, img1, img2, &first, &last);
+
     for (int i = 0; i < height; i++) {
+        if ((uint32)i < first || (uint32)i >= last) {
+            new_image->row[i] = ConstantRow(new_image, WHITE);
+            continue;
+        }
+
+        // atalho: se uma das linhas tem uma só run, o resultado é a linha
+        // branca ou uma cópia da outra linha, sem percorrer as runs
+        const int *other;
+        int shortcut =
+            SingleRunShortcut(OP_AND, img1->row[i], img2->row[i], &other);
+        if (shortcut == WHITE) {
+            new_image->row[i] = ConstantRow(new_image, WHITE);
+            continue;
+        }
+        if (shortcut == SHORTCUT_COPY) {
+            new_image->row[i] = CopyRowIn(new_image, other, 0);
+            continue;
+        }
 
         // inicializar as variáveis
         int size = 1;
@@ -701,8 +2079,14 @@ Image ImageAND_Without_Uncompress(const Image img1, const Image img2) {
 
         temp_row[size++] = -1;
 
+        // uma linha com uma só run é a linha constante partilhada
+        if (size == 3) {
+            new_image->row[i] = ConstantRow(new_image, temp_row[0]);
+            continue;
+        }
+
         // alocar apenas o espaço necessário
-        new_image->row[i] = (int *)malloc(sizeof(int) * size);
+        new_image->row[i] = (int *)InstrMalloc(sizeof(int) * size);
         if (new_image->row[i] == NULL) {
             printf("Error creating row\n");
             return NULL;
@@ -713,14 +2097,8 @@ Image ImageAND_Without_Uncompress(const Image img1, const Image img2) {
     }
 
     // calcular a memoria ocupada
-    RLEMEM += sizeof(new_image->row);
-    for (int i = 0; i < height; i++) {
-        RLEMEM += sizeof(new_image->row[i]);
-        int runs = GetSizeRLERowArray(new_image->row[i]);
-        for (int j = 0; j < runs; j++)
-            RLEMEM += sizeof(new_image->row[i][j]);
-    }
-    free(temp_row);
+    RLEMEM += ImageMemoryUsage(new_image);
+    InstrFree(temp_row);
 
     // descomentar para dar os prints da tabela da função ANDTable()
 
@@ -729,8 +2107,8 @@ Image ImageAND_Without_Uncompress(const Image img1, const Image img2) {
     /*       width);*/
 
     // tabela para o caso médio
-    printf("|%14lu|%11d|%11d|%8.3f|%7d|\n", BOL_OPS, num_runs1, num_runs2,
-           (double)num_runs2 / height, width);
+    /*printf("|%14lu|%11d|%11d|%8.3f|%7d|\n", BOL_OPS, num_runs1, num_runs2,*/
+    /*       (double)num_runs2 / height, width);*/
 
     return new_image;
 }
@@ -738,89 +2116,450 @@ Image ImageAND_Without_Uncompress(const Image img1, const Image img2) {
 Image ImageAND(const Image img1,
                const Image img2) { // Comentar a função que não se quer usar,
                                    // pois não podemos modificar o imageBW.h
-    /*return ImageAND_Uncompressed(img1, img2);*/
-    return ImageAND_Without_Uncompress(img1, img2);
+    InstrTraceBegin("ImageAND");
+    /*Image result = ImageAND_Uncompressed(img1, img2);*/
+    Image result = ImageAND_Without_Uncompress(img1, img2);
+    InstrTraceEnd("ImageAND");
+    return result;
 }
 
 Image ImageOR(const Image img1, const Image img2) {
     assert(img1 != NULL && img2 != NULL);
     assert(img1->height == img2->height && img1->width == img2->width);
 
-    // obter dimensões das imagens
-    uint32 width = img1->width;
-    uint32 height = img1->height;
+    InstrTraceBegin("ImageOR");
+    // percorre as runs das duas linhas, sem as descomprimir
+    Image result = ImageOp(OP_OR, img1, img2);
+    InstrTraceEnd("ImageOR");
+    return result;
+}
 
-    // criar uma nova imagem para armazenar o resultado
-    Image result = AllocateImageHeader(width, height);
+Image ImageXOR(Image img1, Image img2) {
+    assert(img1 != NULL && img2 != NULL);
+    check(img1->height == img2->height && img1->width == img2->width, "size");
 
-    // itera pelas linhas (altura)
-    for (uint32 i = 0; i < height; i++) {
-        // Descomprimir as linhas de ambas as imagens para arrays "raw_row1" e
-        // "raw_row2"
-        uint8 *raw_row1 = UncompressRow(width, img1->row[i]);
-        uint8 *raw_row2 = UncompressRow(width, img2->row[i]);
+    InstrTraceBegin("ImageXOR");
+    // percorre as runs das duas linhas, sem as descomprimir
+    Image result = ImageOp(OP_XOR, img1, img2);
+    InstrTraceEnd("ImageXOR");
+    return result;
+}
 
-        // aloca memória para armazenar a linha resultante da operação OR
-        uint8 *raw_result = malloc(width * sizeof(uint8));
-        check(raw_result != NULL, "malloc");
+/// In-place and destination variants
 
-        // iterar por cada pixel na linha descomprimida
-        for (uint8 j = 0; j < width; j++) {
-            // operação OR bit a bit entre os pixels correspondentes das imagens
-            // e armazena no array raw_result
-            raw_result[j] = raw_row1[j] | raw_row2[j];
+/// Negate an image, in place.
+/// Rows stored in the block of the image are copied before being changed.
+void ImageNEGInPlace(Image img) {
+    assert(img != NULL);
+
+    InstrTraceBegin("ImageNEGInPlace");
+    InvalidateOccupancy(img);
+    for (uint32 i = 0; i < img->height; i++) {
+        if (RowInBlock(img, img->row[i])) {
+            if (img->row[i][2] == EOR) {
+                // uma só run: passa a ser a linha constante da outra cor
+                img->row[i] = ConstantRow(img, img->row[i][0] ^ 1);
+                continue;
+            }
+            uint32 num_elems = GetSizeRLERowArray(img->row[i]);
+            int *row = AllocateRLERowArray(num_elems);
+            memcpy(row, img->row[i], num_elems * sizeof(int));
+            img->row[i] = row;
         }
+        img->row[i][0] ^= 1; // basta negar a cor da primeira run
+    }
+    InstrTraceEnd("ImageNEGInPlace");
+}
+
+void ImageANDInto(Image dst, const Image img1, const Image img2) {
+    InstrTraceBegin("ImageANDInto");
+    ImageOpInto(OP_AND, dst, img1, img2);
+    InstrTraceEnd("ImageANDInto");
+}
 
-        // comprime raw_result de novo para o formato RLE
-        result->row[i] = CompressRow(width, raw_result);
+void ImageORInto(Image dst, const Image img1, const Image img2) {
+    InstrTraceBegin("ImageORInto");
+    ImageOpInto(OP_OR, dst, img1, img2);
+    InstrTraceEnd("ImageORInto");
+}
+
+void ImageXORInto(Image dst, const Image img1, const Image img2) {
+    InstrTraceBegin("ImageXORInto");
+    ImageOpInto(OP_XOR, dst, img1, img2);
+    InstrTraceEnd("ImageXORInto");
+}
+
+/// Translation and compositing
+
+/// Copy the next n pixels of the cursor c to rb
+static void RunCursorCopy(RunCursor *c, int n, RowBuilder *rb) {
+    while (n > 0) {
+        int len = (c->left < n) ? c->left : n;
+        RowBuilderPush(rb, c->color, len);
+        RunCursorSkip(c, len);
+        n -= len;
+    }
+}
+
+/// Combine src into dst, with its top left corner at column x and row y.
+/// Each row of dst under src is rebuilt in one pass: its runs are copied
+/// up to the window, merged with the trimmed runs of src inside it, and
+/// copied after it.  The other rows of dst are not touched.
+void ImageBlit(Image dst, const Image src, int x, int y, uint8 op) {
+    assert(dst != NULL && src != NULL && dst != src);
+
+    InstrTraceBegin("ImageBlit");
+    // colunas [x0, x1[ e linhas [y0, y1[ de dst cobertas por src
+    int64_t x0 = (x > 0) ? x : 0;
+    int64_t y0 = (y > 0) ? y : 0;
+    int64_t x1 = (int64_t)x + src->width;
+    int64_t y1 = (int64_t)y + src->height;
+    if (x1 > dst->width)
+        x1 = dst->width;
+    if (y1 > dst->height)
+        y1 = dst->height;
+    if (x0 >= x1 || y0 >= y1) {
+        InstrTraceEnd("ImageBlit");
+        return;
+    }
 
-        // liberta a memória
-        free(raw_row1);
-        free(raw_row2);
-        free(raw_result);
+    InvalidateOccupancy(dst);
+    int *temp_row = InstrMalloc((dst->width + 2) * sizeof(int));
+    check(temp_row != NULL, "malloc");
+    for (int64_t i = y0; i < y1; i++) {
+        const int *src_row = src->row[i - y];
+        // linha de src com uma só run que deixa dst igual
+        if (src_row[2] == EOR && ((op >> src_row[0]) & 1) == WHITE &&
+            ((op >> (2 + src_row[0])) & 1) == BLACK)
+            continue;
+
+        RunCursor c;
+        RunCursorInit(&c, dst->row[i]);
+        WindowCursor w;
+        WindowCursorInit(&w, src_row, (uint32)(x0 - x), (uint32)(x1 - x0));
+        RowBuilder rb;
+        RowBuilderInit(&rb, temp_row);
+        RunCursorCopy(&c, (int)x0, &rb);
+        while (w.left > 0) {
+            int len = (c.left < w.left) ? c.left : w.left;
+            RowBuilderPush(&rb, (op >> (2 * c.color + w.color)) & 1, len);
+            BOL_OPS++;
+            RunCursorSkip(&c, len);
+            WindowCursorSkip(&w, len);
+        }
+        RunCursorCopy(&c, (int)(dst->width - x1), &rb);
+        rb.buf[rb.size++] = EOR;
+
+        // linha dentro do bloco (ou constante): não pode ser alterada,
+        // é substituída (copy-on-write)
+        int *row = RowInBlock(dst, dst->row[i]) ? NULL : dst->row[i];
+        if (row == NULL && rb.size == 3) {
+            dst->row[i] = ConstantRow(dst, rb.buf[0]);
+        } else {
+            dst->row[i] = ReuseRLERowArray(row, rb.size);
+            memcpy(dst->row[i], rb.buf, rb.size * sizeof(int));
+        }
     }
+    InstrFree(temp_row);
+    InstrTraceEnd("ImageBlit");
+}
+
+/// Translate an image by dx columns and dy rows.
+/// The image is blitted onto a WHITE one, so only its runs are visited.
+Image ImageTranslate(const Image img, int dx, int dy) {
+    assert(img != NULL);
 
+    InstrTraceBegin("ImageTranslate");
+    Image result = ImageCreate(img->width, img->height, WHITE);
+    ImageBlit(result, img, dx, dy, OP_COPY);
+    InstrTraceEnd("ImageTranslate");
     return result;
 }
 
-Image ImageXOR(Image img1, Image img2) {
-    assert(img1 != NULL && img2 != NULL);
-    check(img1->height == img2->height && img1->width == img2->width, "size");
-    // COMPLETE THE CODE
-    // You might consider using the UncompressRow and CompressRow auxiliary
-    // files Or devise a more efficient alternative
+/// Reductions of many images
+
+typedef struct {
+    const Image *imgs;
+    uint32 n;
+    const uint8 *table; // tabela de verdade (ou NULL, para AND/OR/XOR)
+    Image result;
+} ReduceArgs;
+
+/// Color of a segment of the result, given the count and mask of the sweep.
+/// op is OP_AND, OP_OR, OP_XOR or 0 (use the truth table).
+static inline int ReduceColor(uint8 op, const ReduceArgs *a, uint32 count,
+                              uint32 mask) {
+    switch (op) {
+    case OP_AND:
+        return count == a->n;
+    case OP_OR:
+        return count > 0;
+    case OP_XOR:
+        return count & 1;
+    default:
+        return (a->table[mask >> 3] >> (mask & 7)) & 1;
+    }
+}
 
-    int width = ImageWidth(img1);
-    int height = ImageHeight(img1);
+/// Reduce the rows [first, last).
+/// Being inline, with a constant op, each operation gets its own loop.
+static inline void ReduceRows(uint8 op, const ReduceArgs *a, uint32 first,
+                              uint32 last) {
+    uint32 n = a->n;
+    const int **rows = InstrMalloc(n * sizeof(int *));
+    int *temp_row = InstrMalloc((a->result->width + 2) * sizeof(int));
+    check(rows != NULL && temp_row != NULL, "malloc");
+    RowSweep sw;
+    RowSweepInit(&sw, n);
+
+    for (uint32 i = first; i < last; i++) {
+        for (uint32 r = 0; r < n; r++)
+            rows[r] = a->imgs[r]->row[i];
+        RowSweepStart(&sw, rows, n);
+
+        RowBuilder rb;
+        RowBuilderInit(&rb, temp_row);
+        uint32 count, mask;
+        int len;
+        while ((len = RowSweepNext(&sw, &count, &mask)) > 0)
+            RowBuilderPush(&rb, ReduceColor(op, a, count, mask), len);
+        a->result->row[i] = RowBuilderFinishIn(&rb, a->result);
+    }
 
-    // inicializar as linhas necessárias
-    uint8 *row1;
-    uint8 *row2;
-    uint8 *new_row = (uint8 *)malloc(sizeof(uint8) * width);
-    int *comp_row;
+    RowSweepClose(&sw);
+    InstrFree(temp_row);
+    InstrFree(rows);
+}
 
-    Image new_image = AllocateImageHeader(width, height);
-    for (int i = 0; i < height; i++) {
-        // descomprimir as linhas para poder iterar pelos pixeis dessa linha
-        row1 = UncompressRow(width, img1->row[i]);
-        row2 = UncompressRow(width, img2->row[i]);
+static void ReduceANDBand(void *arg, uint32 band, uint32 first, uint32 last) {
+    (void)band;
+    ReduceRows(OP_AND, arg, first, last);
+}
 
-        // O pixel da nova imagem fica com valor = 1 se ambos os valores
-        // forem 1, caso contrário fica com valor = 0
-        for (int j = 0; j < width; j++) {
-            new_row[j] = (row1[j] ^ row2[j]);
-        }
+static void ReduceORBand(void *arg, uint32 band, uint32 first, uint32 last) {
+    (void)band;
+    ReduceRows(OP_OR, arg, first, last);
+}
 
-        // comprimir para poder adicionar à nova imagem
-        comp_row = CompressRow(width, new_row);
-        new_image->row[i] = comp_row;
+static void ReduceXORBand(void *arg, uint32 band, uint32 first, uint32 last) {
+    (void)band;
+    ReduceRows(OP_XOR, arg, first, last);
+}
 
-        // liberta o espaço alocado para cada linha
-        free(row1);
-        free(row2);
+static void ReduceTableBand(void *arg, uint32 band, uint32 first,
+                            uint32 last) {
+    (void)band;
+    ReduceRows(0, arg, first, last);
+}
+
+/// Apply a boolean operation (OP_AND, OP_OR, OP_XOR, or 0 for the truth
+/// table) to n images at once
+static Image ImageReduce(uint8 op, const Image imgs[], uint32 n,
+                         const uint8 *table) {
+    assert(imgs != NULL && n > 0);
+    for (uint32 r = 0; r < n; r++) {
+        assert(imgs[r] != NULL);
+        check(imgs[r]->width == imgs[0]->width &&
+                  imgs[r]->height == imgs[0]->height,
+              "size");
     }
-    free(new_row);
-    return new_image;
+
+    Image result = AllocateImageHeader(imgs[0]->width, imgs[0]->height);
+    ConstantRow(result, WHITE); // alocada antes das bandas
+    ReduceArgs args = {imgs, n, table, result};
+    BandFunc fn = (op == OP_AND)   ? ReduceANDBand
+                  : (op == OP_OR)  ? ReduceORBand
+                  : (op == OP_XOR) ? ReduceXORBand
+                                   : ReduceTableBand;
+    ParallelRows(result->height, NumBands(result->height), fn, &args);
+    return result;
+}
+
+Image ImageANDMany(const Image imgs[], uint32 n) {
+    InstrTraceBegin("ImageANDMany");
+    Image result = ImageReduce(OP_AND, imgs, n, NULL);
+    InstrTraceEnd("ImageANDMany");
+    return result;
+}
+
+Image ImageORMany(const Image imgs[], uint32 n) {
+    InstrTraceBegin("ImageORMany");
+    Image result = ImageReduce(OP_OR, imgs, n, NULL);
+    InstrTraceEnd("ImageORMany");
+    return result;
+}
+
+Image ImageXORMany(const Image imgs[], uint32 n) {
+    InstrTraceBegin("ImageXORMany");
+    Image result = ImageReduce(OP_XOR, imgs, n, NULL);
+    InstrTraceEnd("ImageXORMany");
+    return result;
+}
+
+/// Boolean functions of many images
+
+// Uma expressão é compilada para a sua tabela de verdade: cada subexpressão
+// é avaliada de uma só vez para todas as combinações de cores das imagens,
+// guardadas num conjunto de 256 bits (bit i = valor para as cores i).
+
+typedef struct {
+    uint64 w[4];
+} TruthTable;
+
+typedef struct {
+    const char *p; // próximo carácter da expressão
+    uint32 n;      // número de imagens
+    int ok;        // a expressão é válida (até agora)?
+} ExprParser;
+
+static TruthTable ExprOr(ExprParser *ps);
+
+static char ExprPeek(ExprParser *ps) {
+    while (isspace((unsigned char)*ps->p))
+        ps->p++;
+    return *ps->p;
+}
+
+/// Truth table of image number r (A = 0, B = 1, ...)
+static TruthTable ExprVariable(uint32 n, uint32 r) {
+    TruthTable t = {{0, 0, 0, 0}};
+    for (uint32 i = 0; i < 256; i++)
+        if ((i >> (n - 1 - r)) & 1)
+            t.w[i / 64] |= (uint64)1 << (i % 64);
+    return t;
+}
+
+static TruthTable ExprUnary(ExprParser *ps) {
+    TruthTable t = {{0, 0, 0, 0}};
+    char c = ExprPeek(ps);
+    ps->p++;
+    if (c == '~' || c == '!') {
+        t = ExprUnary(ps);
+        for (int j = 0; j < 4; j++)
+            t.w[j] = ~t.w[j];
+    } else if (c == '(') {
+        t = ExprOr(ps);
+        if (ExprPeek(ps) == ')')
+            ps->p++;
+        else
+            ps->ok = 0;
+    } else if (c >= 'A' && (uint32)(c - 'A') < ps->n) {
+        t = ExprVariable(ps->n, (uint32)(c - 'A'));
+    } else if (c == '1') {
+        for (int j = 0; j < 4; j++)
+            t.w[j] = ~(uint64)0;
+    } else if (c != '0') {
+        ps->ok = 0;
+        ps->p--; // não passar do fim da expressão
+    }
+    return t;
+}
+
+static TruthTable ExprAnd(ExprParser *ps) {
+    TruthTable t = ExprUnary(ps);
+    while (ps->ok && ExprPeek(ps) == '&') {
+        ps->p++;
+        TruthTable u = ExprUnary(ps);
+        for (int j = 0; j < 4; j++)
+            t.w[j] &= u.w[j];
+    }
+    return t;
+}
+
+static TruthTable ExprXor(ExprParser *ps) {
+    TruthTable t = ExprAnd(ps);
+    while (ps->ok && ExprPeek(ps) == '^') {
+        ps->p++;
+        TruthTable u = ExprAnd(ps);
+        for (int j = 0; j < 4; j++)
+            t.w[j] ^= u.w[j];
+    }
+    return t;
+}
+
+static TruthTable ExprOr(ExprParser *ps) {
+    TruthTable t = ExprXor(ps);
+    while (ps->ok && ExprPeek(ps) == '|') {
+        ps->p++;
+        TruthTable u = ExprXor(ps);
+        for (int j = 0; j < 4; j++)
+            t.w[j] |= u.w[j];
+    }
+    return t;
+}
+
+/// Compile a boolean expression over n images to its truth table.
+/// Returns 1 on success, or 0 if the expression is invalid.
+int ImageCompileExpression(const char *expr, uint32 n, uint8 table[]) {
+    assert(expr != NULL && table != NULL);
+    assert(n >= 1 && n <= 8);
+
+    ExprParser ps = {expr, n, 1};
+    TruthTable t = ExprOr(&ps);
+    if (!ps.ok || ExprPeek(&ps) != '\0')
+        return 0;
+    for (uint32 i = 0; i < 32; i++)
+        table[i] = (uint8)(t.w[i / 8] >> (8 * (i % 8)));
+    return 1;
+}
+
+/// Does the truth table of a function of n images match the function f?
+/// (f gives the color for the number of BLACK inputs.)
+static int TableMatches(const uint8 table[], uint32 n,
+                        int (*f)(uint32, uint32)) {
+    for (uint32 i = 0; i < (1u << n); i++) {
+        uint32 count = (uint32)__builtin_popcount(i);
+        if (((table[i >> 3] >> (i & 7)) & 1) != f(count, n))
+            return 0;
+    }
+    return 1;
+}
+
+static int AllBlack(uint32 count, uint32 n) { return count == n; }
+
+static int AnyBlack(uint32 count, uint32 n) {
+    (void)n;
+    return count > 0;
+}
+
+static int OddBlack(uint32 count, uint32 n) {
+    (void)n;
+    return count & 1;
+}
+
+/// Apply the boolean function with the given truth table to n images.
+/// Common functions are dispatched to specialised loops:
+/// functions of 1 or 2 images to the two-row merge, and AND, OR and XOR
+/// of all images to the reductions.
+Image ImageApplyTable(const Image imgs[], uint32 n, const uint8 table[]) {
+    assert(imgs != NULL && table != NULL);
+    assert(n >= 1 && n <= 8);
+
+    InstrTraceBegin("ImageApplyTable");
+    Image result;
+    if (n <= 2) {
+        // tabela de 4 bits, indexada por 2 * cor1 + cor2
+        uint8 op = (n == 2) ? (table[0] & 0xF)
+                            : (uint8)((table[0] & 1) | ((table[0] & 2) << 2));
+        result = ImageOp(op, imgs[0], imgs[n - 1]);
+    } else if (TableMatches(table, n, AllBlack)) {
+        result = ImageReduce(OP_AND, imgs, n, NULL);
+    } else if (TableMatches(table, n, AnyBlack)) {
+        result = ImageReduce(OP_OR, imgs, n, NULL);
+    } else if (TableMatches(table, n, OddBlack)) {
+        result = ImageReduce(OP_XOR, imgs, n, NULL);
+    } else {
+        result = ImageReduce(0, imgs, n, table);
+    }
+    InstrTraceEnd("ImageApplyTable");
+    return result;
+}
+
+/// Evaluate a boolean expression over n images.
+Image ImageEvaluate(const char *expr, const Image imgs[], uint32 n) {
+    uint8 table[32];
+    check(ImageCompileExpression(expr, n, table), "Invalid expression");
+    return ImageApplyTable(imgs, n, table);
 }
 
 /// Geometric transformations
@@ -840,25 +2579,31 @@ Image ImageXOR(Image img1, Image img2) {
 Image ImageHorizontalMirror(const Image img) {
     assert(img != NULL);
 
+    InstrTraceBegin("ImageHorizontalMirror");
     uint32 width = img->width;
     uint32 height = img->height;
 
     Image newImage = AllocateImageHeader(width, height);
 
+    // linhas fora de [y0, y1[ estão em branco
+    uint32 y0, y1;
+    ContentRows(img, &y0, &y1);
+
     for (uint32 i = 0; i < height; i++) {
         // index da linha corresponde à linha i da imagem invertida na imagem
         // normal
-        int index = height - 1 - i;
-        int size = GetSizeRLERowArray(img->row[index]);
-        newImage->row[i] = AllocateRLERowArray(size);
+        uint32 index = height - 1 - i;
+        if (index < y0 || index >= y1) {
+            newImage->row[i] = ConstantRow(newImage, WHITE);
+            continue;
+        }
 
         // copia a linha da imagem original para a linha da imagem
-        // invertida
-        for (int j = 0; j < size; j++) {
-            newImage->row[i][j] = img->row[index][j];
-        }
+        // invertida (as linhas uniformes são partilhadas)
+        newImage->row[i] = CopyRowIn(newImage, img->row[index], 0);
     }
 
+    InstrTraceEnd("ImageHorizontalMirror");
     return newImage;
 }
 
@@ -871,34 +2616,266 @@ Image ImageHorizontalMirror(const Image img) {
 Image ImageVerticalMirror(const Image img) {
     assert(img != NULL);
 
+    InstrTraceBegin("ImageVerticalMirror");
     uint32 width = img->width;
     uint32 height = img->height;
 
     Image newImage = AllocateImageHeader(width, height);
 
+    // linhas fora de [y0, y1[ estão em branco
+    uint32 y0, y1;
+    ContentRows(img, &y0, &y1);
+
     // itera sobre cada linha da imagem original
     for (uint32 i = 0; i < height; i++) {
-        // descomprimir a linha
-        uint8 *raw_row = UncompressRow(width, img->row[i]);
+        const int *row = img->row[i];
+        if (i < y0 || i >= y1 || row[2] == EOR) {
+            // linha uniforme: a linha espelhada é igual
+            newImage->row[i] = (i < y0 || i >= y1)
+                                   ? ConstantRow(newImage, WHITE)
+                                   : ConstantRow(newImage, row[0]);
+            continue;
+        }
+
+        // espelhar a linha invertendo a ordem das runs, sem a descomprimir:
+        // a primeira run passa a ser a última
+        uint32 size = GetSizeRLERowArray(row);
+        uint32 num_runs = size - 2;
+        int *mirror_row = AllocateRLERowArray(size);
+        mirror_row[0] = row[0] ^ !(num_runs & 1); // cor da última run
+        for (uint32 j = 1; j <= num_runs; j++)
+            mirror_row[j] = row[num_runs + 1 - j];
+        mirror_row[size - 1] = EOR;
+        newImage->row[i] = mirror_row;
+    }
+
+    InstrTraceEnd("ImageVerticalMirror");
+    return newImage;
+}
+
+/// Concatenation and tiling
+
+// The rows of a concatenation are built in a single block of memory,
+// sized exactly beforehand: a first pass counts the elements of each new
+// row, and a second one fills them in, merging the runs of the same color
+// that meet at the boundaries between images.  Rows that repeat (rows
+// made of the same rows of the operands, or copies of a tile) are stored
+// once in the block, and uniform rows are the shared constant rows.
+
+#define CONCAT_CONSTANT SIZE_MAX // a linha é uma das linhas constantes
+
+/// Number of elements of the RLE row made of rows[0..k-1], side by side
+static uint32 ConcatRowsSize(const int *const rows[], uint32 k) {
+    uint32 size = 2; // cor da primeira run e EOR
+    int last = -1;   // cor da última run até aqui
+    for (uint32 j = 0; j < k; j++) {
+        uint32 num_runs = GetNumRunsInRLERow(rows[j]);
+        size += num_runs - (rows[j][0] == last);
+        last = rows[j][0] ^ !(num_runs & 1);
+    }
+    return size;
+}
+
+/// Write the RLE row made of rows[0..k-1], side by side, to out,
+/// merging the runs of the same color at the boundaries.
+/// Requires: out has space for ConcatRowsSize(rows, k) elements.
+static void ConcatRows(const int *const rows[], uint32 k, int *out) {
+    uint32 n = 1;
+    int last = -1;
+    out[0] = rows[0][0];
+    for (uint32 j = 0; j < k; j++) {
+        const int *row = rows[j];
+        uint32 r = 1;
+        if (row[0] == last)
+            out[n - 1] += row[r++]; // junta-se à última run
+        while (row[r] != EOR)
+            out[n++] = row[r++];
+        last = row[0] ^ !((r - 1) & 1);
+    }
+    out[n] = EOR;
+}
+
+/// Allocate the block of an image with space for n elements (if n > 0)
+static int *AllocateRowBlock(Image img, size_t n) {
+    if (n == 0)
+        return NULL;
+    int *block = InstrMalloc(n * sizeof(int));
+    check(block != NULL, "malloc");
+    img->block = block;
+    img->block_size = n * sizeof(int);
+    return block;
+}
 
-        // alocar memória para a imagem espelhada
-        uint8 *mirror_row = malloc(width * sizeof(uint8));
-        check(mirror_row != NULL, "malloc");
+/// Put k images side by side, and stack ny copies of the result.
+static Image ConcatRightRepeat(const Image imgs[], uint32 k, uint32 ny) {
+    assert(imgs != NULL && k > 0 && ny > 0);
+    uint32 height = imgs[0]->height;
+    uint64 width = 0;
+    for (uint32 j = 0; j < k; j++) {
+        assert(imgs[j] != NULL);
+        check(imgs[j]->height == height, "size");
+        width += imgs[j]->width;
+    }
+    check(width <= INT32_MAX && (uint64)height * ny <= UINT32_MAX, "size");
+
+    Image result = AllocateImageHeader((uint32)width, height * ny);
+    const int **rows = InstrMalloc(k * sizeof(int *));
+    size_t *offset = InstrMalloc(height * sizeof(size_t));
+    check(rows != NULL && offset != NULL, "malloc");
+
+    // 1ª passagem: posição de cada linha no bloco
+    size_t total = 0;
+    for (uint32 i = 0; i < height; i++) {
+        // feita das mesmas linhas que a anterior: é partilhada
+        uint32 j = 0;
+        while (i > 0 && j < k && imgs[j]->row[i] == imgs[j]->row[i - 1])
+            j++;
+        if (i > 0 && j == k) {
+            offset[i] = offset[i - 1];
+            continue;
+        }
+        for (j = 0; j < k; j++)
+            rows[j] = imgs[j]->row[i];
+        uint32 size = ConcatRowsSize(rows, k);
+        if (size == 3) {
+            offset[i] = CONCAT_CONSTANT;
+        } else {
+            offset[i] = total;
+            total += size;
+        }
+    }
 
-        // espelhar a linha copiando os pixels na ordem inversa
-        for (uint32 j = 0; j < width; j++) {
-            mirror_row[j] = raw_row[width - 1 - j];
+    // 2ª passagem: construir as linhas
+    int *block = AllocateRowBlock(result, total);
+    for (uint32 i = 0; i < height; i++) {
+        if (offset[i] == CONCAT_CONSTANT) {
+            result->row[i] = ConstantRow(result, imgs[0]->row[i][0]);
+        } else if (i > 0 && offset[i] == offset[i - 1]) {
+            result->row[i] = result->row[i - 1];
+        } else {
+            for (uint32 j = 0; j < k; j++)
+                rows[j] = imgs[j]->row[i];
+            result->row[i] = block + offset[i];
+            ConcatRows(rows, k, result->row[i]);
         }
+    }
+    // as outras cópias partilham as mesmas linhas
+    for (uint32 t = 1; t < ny; t++)
+        memcpy(result->row + (size_t)t * height, result->row,
+               height * sizeof(int *));
+
+    InstrFree(offset);
+    InstrFree(rows);
+    return result;
+}
 
-        // comprime a linha espelhada e adiciona à nova imagem
-        newImage->row[i] = CompressRow(width, mirror_row);
+/// Put k images side by side, from left to right.
+/// Requires: k > 0 and the heights of the images must be the same.
+/// Ensures: The original images are not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageConcatRight(const Image imgs[], uint32 k) {
+    InstrTraceBegin("ImageConcatRight");
+    Image result = ConcatRightRepeat(imgs, k, 1);
+    InstrTraceEnd("ImageConcatRight");
+    return result;
+}
 
-        // libertar a memória
-        free(raw_row);
-        free(mirror_row);
+/// Stack k images, from top to bottom.
+/// Requires: k > 0 and the widths of the images must be the same.
+/// Ensures: The original images are not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageConcatBottom(const Image imgs[], uint32 k) {
+    assert(imgs != NULL && k > 0);
+    uint32 width = imgs[0]->width;
+    uint64 height = 0;
+    for (uint32 j = 0; j < k; j++) {
+        assert(imgs[j] != NULL);
+        check(imgs[j]->width == width, "size");
+        height += imgs[j]->height;
+    }
+    check(height <= UINT32_MAX, "size");
+
+    InstrTraceBegin("ImageConcatBottom");
+    Image result = AllocateImageHeader(width, (uint32)height);
+    size_t *offset = InstrMalloc(height * sizeof(size_t));
+    uint32 *first = InstrMalloc(k * sizeof(uint32));
+    check(offset != NULL && first != NULL, "malloc");
+
+    // 1ª passagem: posição de cada linha no bloco
+    size_t total = 0;
+    uint32 o = 0; // linha do resultado
+    for (uint32 j = 0; j < k; j++) {
+        const Image img = imgs[j];
+        first[j] = o;
+        // imagem repetida: partilha as linhas da sua primeira ocorrência
+        uint32 prev = 0;
+        while (imgs[prev] != img)
+            prev++;
+        for (uint32 i = 0; i < img->height; i++, o++) {
+            const int *row = img->row[i];
+            if (prev < j)
+                offset[o] = offset[first[prev] + i];
+            else if (row[2] == EOR)
+                offset[o] = CONCAT_CONSTANT;
+            else if (i > 0 && row == img->row[i - 1])
+                offset[o] = offset[o - 1];
+            else {
+                offset[o] = total;
+                total += GetSizeRLERowArray(row);
+            }
+        }
     }
 
-    return newImage;
+    // 2ª passagem: copiar as linhas (só as que não são partilhadas)
+    int *block = AllocateRowBlock(result, total);
+    o = 0;
+    for (uint32 j = 0; j < k; j++) {
+        const Image img = imgs[j];
+        uint32 prev = 0;
+        while (imgs[prev] != img)
+            prev++;
+        for (uint32 i = 0; i < img->height; i++, o++) {
+            const int *row = img->row[i];
+            if (offset[o] == CONCAT_CONSTANT) {
+                result->row[o] = ConstantRow(result, row[0]);
+                continue;
+            }
+            result->row[o] = block + offset[o];
+            if (prev == j && (i == 0 || row != img->row[i - 1]))
+                memcpy(result->row[o], row,
+                       GetSizeRLERowArray(row) * sizeof(int));
+        }
+    }
+
+    InstrFree(first);
+    InstrFree(offset);
+    InstrTraceEnd("ImageConcatBottom");
+    return result;
+}
+
+/// Tile an image: nx copies side by side, and ny such rows of copies.
+/// Each row of the result is built once and shared by the ny copies.
+/// Requires: nx > 0 and ny > 0.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageTile(const Image img, uint32 nx, uint32 ny) {
+    assert(img != NULL && nx > 0 && ny > 0);
+
+    InstrTraceBegin("ImageTile");
+    Image *imgs = InstrMalloc(nx * sizeof(Image));
+    check(imgs != NULL, "malloc");
+    for (uint32 j = 0; j < nx; j++)
+        imgs[j] = img;
+    Image result = ConcatRightRepeat(imgs, nx, ny);
+    InstrFree(imgs);
+    InstrTraceEnd("ImageTile");
+    return result;
 }
 
 /// Replicate img2 at the bottom of imag1, creating a larger image
@@ -912,34 +2889,8 @@ Image ImageReplicateAtBottom(const Image img1, const Image img2) {
     assert(img1 != NULL && img2 != NULL);
     assert(img1->width == img2->width);
 
-    uint32 new_width = img1->width;
-    uint32 new_height = img1->height + img2->height;
-
-    Image newImage = AllocateImageHeader(new_width, new_height);
-
-    uint32 height1 = img1->height;
-    int size;
-    for (uint32 i = 0; i < new_height; i++) {
-        // verifica se a linha i faz parte da img1 ou da img2
-        if (i < height1) {
-
-            size = GetSizeRLERowArray(img1->row[i]);
-            newImage->row[i] = AllocateRLERowArray(size);
-            // copia a linha da img1 para a nova imagem
-            for (int j = 0; j < size; j++)
-                newImage->row[i][j] = img1->row[i][j];
-
-        } else {
-
-            size = GetSizeRLERowArray(img2->row[i - height1]);
-            newImage->row[i] = AllocateRLERowArray(size);
-            // copia a linha da img2 para a nova imagem
-            for (int j = 0; j < size; j++)
-                newImage->row[i][j] = img2->row[i - height1][j];
-        }
-    }
-
-    return newImage;
+    const Image imgs[2] = {img1, img2};
+    return ImageConcatBottom(imgs, 2);
 }
 
 /// Replicate img2 to the right of imag1, creating a larger image
@@ -953,66 +2904,1659 @@ Image ImageReplicateAtRight(const Image img1, const Image img2) {
     assert(img1 != NULL && img2 != NULL);
     assert(img1->height == img2->height);
 
-    uint32 new_width = img1->width + img2->width;
-    uint32 new_height = img1->height;
-
-    Image newImage = AllocateImageHeader(new_width, new_height);
+    const Image imgs[2] = {img1, img2};
+    return ImageConcatRight(imgs, 2);
+}
 
-    for (uint32 i = 0; i < new_height; i++) {
-        int *rle_row1 = img1->row[i];
-        int *rle_row2 = img2->row[i];
+/// Resolution changes
+
+/// Value of an output pixel covering `area` input pixels, `mass` of them BLACK
+static int PoolValue(uint8 mode, uint64_t mass, uint64_t area) {
+    switch (mode) {
+    case POOL_OR:
+        return mass > 0;
+    case POOL_AND:
+        return mass == area;
+    default: // POOL_MAJORITY (empates ficam brancos)
+        return 2 * mass > area;
+    }
+}
 
-        uint32 num_runs1 = GetNumRunsInRLERow(rle_row1);
-        uint32 num_runs2 = GetNumRunsInRLERow(rle_row2);
+/// Downscale an image by an integer factor.
+/// Each output pixel pools a (factor x factor) block of input pixels
+/// (smaller blocks at the right and bottom edges, if the sizes are not
+/// multiples of factor).
+///   mode: POOL_OR (any BLACK), POOL_AND (all BLACK) or
+///         POOL_MAJORITY (more than half BLACK).
+/// Requires: factor > 0.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageDownscale(const Image img, uint32 factor, uint8 mode) {
+    assert(img != NULL);
+    assert(factor > 0);
+    assert(mode == POOL_OR || mode == POOL_AND || mode == POOL_MAJORITY);
 
-        int initial_pixel1 = rle_row1[0];
-        int initial_pixel2 = rle_row2[0];
+    InstrTraceBegin("ImageDownscale");
+    uint32 width = img->width;
+    uint32 height = img->height;
+    // em 64 bits: width + factor - 1 pode não caber em uint32
+    uint32 new_width = (uint32)(((uint64)width + factor - 1) / factor);
+    uint32 new_height = (uint32)(((uint64)height + factor - 1) / factor);
 
-        int last_pixel1 =
-            (num_runs1 % 2 == 1) ? initial_pixel1 : !initial_pixel1;
-        // se ímpar -> last_pixel1 = inicial_pixel1
-        // se par -> last_pixel1 = contrário do inicial_pixel1
+    Image newImage = AllocateImageHeader(new_width, new_height);
+
+    // cada linha de saída junta no máximo min(factor, height) linhas
+    RowSweep sw;
+    RowSweepInit(&sw, (factor < height) ? factor : height);
+    int *temp_row = InstrMalloc((new_width + 2) * sizeof(int));
+    check(temp_row != NULL, "malloc");
+
+    for (uint32 oy = 0; oy < new_height; oy++) {
+        // as k linhas da imagem original que dão origem à linha oy
+        uint32 first = oy * factor;
+        uint32 k = (height - first < factor) ? height - first : factor;
+        RowSweepStart(&sw, (const int *const *)&img->row[first], k);
+
+        RowBuilder rb;
+        RowBuilderInit(&rb, temp_row);
+
+        uint32 x = 0;         // posição atual na linha original
+        uint32 bx = 0;        // bloco (pixel de saída) atual
+        uint64_t mass = 0;    // pixels pretos já vistos no bloco atual
+        while (x < width) {
+            // segmento em que nenhuma das k linhas muda de cor
+            uint32 count;
+            int len = RowSweepNext(&sw, &count, NULL);
+
+            // distribuir o segmento [x, x+len) pelos blocos de saída
+            uint32 end = x + len;
+            while (x < end) {
+                uint32 bstart = bx * factor;
+                uint32 bend = ((uint64)bstart + factor < width)
+                                  ? bstart + factor
+                                  : width;
+                if (x == bstart && end >= bend) {
+                    // blocos completos com o mesmo count: emitidos de uma vez
+                    uint32 nblocks =
+                        (end == width) ? new_width - bx : (end - x) / factor;
+                    RowBuilderPush(&rb, PoolValue(mode, count, k), nblocks);
+                    bx += nblocks;
+                    x = ((uint64)bx * factor < width) ? bx * factor : width;
+                } else {
+                    uint32 stop = (end < bend) ? end : bend;
+                    mass += (uint64_t)count * (stop - x);
+                    x = stop;
+                    if (x == bend) {
+                        uint64_t area = (uint64_t)(bend - bstart) * k;
+                        RowBuilderPush(&rb, PoolValue(mode, mass, area), 1);
+                        mass = 0;
+                        bx++;
+                    }
+                }
+            }
+        }
+        newImage->row[oy] = RowBuilderFinishIn(&rb, newImage);
+    }
+
+    InstrFree(temp_row);
+    RowSweepClose(&sw);
+    InstrTraceEnd("ImageDownscale");
+    return newImage;
+}
 
-        int merge_runs = (last_pixel1 ==
-                          initial_pixel2); // ver se a segunda imagem começa com
-                                           // a mesma "cor" que acaba a primeira
+/// Build an image pyramid with the given number of levels.
+/// pyramid[0] is img downscaled by 2, pyramid[1] by 4, and so on;
+/// each level is computed from the previous one, so the total cost
+/// is dominated by the first level.
+/// (With POOL_MAJORITY, levels are majorities of majorities.)
+/// Requires: pyramid has space for levels images.
+///
+/// On success, the new images are stored in pyramid[0..levels-1].
+/// (The caller is responsible for destroying them!)
+void ImagePyramid(const Image img, uint8 mode, uint32 levels,
+                  Image pyramid[]) {
+    assert(img != NULL);
+    assert(pyramid != NULL);
 
-        // alocar memoria para o novo rle row
-        uint32 new_max_size =
-            num_runs1 + num_runs2 +
-            2; //+2 porque é o bit inicial e o bit terminador (-1)
-        int *new_rle_row = malloc(new_max_size * sizeof(int));
-        check(new_rle_row != NULL, "malloc");
+    InstrTraceBegin("ImagePyramid");
+    Image prev = img;
+    for (uint32 l = 0; l < levels; l++) {
+        pyramid[l] = ImageDownscale(prev, 2, mode);
+        prev = pyramid[l];
+    }
+    InstrTraceEnd("ImagePyramid");
+}
 
-        uint32 new_index = 0;
-        new_rle_row[new_index++] = initial_pixel1;
+/// Vertically coherent row-delta coding
 
-        //
-        uint32 index1 = 1;
-        while (rle_row1[index1] != EOR) { // EOR -> end of row == -1
-            new_rle_row[new_index++] = rle_row1[index1++];
+// Scanned documents change little from one row to the next, so each row
+// is coded against the row above it, like CCITT Group 4 (T.6) does.
+// Rows are seen as lists of changing elements (transitions): the
+// positions x where pixel x has a different color from pixel x-1,
+// starting from an imaginary WHITE pixel at x = -1. Transitions at even
+// indexes change to BLACK, those at odd indexes change back to WHITE.
+//
+// A row is coded as a sequence of modes, where a0 is the last coded
+// position (initially -1) and, as in T.6:
+//   a1, a2: next transitions in the current row after a0;
+//   b1: first transition in the reference row after a0 to the color
+//       opposite to the color at a0, and b2 the one after b1.
+//   PASS (b2 < a1): a0 = b2.
+//   VERTICAL d (|a1 - b1| <= 3): a1 = b1 + d, a0 = a1.
+//   HORIZONTAL r1, r2: the runs a0..a1 and a1..a2, a0 = a2.
+// Width is used as the transition after the last one in each row.
+
+#define DELTA_PASS 7       // código do modo pass
+#define DELTA_HORIZONTAL 8 // código do modo horizontal (seguido de 2 runs)
+#define DELTA_SAME 9       // a linha é igual à linha de referência
+// Os códigos 0..6 são o modo vertical com d = código - 3
+
+/// One coding mode
+typedef struct {
+    int mode;   // DELTA_PASS, DELTA_HORIZONTAL or 0..6 (vertical)
+    int r1, r2; // runs of the horizontal mode
+    int color;  // color of run r1 (r2 has the opposite color)
+} DeltaMode;
+
+/// Convert a RLE row to a list of transitions. Returns their number.
+/// t must have space for (width + 1) elements.
+static uint32 RowToTransitions(const int *RLE_row, int *t) {
+    uint32 n = 0;
+    int color = WHITE;
+    int pixel_value = RLE_row[0];
+    int x = 0;
+    for (uint32 j = 1; RLE_row[j] != EOR; j++) {
+        if (RLE_row[j] > 0) {
+            if (pixel_value != color) {
+                t[n++] = x;
+                color = pixel_value;
+            }
+            x += RLE_row[j];
         }
+        pixel_value ^= 1;
+    }
+    return n;
+}
 
-        uint32 index2 = 1;
+/// Build a row of img from a list of n transitions, with the first run
+/// of the given color (WHITE, by convention), using temp_row as buffer.
+/// A single run becomes one of the shared constant rows of img.
+static int *TransitionsToRow(Image img, const int *t, uint32 n, int color,
+                             int *temp_row) {
+    RowBuilder rb;
+    RowBuilderInit(&rb, temp_row);
+    int x = 0;
+    for (uint32 i = 0; i < n; i++) {
+        RowBuilderPush(&rb, color, t[i] - x);
+        x = t[i];
+        color ^= 1;
+    }
+    RowBuilderPush(&rb, color, (int)img->width - x);
+    return RowBuilderFinishIn(&rb, img);
+}
 
-        if (merge_runs) {
-            new_rle_row[new_index - 1] +=
-                rle_row2[index2++]; // unir (merge) ultima run da img1 com a
-                                    // primeira da img2
+/// Combine two lists of transitions with a boolean function,
+/// given as a truth table (see OP_AND, OP_OR, OP_XOR).
+/// Returns the number of transitions stored in out.
+static uint32 MergeTransitions(uint8 op, const int *ta, uint32 na,
+                               const int *tb, uint32 nb, int *out) {
+    uint32 i = 0, j = 0, n = 0;
+    int a = WHITE, b = WHITE;
+    int color = WHITE; // cor do pixel imaginário em x = -1
+    int x = 0;
+    for (;;) {
+        int new_color = (op >> (2 * a + b)) & 1;
+        if (new_color != color) {
+            // duas mudanças na mesma posição anulam-se
+            if (n > 0 && out[n - 1] == x)
+                n--;
+            else
+                out[n++] = x;
+            color = new_color;
+        }
+        if (i >= na && j >= nb)
+            break;
+        // próxima posição onde alguma das linhas muda
+        x = (j >= nb || (i < na && ta[i] <= tb[j])) ? ta[i] : tb[j];
+        if (i < na && ta[i] == x) {
+            a ^= 1;
+            i++;
         }
+        if (j < nb && tb[j] == x) {
+            b ^= 1;
+            j++;
+        }
+    }
+    return n;
+}
+
+/// State of the coder (or decoder) of one row
+typedef struct {
+    const int *ref; // transitions of the reference row
+    uint32 nref;
+    uint32 ri;      // index of the first reference transition after a0
+    int a0;         // last coded position
+    int color;      // color at a0
+    int width;
+} DeltaState;
+
+static void DeltaStateInit(DeltaState *st, const int *ref, uint32 nref,
+                           uint32 width) {
+    st->ref = ref;
+    st->nref = nref;
+    st->ri = 0;
+    st->a0 = -1;
+    st->color = WHITE;
+    st->width = (int)width;
+}
+
+/// Find b1 and b2 for the current a0 and color
+static void DeltaFindB(DeltaState *st, int *b1, int *b2) {
+    while (st->ri < st->nref && st->ref[st->ri] <= st->a0)
+        st->ri++;
+    // b1 muda para a cor oposta: índices pares mudam para preto
+    uint32 j = st->ri;
+    if (j < st->nref && (int)(j % 2) != st->color)
+        j++;
+    *b1 = (j < st->nref) ? st->ref[j] : st->width;
+    *b2 = (j + 1 < st->nref) ? st->ref[j + 1] : st->width;
+}
 
-        // copiar os restantes runs da row da img2
-        while (rle_row2[index2] != EOR) {
-            new_rle_row[new_index++] = rle_row2[index2++];
+/// Code the row cur against the row ref (both as transitions).
+/// Stores the modes in modes and returns their number.
+/// modes must have space for (ncur + nref + 1) elements.
+static uint32 DeltaCodeRow(const int *ref, uint32 nref, const int *cur,
+                           uint32 ncur, uint32 width, DeltaMode *modes) {
+    DeltaState st;
+    DeltaStateInit(&st, ref, nref, width);
+    uint32 n = 0;
+    uint32 ci = 0; // índice da primeira transição de cur depois de a0
+    while (st.a0 < st.width) {
+        while (ci < ncur && cur[ci] <= st.a0)
+            ci++;
+        int a1 = (ci < ncur) ? cur[ci] : st.width;
+        int b1, b2;
+        DeltaFindB(&st, &b1, &b2);
+        if (b2 < a1) {
+            modes[n++].mode = DELTA_PASS;
+            st.a0 = b2;
+        } else if (a1 - b1 >= -3 && a1 - b1 <= 3) {
+            modes[n++].mode = a1 - b1 + 3;
+            st.a0 = a1;
+            st.color ^= 1;
+        } else {
+            int a2 = (ci + 1 < ncur) ? cur[ci + 1] : st.width;
+            modes[n].mode = DELTA_HORIZONTAL;
+            modes[n].color = st.color;
+            modes[n].r1 = a1 - (st.a0 > 0 ? st.a0 : 0);
+            modes[n].r2 = a2 - a1;
+            n++;
+            st.a0 = a2;
         }
+    }
+    return n;
+}
 
-        new_rle_row[new_index++] = EOR;
+/// Apply one mode to the decoder state, storing new transitions in t.
+/// Returns 0 on success, or -1 if the mode is not valid in this state.
+static int DeltaDecodeMode(DeltaState *st, const DeltaMode *m, int *t,
+                           uint32 *n) {
+    int b1, b2;
+    int last = (*n > 0) ? t[*n - 1] : -1; // última transição guardada
+    if (m->mode == DELTA_PASS) {
+        DeltaFindB(st, &b1, &b2);
+        st->a0 = b2;
+    } else if (m->mode == DELTA_HORIZONTAL) {
+        if (m->r1 < 0 || m->r2 < 0)
+            return -1;
+        int64_t a1 = (int64_t)(st->a0 > 0 ? st->a0 : 0) + m->r1;
+        int64_t a2 = a1 + m->r2;
+        if (a2 > st->width)
+            return -1;
+        if (a1 < st->width) {
+            if (a1 <= last)
+                return -1;
+            t[(*n)++] = (int)a1;
+        }
+        if (a2 < st->width) {
+            if (a2 <= a1)
+                return -1;
+            t[(*n)++] = (int)a2;
+        }
+        st->a0 = (int)a2;
+    } else if (m->mode >= 0 && m->mode <= 6) {
+        DeltaFindB(st, &b1, &b2);
+        int a1 = b1 + m->mode - 3;
+        if (a1 <= st->a0 || a1 > st->width)
+            return -1;
+        if (a1 < st->width)
+            t[(*n)++] = a1;
+        st->a0 = a1;
+        st->color ^= 1;
+    } else {
+        return -1;
+    }
+    return 0;
+}
 
-        new_rle_row = realloc(new_rle_row, new_index * sizeof(int));
-        check(new_rle_row != NULL, "realloc");
+/// Growable array of 4-bit codes
+typedef struct {
+    uint8 *data;
+    size_t n;   // number of nibbles
+    size_t cap; // capacity in bytes
+} NibbleBuffer;
+
+static void NibblePush(NibbleBuffer *nb, uint8 v) {
+    if (nb->n / 2 >= nb->cap) {
+        nb->cap = (nb->cap > 0) ? 2 * nb->cap : 64;
+        nb->data = InstrRealloc(nb->data, nb->cap);
+        check(nb->data != NULL, "realloc");
+    }
+    if (nb->n % 2 == 0)
+        nb->data[nb->n / 2] = v;
+    else
+        nb->data[nb->n / 2] |= v << 4;
+    nb->n++;
+}
 
-        newImage->row[i] = new_rle_row;
+/// Push a non-negative integer, 3 bits per nibble (bit 3 means "more")
+static void NibblePushVarint(NibbleBuffer *nb, uint32 v) {
+    while (v >= 8) {
+        NibblePush(nb, 8 | (v & 7));
+        v >>= 3;
     }
+    NibblePush(nb, v);
+}
 
-    return newImage;
+static uint8 NibbleGet(const uint8 *data, size_t *pos) {
+    uint8 v = (*pos % 2 == 0) ? data[*pos / 2] & 0xF : data[*pos / 2] >> 4;
+    (*pos)++;
+    return v;
+}
+
+static uint32 NibbleGetVarint(const uint8 *data, size_t *pos) {
+    uint32 v = 0;
+    int shift = 0;
+    uint8 nib;
+    do {
+        nib = NibbleGet(data, pos);
+        v |= (uint32)(nib & 7) << shift;
+        shift += 3;
+    } while (nib & 8);
+    return v;
+}
+
+// Internal structure for storing row-delta coded images
+struct deltaImage {
+    uint32 width;
+    uint32 height;
+    NibbleBuffer code; // modes of all rows, one after the other
+};
+
+/// Streaming decoder of a delta image: one row at a time
+typedef struct {
+    DeltaImage dimg;
+    size_t pos;     // próximo nibble a ler
+    int *buf;       // espaço para as duas linhas de transições
+    int *ref, *cur; // transições da linha anterior e da atual
+    uint32 nref, ncur;
+} DeltaReader;
+
+static void DeltaReaderInit(DeltaReader *rd, const DeltaImage dimg) {
+    rd->dimg = dimg;
+    rd->pos = 0;
+    rd->buf = InstrMalloc(2 * (dimg->width + 1) * sizeof(int));
+    check(rd->buf != NULL, "malloc");
+    rd->ref = rd->buf;
+    rd->cur = rd->buf + dimg->width + 1;
+    rd->nref = rd->ncur = 0;
+}
+
+/// Decode the next row; its transitions are left in rd->cur, rd->ncur
+static void DeltaReaderNext(DeltaReader *rd) {
+    // a linha atual passa a ser a referência
+    int *tmp = rd->ref;
+    rd->ref = rd->cur;
+    rd->cur = tmp;
+    rd->nref = rd->ncur;
+    rd->ncur = 0;
+
+    const uint8 *data = rd->dimg->code.data;
+    if (NibbleGet(data, &rd->pos) == DELTA_SAME) {
+        memcpy(rd->cur, rd->ref, rd->nref * sizeof(int));
+        rd->ncur = rd->nref;
+        return;
+    }
+    rd->pos--;
+
+    DeltaState st;
+    DeltaStateInit(&st, rd->ref, rd->nref, rd->dimg->width);
+    while (st.a0 < st.width) {
+        DeltaMode m;
+        m.mode = NibbleGet(data, &rd->pos);
+        if (m.mode == DELTA_HORIZONTAL) {
+            m.r1 = (int)NibbleGetVarint(data, &rd->pos);
+            m.r2 = (int)NibbleGetVarint(data, &rd->pos);
+        }
+        int r = DeltaDecodeMode(&st, &m, rd->cur, &rd->ncur);
+        assert(r == 0);
+        (void)r;
+    }
+}
+
+static void DeltaReaderClose(DeltaReader *rd) { InstrFree(rd->buf); }
+
+/// Streaming encoder of a delta image: one row at a time
+typedef struct {
+    DeltaImage dimg;
+    int *ref;        // transições da linha anterior
+    uint32 nref;
+    DeltaMode *modes;
+} DeltaWriter;
+
+static void DeltaWriterInit(DeltaWriter *wr, uint32 width, uint32 height) {
+    wr->dimg = InstrMalloc(sizeof(struct deltaImage));
+    check(wr->dimg != NULL, "malloc");
+    wr->dimg->width = width;
+    wr->dimg->height = height;
+    wr->dimg->code.data = NULL;
+    wr->dimg->code.n = wr->dimg->code.cap = 0;
+    wr->ref = InstrMalloc((width + 1) * sizeof(int));
+    check(wr->ref != NULL, "malloc");
+    wr->nref = 0;
+    wr->modes = InstrMalloc((2 * width + 3) * sizeof(DeltaMode));
+    check(wr->modes != NULL, "malloc");
+}
+
+/// Append a row, given by its n transitions
+static void DeltaWriterPut(DeltaWriter *wr, const int *t, uint32 n) {
+    NibbleBuffer *code = &wr->dimg->code;
+    if (n == wr->nref && memcmp(t, wr->ref, n * sizeof(int)) == 0) {
+        NibblePush(code, DELTA_SAME);
+        return;
+    }
+    uint32 nmodes =
+        DeltaCodeRow(wr->ref, wr->nref, t, n, wr->dimg->width, wr->modes);
+    for (uint32 i = 0; i < nmodes; i++) {
+        NibblePush(code, (uint8)wr->modes[i].mode);
+        if (wr->modes[i].mode == DELTA_HORIZONTAL) {
+            NibblePushVarint(code, (uint32)wr->modes[i].r1);
+            NibblePushVarint(code, (uint32)wr->modes[i].r2);
+        }
+    }
+    memcpy(wr->ref, t, n * sizeof(int));
+    wr->nref = n;
+}
+
+static DeltaImage DeltaWriterClose(DeltaWriter *wr) {
+    InstrFree(wr->ref);
+    InstrFree(wr->modes);
+    return wr->dimg;
+}
+
+/// Encode an image as row deltas.
+/// On success, a new delta image is returned.
+/// (The caller is responsible for destroying the returned image!)
+DeltaImage ImageDeltaEncode(const Image img) {
+    assert(img != NULL);
+
+    InstrTraceBegin("ImageDeltaEncode");
+    DeltaWriter wr;
+    DeltaWriterInit(&wr, img->width, img->height);
+    int *t = InstrMalloc((img->width + 1) * sizeof(int));
+    check(t != NULL, "malloc");
+    for (uint32 i = 0; i < img->height; i++) {
+        uint32 n = RowToTransitions(img->row[i], t);
+        DeltaWriterPut(&wr, t, n);
+    }
+    InstrFree(t);
+    DeltaImage dimg = DeltaWriterClose(&wr);
+    InstrTraceEnd("ImageDeltaEncode");
+    return dimg;
+}
+
+/// Decode a delta image back to a RLE image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageDeltaDecode(const DeltaImage dimg) {
+    assert(dimg != NULL);
+
+    InstrTraceBegin("ImageDeltaDecode");
+    Image img = AllocateImageHeader(dimg->width, dimg->height);
+    int *temp_row = InstrMalloc((dimg->width + 2) * sizeof(int));
+    check(temp_row != NULL, "malloc");
+    DeltaReader rd;
+    DeltaReaderInit(&rd, dimg);
+    for (uint32 i = 0; i < dimg->height; i++) {
+        DeltaReaderNext(&rd);
+        img->row[i] = TransitionsToRow(img, rd.cur, rd.ncur, WHITE, temp_row);
+    }
+    DeltaReaderClose(&rd);
+    InstrFree(temp_row);
+    InstrTraceEnd("ImageDeltaDecode");
+    return img;
+}
+
+/// Destroy the delta image pointed to by (*dimgp).
+/// If (*dimgp)==NULL, no operation is performed.
+/// Ensures: (*dimgp)==NULL.
+void DeltaImageDestroy(DeltaImage *dimgp) {
+    assert(dimgp != NULL);
+    if (*dimgp == NULL)
+        return;
+    InstrFree((*dimgp)->code.data);
+    InstrFree(*dimgp);
+    *dimgp = NULL;
+}
+
+/// Size of the code of a delta image, in bytes
+size_t DeltaImageSize(const DeltaImage dimg) {
+    assert(dimg != NULL);
+    return (dimg->code.n + 1) / 2;
+}
+
+/// Count the BLACK pixels of a delta image, decoding it row by row
+uint64 DeltaImageCountBlack(const DeltaImage dimg) {
+    assert(dimg != NULL);
+
+    InstrTraceBegin("DeltaImageCountBlack");
+    uint64 count = 0;
+    DeltaReader rd;
+    DeltaReaderInit(&rd, dimg);
+    for (uint32 i = 0; i < dimg->height; i++) {
+        DeltaReaderNext(&rd);
+        // runs pretas: [t[0], t[1]), [t[2], t[3]), ...
+        for (uint32 j = 0; j < rd.ncur; j += 2) {
+            int end = (j + 1 < rd.ncur) ? rd.cur[j + 1] : (int)dimg->width;
+            count += end - rd.cur[j];
+        }
+    }
+    DeltaReaderClose(&rd);
+    InstrTraceEnd("DeltaImageCountBlack");
+    return count;
+}
+
+/// Apply a boolean operation (OP_AND, OP_OR, OP_XOR) to two delta images,
+/// streaming both row by row; no RLE image is built.
+/// Requires: the images must be of the same size.
+/// On success, a new delta image is returned.
+/// (The caller is responsible for destroying the returned image!)
+DeltaImage DeltaImageOp(const DeltaImage dimg1, const DeltaImage dimg2,
+                        uint8 op) {
+    assert(dimg1 != NULL && dimg2 != NULL);
+    assert(dimg1->width == dimg2->width && dimg1->height == dimg2->height);
+
+    InstrTraceBegin("DeltaImageOp");
+    DeltaReader rd1, rd2;
+    DeltaReaderInit(&rd1, dimg1);
+    DeltaReaderInit(&rd2, dimg2);
+    DeltaWriter wr;
+    DeltaWriterInit(&wr, dimg1->width, dimg1->height);
+    int *t = InstrMalloc((dimg1->width + 1) * sizeof(int));
+    check(t != NULL, "malloc");
+    for (uint32 i = 0; i < dimg1->height; i++) {
+        DeltaReaderNext(&rd1);
+        DeltaReaderNext(&rd2);
+        uint32 n = MergeTransitions(op, rd1.cur, rd1.ncur, rd2.cur, rd2.ncur, t);
+        DeltaWriterPut(&wr, t, n);
+    }
+    InstrFree(t);
+    DeltaReaderClose(&rd1);
+    DeltaReaderClose(&rd2);
+    DeltaImage dimg = DeltaWriterClose(&wr);
+    InstrTraceEnd("DeltaImageOp");
+    return dimg;
+}
+
+/// Sub-image views
+
+// A view is just a window over the rows of an image: no row is copied.
+// Runs are trimmed to the columns of the window as they are read, by a
+// cursor that skips the runs to the left of the window and stops at its
+// right edge, so each row of a view costs O(runs up to the right edge).
+
+// Internal structure for views of a window of an image
+struct imageView {
+    Image img;            // imagem de que a vista é uma janela
+    uint32 x, y;          // canto superior esquerdo da janela
+    uint32 width, height; // dimensões da janela
+};
+
+/// Row i of a view, as a row of its image (not trimmed)
+static const int *ViewRow(const ImageView view, uint32 i) {
+    return view->img->row[view->y + i];
+}
+
+/// Rows [*first, *last[ of a view outside which it is surely blank,
+/// according to the occupancy summary of its image
+static void ViewContentRows(const ImageView view, uint32 *first,
+                            uint32 *last) {
+    const Occupancy *occ = PeekOccupancy(view->img);
+    uint32 y0 = view->y, y1 = view->y + view->height;
+    if (occ != NULL) {
+        // janela fora da caixa dos pixels pretos: tudo em branco
+        if (occ->x1 <= view->x || occ->x0 >= view->x + view->width)
+            y1 = y0;
+        y0 = (occ->y0 > y0) ? occ->y0 : y0;
+        y1 = (occ->y1 < y1) ? occ->y1 : y1;
+    }
+    if (y0 >= y1)
+        y0 = y1 = view->y;
+    *first = y0 - view->y;
+    *last = y1 - view->y;
+}
+
+/// Create a view of the window of img with the given size, whose top left
+/// corner is at column x and row y.
+ImageView ImageViewCreate(const Image img, uint32 x, uint32 y, uint32 width,
+                          uint32 height) {
+    assert(img != NULL);
+    assert(width > 0 && height > 0);
+    assert(x <= img->width && width <= img->width - x);
+    assert(y <= img->height && height <= img->height - y);
+
+    ImageView view = InstrMalloc(sizeof(struct imageView));
+    check(view != NULL, "malloc");
+    view->img = img;
+    view->x = x;
+    view->y = y;
+    view->width = width;
+    view->height = height;
+    return view;
+}
+
+/// Destroy the view pointed to by (*viewp).
+/// If (*viewp)==NULL, no operation is performed.
+/// Ensures: (*viewp)==NULL.
+void ImageViewDestroy(ImageView *viewp) {
+    assert(viewp != NULL);
+    InstrFree(*viewp);
+    *viewp = NULL;
+}
+
+/// Get view width
+int ImageViewWidth(const ImageView view) {
+    assert(view != NULL);
+    return view->width;
+}
+
+/// Get view height
+int ImageViewHeight(const ImageView view) {
+    assert(view != NULL);
+    return view->height;
+}
+
+/// Number of BLACK pixels of a RLE row in the columns [x, x + width[
+static uint32 CountBlackInWindow(const int *RLE_row, uint32 x, uint32 width) {
+    uint32 count = 0;
+    WindowCursor w;
+    WindowCursorInit(&w, RLE_row, x, width);
+    while (w.left > 0) {
+        if (w.color == BLACK)
+            count += w.left;
+        WindowCursorSkip(&w, w.left);
+    }
+    return count;
+}
+
+typedef struct {
+    const ImageView view;
+    uint64 *partial; // contagem total de cada banda
+    uint32 y0;       // primeira linha da vista com pixels pretos
+} ViewCountArgs;
+
+static void ViewCountBand(void *arg, uint32 band, uint32 first, uint32 last) {
+    ViewCountArgs *a = arg;
+    const ImageView view = a->view;
+    // janela com as linhas inteiras: contam-se as runs sem as cortar
+    int whole = (view->x == 0 && view->width == view->img->width);
+    uint64 total = 0;
+    for (uint32 i = a->y0 + first; i < a->y0 + last; i++)
+        total += whole ? CountBlackInRLERow(ViewRow(view, i))
+                       : CountBlackInWindow(ViewRow(view, i), view->x,
+                                            view->width);
+    a->partial[band] = total;
+}
+
+/// Count the BLACK pixels of a view.
+uint64 ImageViewCountBlack(const ImageView view) {
+    assert(view != NULL);
+
+    InstrTraceBegin("ImageViewCountBlack");
+    uint32 y0, y1;
+    ViewContentRows(view, &y0, &y1);
+    uint32 nbands = NumBands(y1 - y0);
+    uint64 partial[nbands];
+    ViewCountArgs args = {view, partial, y0};
+    ParallelRows(y1 - y0, nbands, ViewCountBand, &args);
+
+    uint64 total = 0;
+    for (uint32 b = 0; b < nbands; b++)
+        total += partial[b];
+    InstrTraceEnd("ImageViewCountBlack");
+    return total;
+}
+
+/// Compare the pixels of two views.
+int ImageViewIsEqual(const ImageView view1, const ImageView view2) {
+    assert(view1 != NULL && view2 != NULL);
+
+    if (view1->width != view2->width || view1->height != view2->height)
+        return 0;
+
+    for (uint32 i = 0; i < view1->height; i++) {
+        // a mesma linha, com as mesmas colunas, é igual a si própria
+        if (ViewRow(view1, i) == ViewRow(view2, i) && view1->x == view2->x)
+            continue;
+        WindowCursor w1, w2;
+        WindowCursorInit(&w1, ViewRow(view1, i), view1->x, view1->width);
+        WindowCursorInit(&w2, ViewRow(view2, i), view2->x, view2->width);
+        // parar na primeira diferença
+        while (w1.left > 0) {
+            if (w1.color != w2.color)
+                return 0;
+            int len = (w1.left < w2.left) ? w1.left : w2.left;
+            WindowCursorSkip(&w1, len);
+            WindowCursorSkip(&w2, len);
+        }
+    }
+    return 1;
+}
+
+/// Apply a boolean operation (OP_AND, OP_OR, OP_XOR) to two views,
+/// merging the trimmed runs of their rows.
+/// Requires: the views must be of the same size.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageViewOp(const ImageView view1, const ImageView view2, uint8 op) {
+    assert(view1 != NULL && view2 != NULL);
+    check(view1->width == view2->width && view1->height == view2->height,
+          "size");
+
+    InstrTraceBegin("ImageViewOp");
+    Image result = AllocateImageHeader(view1->width, view1->height);
+    int *temp_row = InstrMalloc((view1->width + 2) * sizeof(int));
+    check(temp_row != NULL, "malloc");
+    for (uint32 i = 0; i < view1->height; i++) {
+        WindowCursor w1, w2;
+        WindowCursorInit(&w1, ViewRow(view1, i), view1->x, view1->width);
+        WindowCursorInit(&w2, ViewRow(view2, i), view2->x, view2->width);
+        RowBuilder rb;
+        RowBuilderInit(&rb, temp_row);
+        while (w1.left > 0) {
+            int len = (w1.left < w2.left) ? w1.left : w2.left;
+            RowBuilderPush(&rb, (op >> (2 * w1.color + w2.color)) & 1, len);
+            BOL_OPS++;
+            WindowCursorSkip(&w1, len);
+            WindowCursorSkip(&w2, len);
+        }
+        result->row[i] = RowBuilderFinishIn(&rb, result);
+    }
+    InstrFree(temp_row);
+    InstrTraceEnd("ImageViewOp");
+    return result;
+}
+
+/// Copy the pixels of a view to a new image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageViewCopy(const ImageView view) {
+    assert(view != NULL);
+
+    InstrTraceBegin("ImageViewCopy");
+    Image result = AllocateImageHeader(view->width, view->height);
+    int *temp_row = InstrMalloc((view->width + 2) * sizeof(int));
+    check(temp_row != NULL, "malloc");
+    int whole = (view->x == 0 && view->width == view->img->width);
+    for (uint32 i = 0; i < view->height; i++) {
+        if (whole) {
+            result->row[i] = CopyRowIn(result, ViewRow(view, i), 0);
+            continue;
+        }
+        WindowCursor w;
+        WindowCursorInit(&w, ViewRow(view, i), view->x, view->width);
+        RowBuilder rb;
+        RowBuilderInit(&rb, temp_row);
+        while (w.left > 0) {
+            RowBuilderPush(&rb, w.color, w.left);
+            WindowCursorSkip(&w, w.left);
+        }
+        result->row[i] = RowBuilderFinishIn(&rb, result);
+    }
+    InstrFree(temp_row);
+    InstrTraceEnd("ImageViewCopy");
+    return result;
+}
+
+/// Save a view to PBM file.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageViewSave(const ImageView view, const char *filename) {
+    assert(view != NULL);
+    InstrTraceBegin("ImageViewSave");
+    int w = view->width;
+    int h = view->height;
+    FILE *f = NULL;
+
+    check((f = fopen(filename, "wb")) != NULL, "Open failed");
+    check(fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed");
+
+    int nbytes = (w + 8 - 1) / 8; // number of bytes for each row
+    uint8 bytes[nbytes];
+    uint8 raw_row[nbytes * 8];
+    // os pixels de enchimento ficam brancos
+    memset(raw_row, WHITE, nbytes * 8);
+    // linhas fora de [y0, y1[ estão em branco: escrevem-se zeros
+    uint32 y0, y1;
+    ViewContentRows(view, &y0, &y1);
+    uint8 zeros[nbytes];
+    memset(zeros, 0, nbytes);
+    for (uint32 i = 0; i < view->height; i++) {
+        if (i < y0 || i >= y1) {
+            check(fwrite(zeros, sizeof(uint8), nbytes, f) == (size_t)nbytes,
+                  "Writing pixels failed");
+            continue;
+        }
+        // descomprimir só os troços dentro da janela
+        WindowCursor wc;
+        WindowCursorInit(&wc, ViewRow(view, i), view->x, view->width);
+        uint8 *p = raw_row;
+        while (wc.left > 0) {
+            memset(p, wc.color, wc.left);
+            p += wc.left;
+            WindowCursorSkip(&wc, wc.left);
+        }
+        packBits(nbytes, bytes, raw_row);
+        size_t written = fwrite(bytes, sizeof(uint8), nbytes, f);
+        check(written == (size_t)nbytes, "Writing pixels failed");
+    }
+
+    fclose(f);
+    InstrTraceEnd("ImageViewSave");
+    return 0;
+}
+
+/// Transition-coordinate images
+
+// Here each row is stored as the sorted list of its transitions (the
+// positions x where the color changes, see RowToTransitions above), so
+// the color of any pixel is found by binary search, and a boolean
+// operation is a merge of two sorted lists (for XOR, just their
+// symmetric difference).  The transitions of all rows are kept in one
+// array, and the rows of a result are merged in parallel by bands: each
+// row is written at an upper bound of its position, and the gaps are
+// closed afterwards.
+
+// Internal structure for storing transition-coordinate images
+struct transitionImage {
+    uint32 width;
+    uint32 height;
+    uint64 *start; // transições da linha i: x[start[i]] .. x[start[i+1]-1]
+    int *x;        // transições de todas as linhas, seguidas
+};
+
+static TransitionImage AllocateTransitionImage(uint32 width, uint32 height,
+                                               uint64 size) {
+    TransitionImage timg = InstrMalloc(sizeof(struct transitionImage));
+    check(timg != NULL, "malloc");
+    timg->width = width;
+    timg->height = height;
+    timg->start = InstrMalloc((height + 1) * sizeof(uint64));
+    timg->x = InstrMalloc((size > 0 ? size : 1) * sizeof(int));
+    check(timg->start != NULL && timg->x != NULL, "malloc");
+    return timg;
+}
+
+/// Close the gaps between the rows of a transition image, whose row i was
+/// written at start[i] (an upper bound) with count[i] transitions
+static void CompactTransitions(TransitionImage timg, const uint32 *count) {
+    uint64 n = 0;
+    for (uint32 i = 0; i < timg->height; i++) {
+        memmove(timg->x + n, timg->x + timg->start[i], count[i] * sizeof(int));
+        timg->start[i] = n;
+        n += count[i];
+    }
+    timg->start[timg->height] = n;
+    int *x = InstrRealloc(timg->x, (n > 0 ? n : 1) * sizeof(int));
+    check(x != NULL, "realloc");
+    timg->x = x;
+}
+
+/// Symmetric difference of two sorted lists of transitions (XOR):
+/// the positions in only one of them.
+/// Returns the number of transitions stored in out.
+static uint32 XorTransitions(const int *ta, uint32 na, const int *tb,
+                             uint32 nb, int *out) {
+    uint32 i = 0, j = 0, n = 0;
+    while (i < na && j < nb) {
+        int a = ta[i], b = tb[j];
+        out[n] = (a < b) ? a : b;
+        n += (a != b);
+        i += (a <= b);
+        j += (b <= a);
+    }
+    while (i < na)
+        out[n++] = ta[i++];
+    while (j < nb)
+        out[n++] = tb[j++];
+    return n;
+}
+
+typedef struct {
+    const Image img;
+    TransitionImage timg;
+    uint32 *count; // número de transições de cada linha
+} ToTransitionsArgs;
+
+static void ToTransitionsBand(void *arg, uint32 band, uint32 first,
+                              uint32 last) {
+    (void)band;
+    ToTransitionsArgs *a = arg;
+    for (uint32 i = first; i < last; i++)
+        a->count[i] = RowToTransitions(a->img->row[i],
+                                       a->timg->x + a->timg->start[i]);
+}
+
+/// Convert an image to transition coordinates.
+/// On success, a new transition image is returned.
+/// (The caller is responsible for destroying the returned image!)
+TransitionImage ImageToTransitions(const Image img) {
+    assert(img != NULL);
+
+    InstrTraceBegin("ImageToTransitions");
+    // cada linha tem no máximo tantas transições como runs
+    uint64 *bound = InstrMalloc((img->height + 1) * sizeof(uint64));
+    check(bound != NULL, "malloc");
+    bound[0] = 0;
+    for (uint32 i = 0; i < img->height; i++)
+        bound[i + 1] = bound[i] + GetNumRunsInRLERow(img->row[i]);
+    TransitionImage timg =
+        AllocateTransitionImage(img->width, img->height, bound[img->height]);
+    memcpy(timg->start, bound, (img->height + 1) * sizeof(uint64));
+    InstrFree(bound);
+
+    uint32 *count = InstrMalloc(img->height * sizeof(uint32));
+    check(count != NULL, "malloc");
+    ToTransitionsArgs args = {img, timg, count};
+    ParallelRows(img->height, NumBands(img->height), ToTransitionsBand, &args);
+    CompactTransitions(timg, count);
+    InstrFree(count);
+    InstrTraceEnd("ImageToTransitions");
+    return timg;
+}
+
+typedef struct {
+    const TransitionImage timg;
+    Image img;
+} FromTransitionsArgs;
+
+static void FromTransitionsBand(void *arg, uint32 band, uint32 first,
+                                uint32 last) {
+    (void)band;
+    FromTransitionsArgs *a = arg;
+    const TransitionImage timg = a->timg;
+    int *temp_row = InstrMalloc((timg->width + 2) * sizeof(int));
+    check(temp_row != NULL, "malloc");
+    for (uint32 i = first; i < last; i++) {
+        const int *t = timg->x + timg->start[i];
+        uint32 n = (uint32)(timg->start[i + 1] - timg->start[i]);
+        a->img->row[i] = TransitionsToRow(a->img, t, n, WHITE, temp_row);
+    }
+    InstrFree(temp_row);
+}
+
+/// Convert a transition image back to a RLE image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image TransitionImageToImage(const TransitionImage timg) {
+    assert(timg != NULL);
+
+    InstrTraceBegin("TransitionImageToImage");
+    Image img = AllocateImageHeader(timg->width, timg->height);
+    ConstantRow(img, WHITE); // antes das bandas (ver ConstantRow)
+    FromTransitionsArgs args = {timg, img};
+    ParallelRows(timg->height, NumBands(timg->height), FromTransitionsBand,
+                 &args);
+    InstrTraceEnd("TransitionImageToImage");
+    return img;
+}
+
+/// Destroy the transition image pointed to by (*timgp).
+/// If (*timgp)==NULL, no operation is performed.
+/// Ensures: (*timgp)==NULL.
+void TransitionImageDestroy(TransitionImage *timgp) {
+    assert(timgp != NULL);
+    if (*timgp == NULL)
+        return;
+    InstrFree((*timgp)->x);
+    InstrFree((*timgp)->start);
+    InstrFree(*timgp);
+    *timgp = NULL;
+}
+
+/// Get the color of pixel (x, y) of a transition image, by binary search:
+/// it is BLACK if an odd number of transitions are at or before x.
+int TransitionImagePixel(const TransitionImage timg, uint32 x, uint32 y) {
+    assert(timg != NULL && x < timg->width && y < timg->height);
+    const int *t = timg->x + timg->start[y];
+    uint32 lo = 0, hi = (uint32)(timg->start[y + 1] - timg->start[y]);
+    while (lo < hi) {
+        uint32 mid = lo + (hi - lo) / 2;
+        if (t[mid] <= (int)x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo & 1;
+}
+
+/// Count the BLACK pixels of a transition image.
+/// The BLACK runs are [t[0], t[1]), [t[2], t[3]), ..., so the count is the
+/// sum of the odd transitions minus the sum of the even ones.
+uint64 TransitionImageCountBlack(const TransitionImage timg) {
+    assert(timg != NULL);
+
+    InstrTraceBegin("TransitionImageCountBlack");
+    int64_t total = 0;
+    for (uint32 i = 0; i < timg->height; i++) {
+        const int *t = timg->x + timg->start[i];
+        uint32 n = (uint32)(timg->start[i + 1] - timg->start[i]);
+        int64_t sum = 0;
+        for (uint32 j = 0; j + 1 < n; j += 2)
+            sum += t[j + 1] - t[j];
+        if (n & 1) // a última run preta vai até ao fim da linha
+            sum += timg->width - t[n - 1];
+        total += sum;
+    }
+    InstrTraceEnd("TransitionImageCountBlack");
+    return (uint64)total;
+}
+
+typedef struct {
+    const TransitionImage timg1, timg2;
+    uint8 op;
+    TransitionImage result;
+    uint32 *count; // número de transições de cada linha do resultado
+} TransitionOpArgs;
+
+static void TransitionOpBand(void *arg, uint32 band, uint32 first,
+                             uint32 last) {
+    (void)band;
+    TransitionOpArgs *a = arg;
+    const TransitionImage t1 = a->timg1, t2 = a->timg2;
+    for (uint32 i = first; i < last; i++) {
+        const int *ta = t1->x + t1->start[i];
+        const int *tb = t2->x + t2->start[i];
+        uint32 na = (uint32)(t1->start[i + 1] - t1->start[i]);
+        uint32 nb = (uint32)(t2->start[i + 1] - t2->start[i]);
+        int *out = a->result->x + a->result->start[i];
+        a->count[i] = (a->op == OP_XOR)
+                          ? XorTransitions(ta, na, tb, nb, out)
+                          : MergeTransitions(a->op, ta, na, tb, nb, out);
+    }
+}
+
+/// Apply a boolean operation (OP_AND, OP_OR, OP_XOR) to two transition
+/// images, merging the sorted transitions of each pair of rows.
+/// Requires: the images must be of the same size.
+/// On success, a new transition image is returned.
+/// (The caller is responsible for destroying the returned image!)
+TransitionImage TransitionImageOp(const TransitionImage timg1,
+                                  const TransitionImage timg2, uint8 op) {
+    assert(timg1 != NULL && timg2 != NULL);
+    check(timg1->width == timg2->width && timg1->height == timg2->height,
+          "size");
+
+    InstrTraceBegin("TransitionImageOp");
+    uint32 height = timg1->height;
+    // uma linha do resultado tem no máximo na + nb + 1 transições
+    // (mais uma, se WHITE op WHITE é BLACK)
+    TransitionImage result = AllocateTransitionImage(
+        timg1->width, height,
+        timg1->start[height] + timg2->start[height] + height);
+    for (uint32 i = 0; i <= height; i++)
+        result->start[i] = timg1->start[i] + timg2->start[i] + i;
+
+    uint32 *count = InstrMalloc(height * sizeof(uint32));
+    check(count != NULL, "malloc");
+    TransitionOpArgs args = {timg1, timg2, op, result, count};
+    ParallelRows(height, NumBands(height), TransitionOpBand, &args);
+    CompactTransitions(result, count);
+    InstrFree(count);
+    InstrTraceEnd("TransitionImageOp");
+    return result;
+}
+
+/// TIFF (CCITT Group 4) file operations
+
+// CCITT T.6 (Group 4) codes the same modes as the row-delta coding above,
+// but as variable length bit codes, with the runs of horizontal mode
+// coded with the Modified Huffman tables of T.4.
+// Rows are decoded straight to transitions and then to RLE rows, and
+// coded from the RLE rows, so no RAW pixel buffer is ever used.
+
+// Códigos dos runs brancos 0..63 (terminating codes)
+static const char *G4WhiteTerm[64] = {
+    "00110101", "000111",   "0111",     "1000",     "1011",     "1100",
+    "1110",     "1111",     "10011",    "10100",    "00111",    "01000",
+    "001000",   "000011",   "110100",   "110101",   "101010",   "101011",
+    "0100111",  "0001100",  "0001000",  "0010111",  "0000011",  "0000100",
+    "0101000",  "0101011",  "0010011",  "0100100",  "0011000",  "00000010",
+    "00000011", "00011010", "00011011", "00010010", "00010011", "00010100",
+    "00010101", "00010110", "00010111", "00101000", "00101001", "00101010",
+    "00101011", "00101100", "00101101", "00000100", "00000101", "00001010",
+    "00001011", "01010010", "01010011", "01010100", "01010101", "00100100",
+    "00100101", "01011000", "01011001", "01011010", "01011011", "01001010",
+    "01001011", "00110010", "00110011", "00110100"};
+
+// Códigos dos runs pretos 0..63 (terminating codes)
+static const char *G4BlackTerm[64] = {
+    "0000110111",   "010",          "11",           "10",
+    "011",          "0011",         "0010",         "00011",
+    "000101",       "000100",       "0000100",      "0000101",
+    "0000111",      "00000100",     "00000111",     "000011000",
+    "0000010111",   "0000011000",   "0000001000",   "00001100111",
+    "00001101000",  "00001101100",  "00000110111",  "00000101000",
+    "00000010111",  "00000011000",  "000011001010", "000011001011",
+    "000011001100", "000011001101", "000001101000", "000001101001",
+    "000001101010", "000001101011", "000011010010", "000011010011",
+    "000011010100", "000011010101", "000011010110", "000011010111",
+    "000001101100", "000001101101", "000011011010", "000011011011",
+    "000001010100", "000001010101", "000001010110", "000001010111",
+    "000001100100", "000001100101", "000001010010", "000001010011",
+    "000000100100", "000000110111", "000000111000", "000000100111",
+    "000000101000", "000001011000", "000001011001", "000000101011",
+    "000000101100", "000001011010", "000001100110", "000001100111"};
+
+// Códigos dos runs brancos 64, 128, ..., 1728 (makeup codes)
+static const char *G4WhiteMakeup[27] = {
+    "11011",     "10010",     "010111",    "0110111",   "00110110",
+    "00110111",  "01100100",  "01100101",  "01101000",  "01100111",
+    "011001100", "011001101", "011010010", "011010011", "011010100",
+    "011010101", "011010110", "011010111", "011011000", "011011001",
+    "011011010", "011011011", "010011000", "010011001", "010011010",
+    "011000",    "010011011"};
+
+// Códigos dos runs pretos 64, 128, ..., 1728 (makeup codes)
+static const char *G4BlackMakeup[27] = {
+    "0000001111",    "000011001000",  "000011001001",  "000001011011",
+    "000000110011",  "000000110100",  "000000110101",  "0000001101100",
+    "0000001101101", "0000001001010", "0000001001011", "0000001001100",
+    "0000001001101", "0000001110010", "0000001110011", "0000001110100",
+    "0000001110101", "0000001110110", "0000001110111", "0000001010010",
+    "0000001010011", "0000001010100", "0000001010101", "0000001011010",
+    "0000001011011", "0000001100100", "0000001100101"};
+
+// Códigos dos runs 1792, 1856, ..., 2560 (iguais para as duas cores)
+static const char *G4ExtMakeup[13] = {
+    "00000001000",  "00000001100",  "00000001101",  "000000010010",
+    "000000010011", "000000010100", "000000010101", "000000010110",
+    "000000010111", "000000011100", "000000011101", "000000011110",
+    "000000011111"};
+
+// Códigos dos modos, indexados como em DeltaMode (0..6 = VL3..VR3)
+static const char *G4ModeCodes[9] = {"0000010", "000010", "010",
+                                     "1",       "011",    "000011",
+                                     "0000011", "0001",   "001"};
+
+#define G4_EOL "000000000001" // two of them make the EOFB
+#define G4_MAX_CODE 13        // maximum length of a run code
+#define G4_MAX_MODE 7         // maximum length of a mode code
+
+/// A bit code
+typedef struct {
+    uint16 bits;
+    uint8 len;
+} G4Code;
+
+/// An entry of a decoding table, indexed by the next bits of the input
+typedef struct {
+    int16_t value; // run length or mode, -1 if no code matches
+    uint8 len;
+} G4Entry;
+
+// Tabelas de códigos (para codificar) e de descodificação, por cor
+static G4Code G4RunCode[2][2561]; // só para 0..63 e múltiplos de 64
+static G4Entry G4RunTable[2][1 << G4_MAX_CODE];
+static G4Code G4ModeCode[9];
+static G4Entry G4ModeTable[1 << G4_MAX_MODE];
+static pthread_once_t G4TablesOnce = PTHREAD_ONCE_INIT;
+
+static G4Code G4ParseCode(const char *str) {
+    G4Code c = {0, 0};
+    for (; *str != '\0'; str++) {
+        c.bits = (uint16)((c.bits << 1) | (*str == '1'));
+        c.len++;
+    }
+    return c;
+}
+
+/// Add a code to a decoding table indexed by maxlen bits
+static void G4AddCode(G4Entry *table, int maxlen, G4Code c, int value) {
+    int shift = maxlen - c.len;
+    for (int suffix = 0; suffix < (1 << shift); suffix++) {
+        table[(c.bits << shift) | suffix].value = (int16_t)value;
+        table[(c.bits << shift) | suffix].len = c.len;
+    }
+}
+
+static void G4InitTables(void) {
+    for (int color = 0; color < 2; color++) {
+        for (int i = 0; i < (1 << G4_MAX_CODE); i++)
+            G4RunTable[color][i].value = -1;
+        const char **term = (color == WHITE) ? G4WhiteTerm : G4BlackTerm;
+        const char **makeup = (color == WHITE) ? G4WhiteMakeup : G4BlackMakeup;
+        for (int r = 0; r < 64; r++)
+            G4RunCode[color][r] = G4ParseCode(term[r]);
+        for (int i = 0; i < 27; i++)
+            G4RunCode[color][64 * (i + 1)] = G4ParseCode(makeup[i]);
+        for (int i = 0; i < 13; i++)
+            G4RunCode[color][1792 + 64 * i] = G4ParseCode(G4ExtMakeup[i]);
+        for (int r = 0; r <= 2560; r++)
+            if (r < 64 || r % 64 == 0)
+                G4AddCode(G4RunTable[color], G4_MAX_CODE, G4RunCode[color][r],
+                          r);
+    }
+    for (int i = 0; i < (1 << G4_MAX_MODE); i++)
+        G4ModeTable[i].value = -1;
+    for (int m = 0; m < 9; m++) {
+        G4ModeCode[m] = G4ParseCode(G4ModeCodes[m]);
+        G4AddCode(G4ModeTable, G4_MAX_MODE, G4ModeCode[m], m);
+    }
+}
+
+/// Growable buffer of bits, written most significant bit first
+typedef struct {
+    uint8 *data;
+    size_t size; // bytes used (including the partial last byte)
+    size_t cap;
+    int free_bits; // bits still free in the last byte
+} BitWriter;
+
+static void BitPut(BitWriter *bw, uint32 bits, int len) {
+    while (len > 0) {
+        if (bw->free_bits == 0) {
+            if (bw->size == bw->cap) {
+                bw->cap = (bw->cap > 0) ? 2 * bw->cap : 4096;
+                bw->data = InstrRealloc(bw->data, bw->cap);
+                check(bw->data != NULL, "realloc");
+            }
+            bw->data[bw->size++] = 0;
+            bw->free_bits = 8;
+        }
+        int n = (len < bw->free_bits) ? len : bw->free_bits;
+        uint8 chunk = (bits >> (len - n)) & ((1u << n) - 1);
+        bw->data[bw->size - 1] |= chunk << (bw->free_bits - n);
+        bw->free_bits -= n;
+        len -= n;
+    }
+}
+
+static void BitPutCode(BitWriter *bw, G4Code c) { BitPut(bw, c.bits, c.len); }
+
+/// Put the codes of a run of the given color
+static void G4PutRun(BitWriter *bw, int color, int run) {
+    while (run >= 2560 + 64) {
+        BitPutCode(bw, G4RunCode[color][2560]);
+        run -= 2560;
+    }
+    if (run >= 64) {
+        BitPutCode(bw, G4RunCode[color][run & ~63]);
+        run &= 63;
+    }
+    BitPutCode(bw, G4RunCode[color][run]);
+}
+
+/// Reader of bits, most significant bit first
+typedef struct {
+    const uint8 *data;
+    size_t size;
+    size_t pos;    // next bit to read
+    int reversed;  // bits are stored least significant first (FillOrder 2)
+} BitReader;
+
+/// Peek the next n bits (zeros past the end of the data), n <= 24
+static uint32 BitPeek(const BitReader *br, int n) {
+    size_t byte = br->pos / 8;
+    uint32 v = 0;
+    for (int i = 0; i < 4; i++) {
+        uint8 b = (byte + i < br->size) ? br->data[byte + i] : 0;
+        if (br->reversed) // inverter a ordem dos bits do byte
+            b = (uint8)(((b * 0x0202020202ULL) & 0x010884422010ULL) % 1023);
+        v = (v << 8) | b;
+    }
+    return (v << (br->pos % 8)) >> (32 - n);
+}
+
+/// Read a run of the given color (makeup codes followed by a
+/// terminating code). Returns -1 on invalid data.
+static int G4GetRun(BitReader *br, int color) {
+    int run = 0;
+    for (;;) {
+        G4Entry e = G4RunTable[color][BitPeek(br, G4_MAX_CODE)];
+        if (e.value < 0 || br->pos / 8 >= br->size)
+            return -1;
+        br->pos += e.len;
+        run += e.value;
+        if (e.value < 64)
+            return run;
+    }
+}
+
+/// Decode one G4 strip of nrows rows into img, starting at row first.
+/// Returns the number of rows decoded, less than nrows on invalid data.
+static uint32 G4DecodeStrip(Image img, uint32 first, uint32 nrows,
+                            BitReader *br, int invert) {
+    uint32 width = img->width;
+    int *buf = InstrMalloc(2 * ((size_t)width + 1) * sizeof(int));
+    check(buf != NULL, "malloc");
+    int *temp_row = InstrMalloc(((size_t)width + 2) * sizeof(int));
+    check(temp_row != NULL, "malloc");
+    int *ref = buf, *cur = buf + width + 1;
+    uint32 nref = 0; // a linha de referência inicial é branca
+
+    uint32 i = first;
+    for (; i < first + nrows; i++) {
+        uint32 ncur = 0;
+        DeltaState st;
+        DeltaStateInit(&st, ref, nref, width);
+        int ok = 1;
+        while (ok && st.a0 < st.width) {
+            G4Entry e = G4ModeTable[BitPeek(br, G4_MAX_MODE)];
+            if (e.value < 0 || br->pos / 8 >= br->size) {
+                ok = 0;
+                break;
+            }
+            br->pos += e.len;
+            DeltaMode m;
+            m.mode = e.value;
+            if (m.mode == DELTA_HORIZONTAL) {
+                m.r1 = G4GetRun(br, st.color);
+                m.r2 = G4GetRun(br, !st.color);
+            }
+            ok = DeltaDecodeMode(&st, &m, cur, &ncur) == 0;
+        }
+        if (!ok)
+            break;
+        img->row[i] = TransitionsToRow(img, cur, ncur, WHITE ^ invert,
+                                       temp_row);
+        int *tmp = ref;
+        ref = cur;
+        cur = tmp;
+        nref = ncur;
+    }
+    InstrFree(temp_row);
+    InstrFree(buf);
+    return i - first;
+}
+
+/// Read an unsigned integer of n bytes with the byte order of the file
+static uint32 TIFFGet(const uint8 *p, int n, int big_endian) {
+    uint32 v = 0;
+    for (int i = 0; i < n; i++)
+        v |= (uint32)p[big_endian ? i : n - 1 - i] << (8 * (n - 1 - i));
+    return v;
+}
+
+/// Size in bytes of each value of a TIFF field type (0 if unknown)
+static int TIFFTypeSize(uint32 type) {
+    static const int size[13] = {0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8};
+    return (type < 13) ? size[type] : 0;
+}
+
+/// Is the tag one of those used by ImageLoadTIFF?
+static int TIFFTagUsed(uint32 tag) {
+    switch (tag) {
+    case 256: case 257: case 258: case 259: case 262:
+    case 266: case 273: case 278: case 279: case 293:
+        return 1;
+    }
+    return 0;
+}
+
+/// Load a bilevel TIFF file compressed with CCITT Group 4.
+/// Only the first image (IFD) of the file is read.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// If the file cannot be read or is not a valid G4 TIFF file,
+/// returns NULL and sets errno (EINVAL for invalid contents).
+Image ImageLoadTIFF(const char *filename) { ///
+    InstrTraceBegin("ImageLoadTIFF");
+    pthread_once(&G4TablesOnce, G4InitTables);
+
+    FILE *f = NULL;
+    uint8 *data = NULL;
+    Image img = NULL;
+    uint32 nrows = 0; // linhas já descodificadas
+
+    if ((f = fopen(filename, "rb")) == NULL)
+        goto fail;
+    long file_size = -1;
+    if (fseek(f, 0, SEEK_END) != 0 || (file_size = ftell(f)) < 0) {
+        fclose(f);
+        goto fail;
+    }
+    if (file_size < 8) {
+        fclose(f);
+        goto invalid;
+    }
+    rewind(f);
+    data = InstrMalloc(file_size);
+    check(data != NULL, "malloc");
+    size_t nread = fread(data, 1, file_size, f);
+    fclose(f);
+    if (nread != (size_t)file_size)
+        goto invalid;
+
+    // Parse TIFF header
+    if (!((data[0] == 'I' && data[1] == 'I') ||
+          (data[0] == 'M' && data[1] == 'M')))
+        goto invalid;
+    int be = (data[0] == 'M');
+    if (TIFFGet(data + 2, 2, be) != 42)
+        goto invalid;
+    uint32 ifd = TIFFGet(data + 4, 4, be);
+    if ((uint64)ifd + 2 > (uint64)file_size)
+        goto invalid;
+    uint32 nentries = TIFFGet(data + ifd, 2, be);
+    if ((uint64)ifd + 2 + 12 * nentries > (uint64)file_size)
+        goto invalid;
+
+    uint32 width = 0, height = 0, compression = 1, photometric = 0;
+    uint32 fill_order = 1, rows_per_strip = UINT32_MAX, t6_options = 0;
+    uint32 bits_per_sample = 1;
+    uint32 nstrips = 0, nbytecounts = 0;
+    const uint8 *strip_offsets = NULL, *strip_bytes = NULL;
+    int offsets_size = 4, bytes_size = 4;
+    for (uint32 e = 0; e < nentries; e++) {
+        const uint8 *entry = data + ifd + 2 + 12 * e;
+        uint32 tag = TIFFGet(entry, 2, be);
+        uint32 type = TIFFGet(entry + 2, 2, be);
+        uint32 count = TIFFGet(entry + 4, 4, be);
+        // as outras tags (Software, DateTime, ...) não são lidas
+        if (!TIFFTagUsed(tag))
+            continue;
+        // BYTE, SHORT ou LONG
+        if (!((type == 1 || type == 3 || type == 4) && count > 0))
+            goto invalid;
+        int size = TIFFTypeSize(type);
+        const uint8 *value = entry + 8;
+        if ((uint64)count * size > 4) {
+            uint32 offset = TIFFGet(entry + 8, 4, be);
+            if (offset + (uint64)count * size > (uint64)file_size)
+                goto invalid;
+            value = data + offset;
+        }
+        uint32 v = TIFFGet(value, size, be);
+        switch (tag) {
+        case 256: width = v; break;
+        case 257: height = v; break;
+        case 258: bits_per_sample = v; break;
+        case 259: compression = v; break;
+        case 262: photometric = v; break;
+        case 266: fill_order = v; break;
+        case 273: strip_offsets = value; nstrips = count; offsets_size = size;
+            break;
+        case 278: rows_per_strip = v; break;
+        case 279: strip_bytes = value; nbytecounts = count; bytes_size = size;
+            break;
+        case 293: t6_options = v; break;
+        }
+    }
+    // cada linha tem pelo menos um código de modo (1 bit) no ficheiro
+    if (width == 0 || width > INT32_MAX || height == 0 || height > INT32_MAX ||
+        height > 8 * (uint64)file_size)
+        goto invalid;
+    // só imagens bilevel, em CCITT Group 4 e sem o modo não comprimido
+    if (bits_per_sample != 1 || compression != 4 || photometric > 1 ||
+        (t6_options & 2) != 0)
+        goto invalid;
+    if (strip_offsets == NULL || strip_bytes == NULL ||
+        nstrips != nbytecounts || rows_per_strip == 0)
+        goto invalid;
+    if (rows_per_strip > height)
+        rows_per_strip = height;
+    if (nstrips != (height + rows_per_strip - 1) / rows_per_strip)
+        goto invalid;
+
+    img = AllocateImageHeader(width, height);
+    for (uint32 s = 0; s < nstrips; s++) {
+        uint32 offset = TIFFGet(strip_offsets + s * offsets_size,
+                                offsets_size, be);
+        uint32 nbytes = TIFFGet(strip_bytes + s * bytes_size, bytes_size, be);
+        if ((uint64)offset + nbytes > (uint64)file_size)
+            goto invalid;
+        BitReader br = {data + offset, nbytes, 0, fill_order == 2};
+        uint32 first = s * rows_per_strip;
+        uint32 n = (height - first < rows_per_strip) ? height - first
+                                                     : rows_per_strip;
+        // Com BlackIsZero (photometric 1), os runs "brancos" são pretos
+        nrows += G4DecodeStrip(img, first, n, &br, photometric == 1);
+        if (nrows < first + n)
+            goto invalid;
+    }
+
+    InstrFree(data);
+    GetOccupancy(img);
+    InstrTraceEnd("ImageLoadTIFF");
+    return img;
+
+invalid:
+    errno = EINVAL;
+fail:
+    if (img != NULL)
+        DestroyPartialImage(img, nrows);
+    InstrFree(data);
+    InstrTraceEnd("ImageLoadTIFF");
+    return NULL;
+}
+
+/// Append an unsigned integer of n bytes, in little-endian order
+static uint8 *TIFFPut(uint8 *p, uint32 v, int n) {
+    for (int i = 0; i < n; i++)
+        *p++ = (uint8)(v >> (8 * i));
+    return p;
+}
+
+/// Append a TIFF directory entry with a single SHORT or LONG value
+static uint8 *TIFFPutEntry(uint8 *p, uint16 tag, uint16 type, uint32 v) {
+    p = TIFFPut(p, tag, 2);
+    p = TIFFPut(p, type, 2);
+    p = TIFFPut(p, 1, 4);
+    if (type == 3) // SHORT: à esquerda, completado com zeros
+        return TIFFPut(TIFFPut(p, v, 2), 0, 2);
+    return TIFFPut(p, v, 4);
+}
+
+/// Save image to a bilevel TIFF file compressed with CCITT Group 4
+/// (one strip, WhiteIsZero).
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSaveTIFF(const Image img, const char *filename) { ///
+    assert(img != NULL);
+    InstrTraceBegin("ImageSaveTIFF");
+    pthread_once(&G4TablesOnce, G4InitTables);
+
+    uint32 width = img->width;
+    BitWriter bw = {NULL, 0, 0, 0};
+    int *buf = InstrMalloc(2 * (width + 1) * sizeof(int));
+    check(buf != NULL, "malloc");
+    DeltaMode *modes = InstrMalloc((2 * width + 3) * sizeof(DeltaMode));
+    check(modes != NULL, "malloc");
+    int *ref = buf, *cur = buf + width + 1;
+    uint32 nref = 0;
+
+    for (uint32 i = 0; i < img->height; i++) {
+        uint32 ncur = RowToTransitions(img->row[i], cur);
+        uint32 nmodes = DeltaCodeRow(ref, nref, cur, ncur, width, modes);
+        for (uint32 m = 0; m < nmodes; m++) {
+            BitPutCode(&bw, G4ModeCode[modes[m].mode]);
+            if (modes[m].mode == DELTA_HORIZONTAL) {
+                G4PutRun(&bw, modes[m].color, modes[m].r1);
+                G4PutRun(&bw, !modes[m].color, modes[m].r2);
+            }
+        }
+        int *tmp = ref;
+        ref = cur;
+        cur = tmp;
+        nref = ncur;
+    }
+    // EOFB
+    BitPutCode(&bw, G4ParseCode(G4_EOL));
+    BitPutCode(&bw, G4ParseCode(G4_EOL));
+    InstrFree(modes);
+    InstrFree(buf);
+
+    // Layout: header (8), strip data, IFD (word aligned), resolution values
+    const uint16 nentries = 13;
+    uint32 ifd = 8 + (uint32)bw.size + (bw.size % 2);
+    uint32 res = ifd + 2 + 12 * nentries + 4;
+    uint8 header[8], dir[2 + 12 * 13 + 4 + 16];
+    uint8 *p = header;
+    *p++ = 'I';
+    *p++ = 'I';
+    p = TIFFPut(p, 42, 2);
+    TIFFPut(p, ifd, 4);
+
+    p = TIFFPut(dir, nentries, 2);
+    p = TIFFPutEntry(p, 256, 4, width);         // ImageWidth
+    p = TIFFPutEntry(p, 257, 4, img->height);   // ImageLength
+    p = TIFFPutEntry(p, 258, 3, 1);             // BitsPerSample
+    p = TIFFPutEntry(p, 259, 3, 4);             // Compression: CCITT G4
+    p = TIFFPutEntry(p, 262, 3, 0);             // Photometric: WhiteIsZero
+    p = TIFFPutEntry(p, 273, 4, 8);             // StripOffsets
+    p = TIFFPutEntry(p, 277, 3, 1);             // SamplesPerPixel
+    p = TIFFPutEntry(p, 278, 4, img->height);   // RowsPerStrip
+    p = TIFFPutEntry(p, 279, 4, (uint32)bw.size); // StripByteCounts
+    p = TIFFPut(p, 282, 2);                     // XResolution (RATIONAL)
+    p = TIFFPut(p, 5, 2);
+    p = TIFFPut(p, 1, 4);
+    p = TIFFPut(p, res, 4);
+    p = TIFFPut(p, 283, 2);                     // YResolution (RATIONAL)
+    p = TIFFPut(p, 5, 2);
+    p = TIFFPut(p, 1, 4);
+    p = TIFFPut(p, res + 8, 4);
+    p = TIFFPutEntry(p, 293, 4, 0);             // T6Options
+    p = TIFFPutEntry(p, 296, 3, 2);             // ResolutionUnit: inch
+    p = TIFFPut(p, 0, 4);                       // no next IFD
+    for (int r = 0; r < 2; r++) {               // 72/1 dpi
+        p = TIFFPut(p, 72, 4);
+        p = TIFFPut(p, 1, 4);
+    }
+
+    FILE *f = NULL;
+    const uint8 pad = 0;
+    check((f = fopen(filename, "wb")) != NULL, "Open failed");
+    check(fwrite(header, 1, 8, f) == 8, "Writing header failed");
+    check(fwrite(bw.data, 1, bw.size, f) == bw.size, "Writing data failed");
+    if (bw.size % 2 == 1)
+        check(fwrite(&pad, 1, 1, f) == 1, "Writing data failed");
+    check(fwrite(dir, 1, p - dir, f) == (size_t)(p - dir),
+          "Writing directory failed");
+    check(fclose(f) == 0, "Closing file failed");
+
+    InstrFree(bw.data);
+    InstrTraceEnd("ImageSaveTIFF");
+    return 0;
 }
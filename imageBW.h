@@ -14,23 +14,56 @@
 #define IMAGEBW_H
 
 #include <inttypes.h>
+#include <stddef.h>
 
 // Types for non-negative integer values
 typedef uint8_t uint8;
 typedef uint16_t uint16;
 typedef uint32_t uint32;
+typedef uint64_t uint64;
 
 // Type Image is a pointer to image objects
 typedef struct image* Image;
 
+// Type DeltaImage is a pointer to images coded as row deltas
+typedef struct deltaImage* DeltaImage;
+
+// Type ImageView is a pointer to views of a window of an image
+typedef struct imageView* ImageView;
+
+// Type TransitionImage is a pointer to images coded as transition positions
+typedef struct transitionImage* TransitionImage;
+
 // The values for the B and W pixels
 #define BLACK 1  // Black pixel value
 #define WHITE 0  // White pixel value
 
+// The pooling modes for downscaling
+#define POOL_OR 0        // BLACK if any pixel in the block is BLACK
+#define POOL_AND 1       // BLACK if all pixels in the block are BLACK
+#define POOL_MAJORITY 2  // BLACK if more than half the block is BLACK
+
+// The run-length distributions of synthetic images
+#define GEN_GEOMETRIC 0  // geometric, with mean length P
+#define GEN_ZIPF 1       // Zipf, P(length = k) proportional to k^-P
+#define GEN_FIXED 2      // all runs with length P
+
+// Boolean operations on two pixels a, b, as 4-bit truth tables:
+// bit (2*a + b) is the result for the pixel values a and b.
+#define OP_AND 0x8
+#define OP_OR 0xE
+#define OP_XOR 0x6
+#define OP_COPY 0xA  // the result is b
+
 /// Init Image library.  (Call once!)
 /// Currently, simply calibrate instrumentation and set names of counters.
 void ImageInit(void);
 
+/// Set the number of threads used by each row-parallel operation
+/// (at least 1).  Overrides environment variable IMAGEBW_THREADS.
+/// (E.g. 1, when the caller runs several operations in parallel.)
+void ImageSetThreads(uint32 n);
+
 /// Image management functions
 
 /// Create a new BW image, either BLACK or WHITE.
@@ -59,6 +92,24 @@ Image ImageCreate(uint32 width, uint32 height, uint8 val);
 Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
                             uint8 first_value);
 
+/// Generate a synthetic image, directly in RLE form.
+///   width, height : the dimensions of the new image.
+///   dist, param : the distribution of run lengths (GEN_GEOMETRIC, GEN_ZIPF
+///   or GEN_FIXED) and its parameter.
+///   density : the expected fraction of BLACK pixels.  Lengths drawn for
+///   BLACK runs are scaled by 2*density, and for WHITE runs by 2*(1-density).
+///   coherence : the probability of a row being a copy of the row above,
+///   with each color transition moved by -1, 0 or +1 pixels.
+///   seed : the seed of the pseudo-random generator.
+/// The same parameters always generate the same image.
+/// Requires: param >= 1 (or > 0 for GEN_ZIPF), density and coherence
+/// in [0, 1].
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageGenerate(uint32 width, uint32 height, uint8 dist, double param,
+                    double density, double coherence, uint64 seed);
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -80,6 +131,8 @@ void ImageRLEPrint(const Image img);
 /// Only binary PBM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
+/// If the file cannot be read or is not a valid PBM file,
+/// returns NULL and sets errno (EINVAL for invalid contents).
 Image ImageLoad(const char* filename);
 
 /// Save image to PBM file.
@@ -87,6 +140,38 @@ Image ImageLoad(const char* filename);
 /// On failure, does not return, EXITS program!
 int ImageSave(const Image img, const char* filename);
 
+/// Native RLE file operations
+
+/// Save image to a file in the native (binary, versioned) RLE format:
+/// a header, a table of row offsets, the run data and a checksum.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSaveRLE(const Image img, const char* filename);
+
+/// Load an image saved with ImageSaveRLE.
+/// The file is mapped in memory with a single mmap and the rows are used
+/// in place, without any per-row allocation.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// If the file cannot be read or is not a valid RLE file,
+/// returns NULL and sets errno (EINVAL for invalid contents).
+Image ImageLoadRLE(const char* filename);
+
+/// TIFF (CCITT Group 4) file operations
+
+/// Load a bilevel TIFF file compressed with CCITT Group 4.
+/// Rows are decoded straight into RLE rows.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// If the file cannot be read or is not a valid G4 TIFF file,
+/// returns NULL and sets errno (EINVAL for invalid contents).
+Image ImageLoadTIFF(const char* filename);
+
+/// Save image to a bilevel TIFF file compressed with CCITT Group 4.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSaveTIFF(const Image img, const char* filename);
+
 /// Information queries
 
 /// Get image width
@@ -95,6 +180,46 @@ int ImageWidth(const Image img);
 /// Get image height
 int ImageHeight(const Image img);
 
+/// Get the bytes of memory allocated for an image.
+size_t ImageMemoryUsage(const Image img);
+
+/// Occupancy summary
+/// Each image may keep a summary of where its BLACK pixels are,
+/// computed when it is created or loaded (or else on demand).
+/// Operations use it to skip blank rows without looking at them.
+
+/// Get the bounding box of the BLACK pixels of an image:
+/// the columns [*x0, *x1) and the rows [*y0, *y1).
+/// Returns 0 (and an empty box, with all 0) if there are no BLACK pixels.
+int ImageBoundingBox(const Image img, uint32* x0, uint32* y0, uint32* x1,
+                     uint32* y1);
+
+/// Get the number of rows of an image without BLACK pixels.
+uint32 ImageBlankRows(const Image img);
+
+/// Pixel counts and projection profiles
+/// These work directly on the RLE rows, never on raw pixels.
+/// Rows are processed in parallel, using the threads set by ImageSetThreads
+/// or IMAGEBW_THREADS (default: the number of processors).
+
+/// Count the BLACK pixels of an image.
+uint64 ImageCountBlack(const Image img);
+
+/// Count the BLACK pixels of each row of an image.
+/// Requires: counts has space for height elements.
+void ImageRowProfile(const Image img, uint32 counts[]);
+
+/// Count the BLACK pixels of each column of an image.
+/// Requires: counts has space for width elements.
+void ImageColumnProfile(const Image img, uint32 counts[]);
+
+/// Histogram of the lengths of the runs of a given color.
+/// hist[len] counts the runs with len pixels,
+/// and hist[nbins-1] also counts all longer runs.
+/// Requires: nbins > 0 and hist has space for nbins elements.
+void ImageRunHistogram(const Image img, uint8 color, uint32 nbins,
+                       uint64 hist[]);
+
 /// Image comparison
 
 int ImageIsEqual(const Image img1, const Image img2);
@@ -119,6 +244,97 @@ Image ImageOR(const Image img1, const Image img2);
 
 Image ImageXOR(const Image img1, const Image img2);
 
+/// In-place and destination variants
+
+/// These variants store the result in an existing image instead of
+/// allocating a new one.
+/// The arrays of the rows of the destination are reused whenever they have
+/// enough space, so repeating an operation on images with a similar number
+/// of runs allocates no memory.
+/// The destination may also be one of the operands.
+/// Requires: all images must be of the same size.
+
+/// Negate img, in place.
+void ImageNEGInPlace(Image img);
+
+/// Store img1 AND img2 in dst.
+void ImageANDInto(Image dst, const Image img1, const Image img2);
+
+/// Store img1 OR img2 in dst.
+void ImageORInto(Image dst, const Image img1, const Image img2);
+
+/// Store img1 XOR img2 in dst.
+void ImageXORInto(Image dst, const Image img1, const Image img2);
+
+/// Translation and compositing
+
+/// Translate an image by dx columns and dy rows (right and down, if
+/// positive).  Pixels moved out of the image are lost, and the pixels
+/// left uncovered are WHITE.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageTranslate(const Image img, int dx, int dy);
+
+/// Combine src into dst, in place, with the top left corner of src at
+/// column x and row y of dst (which may be negative).
+/// Each pixel a of dst under a pixel b of src becomes (a op b), for a
+/// boolean operation op (OP_AND, OP_OR, OP_XOR or OP_COPY); the parts of
+/// src outside dst are ignored.  Only the rows of dst under src are
+/// rebuilt, merging their runs with the runs of src.
+/// Requires: dst and src must be different images.
+void ImageBlit(Image dst, const Image src, int x, int y, uint8 op);
+
+/// Reductions of many images
+
+/// These functions apply a boolean operation to n images at once,
+/// merging the runs of the n rows in a single sweep, in
+/// O(total runs * log n) time per row and without intermediate images.
+/// A pixel of the result is BLACK if it is BLACK in all images (AND),
+/// in some image (OR) or in an odd number of images (XOR).
+/// Requires: n > 0 and all images must be of the same size.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+Image ImageANDMany(const Image imgs[], uint32 n);
+
+Image ImageORMany(const Image imgs[], uint32 n);
+
+Image ImageXORMany(const Image imgs[], uint32 n);
+
+/// Boolean functions of many images
+
+/// A boolean function of n images (1 <= n <= 8) is given by its truth table:
+/// bit i (bit i % 8 of table[i / 8]) is the color of the result where the
+/// colors of the images are the bits of i, imgs[0] being the most
+/// significant.  (For n = 2, OP_AND, OP_OR and OP_XOR are truth tables.)
+/// Functions are evaluated in a single pass per row, merging the runs of
+/// the n rows, without intermediate images.
+/// Requires: all images must be of the same size.
+
+/// Compile a boolean expression over n images to its truth table.
+/// The images are named A (imgs[0]), B, ..., H.  The operators are
+/// ~ (NOT), & (AND), ^ (XOR) and | (OR), in decreasing precedence,
+/// and parentheses may be used.  0 and 1 are the constant colors.
+/// Requires: table has space for 32 elements.
+/// Returns 1 on success, or 0 if the expression is invalid.
+int ImageCompileExpression(const char* expr, uint32 n, uint8 table[]);
+
+/// Apply the boolean function with the given truth table to n images.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageApplyTable(const Image imgs[], uint32 n, const uint8 table[]);
+
+/// Evaluate a boolean expression over n images, e.g. "(A & ~B) | (C ^ D)".
+/// Requires: expr must be valid (see ImageCompileExpression).
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageEvaluate(const char* expr, const Image imgs[], uint32 n);
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -161,4 +377,178 @@ Image ImageReplicateAtBottom(const Image img1, const Image img2);
 /// (The caller is responsible for destroying the returned image!)
 Image ImageReplicateAtRight(const Image img1, const Image img2);
 
+/// Concatenation and tiling
+/// Each row of the result is sized exactly and built in one go, merging
+/// the runs that meet at the boundaries, and repeated rows are shared,
+/// so the cost is linear in the number of runs of the result.
+
+/// Put k images side by side, from left to right.
+/// Requires: k > 0 and the heights of the images must be the same.
+/// Ensures: The original images are not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageConcatRight(const Image imgs[], uint32 k);
+
+/// Stack k images, from top to bottom.
+/// Requires: k > 0 and the widths of the images must be the same.
+/// Ensures: The original images are not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageConcatBottom(const Image imgs[], uint32 k);
+
+/// Tile an image: a grid of nx by ny copies of img.
+/// Requires: nx > 0 and ny > 0.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageTile(const Image img, uint32 nx, uint32 ny);
+
+/// Resolution changes
+
+/// Downscale an image by an integer factor.
+/// Each output pixel pools a (factor x factor) block of input pixels
+/// (smaller blocks at the right and bottom edges).
+///   mode: POOL_OR, POOL_AND or POOL_MAJORITY.
+/// Requires: factor > 0.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageDownscale(const Image img, uint32 factor, uint8 mode);
+
+/// Build an image pyramid: pyramid[l] is img downscaled by 2^(l+1).
+/// Each level is computed from the previous one.
+/// Requires: pyramid has space for levels images.
+///
+/// On success, the new images are stored in pyramid[0..levels-1].
+/// (The caller is responsible for destroying them!)
+void ImagePyramid(const Image img, uint8 mode, uint32 levels,
+                  Image pyramid[]);
+
+/// Row-delta coding
+
+/// Images can also be coded with each row stored as edits against the
+/// transitions (color changes) of the row above, like CCITT Group 4.
+/// Text pages and other vertically coherent images get much smaller.
+/// Delta images are read and written sequentially, row by row, so
+/// operations on them stream through the rows without decoding the
+/// whole image.
+
+/// Encode an image as row deltas.
+/// On success, a new delta image is returned.
+/// (The caller is responsible for destroying the returned image!)
+DeltaImage ImageDeltaEncode(const Image img);
+
+/// Decode a delta image back to a RLE image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageDeltaDecode(const DeltaImage dimg);
+
+/// Destroy the delta image pointed to by (*dimgp).
+/// If (*dimgp)==NULL, no operation is performed.
+/// Ensures: (*dimgp)==NULL.
+void DeltaImageDestroy(DeltaImage* dimgp);
+
+/// Size of the code of a delta image, in bytes.
+size_t DeltaImageSize(const DeltaImage dimg);
+
+/// Count the BLACK pixels of a delta image, streaming through its rows.
+uint64 DeltaImageCountBlack(const DeltaImage dimg);
+
+/// Apply a boolean operation (OP_AND, OP_OR or OP_XOR) to two delta images,
+/// streaming through the rows of both.
+/// Requires: the images must be of the same size.
+/// On success, a new delta image is returned.
+/// (The caller is responsible for destroying the returned image!)
+DeltaImage DeltaImageOp(const DeltaImage dimg1, const DeltaImage dimg2,
+                        uint8 op);
+
+/// Sub-image views
+
+/// A view refers to a rectangular window of an image, without copying it:
+/// the runs of the rows of the image are trimmed to the window as they
+/// are read.  A view is valid while its image exists and is not changed.
+
+/// Create a view of the width x height window of img whose top left
+/// corner is at column x and row y.
+/// Requires: width > 0, height > 0 and the window must lie inside img.
+/// (The caller is responsible for destroying the returned view!)
+ImageView ImageViewCreate(const Image img, uint32 x, uint32 y, uint32 width,
+                          uint32 height);
+
+/// Destroy the view pointed to by (*viewp).  The image is not changed.
+/// If (*viewp)==NULL, no operation is performed.
+/// Ensures: (*viewp)==NULL.
+void ImageViewDestroy(ImageView* viewp);
+
+/// Get view width
+int ImageViewWidth(const ImageView view);
+
+/// Get view height
+int ImageViewHeight(const ImageView view);
+
+/// Count the BLACK pixels of a view.
+uint64 ImageViewCountBlack(const ImageView view);
+
+/// Compare the pixels of two views.
+int ImageViewIsEqual(const ImageView view1, const ImageView view2);
+
+/// Apply a boolean operation (OP_AND, OP_OR or OP_XOR) to two views.
+/// Requires: the views must be of the same size.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageViewOp(const ImageView view1, const ImageView view2, uint8 op);
+
+/// Copy the pixels of a view to a new image (crop).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageViewCopy(const ImageView view);
+
+/// Save a view to PBM file.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageViewSave(const ImageView view, const char* filename);
+
+/// Transition-coordinate images
+
+/// Images can also be coded with each row stored as the sorted positions
+/// of its transitions (the columns where the color changes, starting
+/// from WHITE), instead of run lengths.  The color of any pixel is then
+/// found by binary search, and boolean operations are merges of sorted
+/// lists (XOR is their symmetric difference), done in parallel by bands
+/// of rows.  Converting from and to RLE images is linear in the runs.
+
+/// Convert an image to transition coordinates.
+/// On success, a new transition image is returned.
+/// (The caller is responsible for destroying the returned image!)
+TransitionImage ImageToTransitions(const Image img);
+
+/// Convert a transition image back to a RLE image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image TransitionImageToImage(const TransitionImage timg);
+
+/// Destroy the transition image pointed to by (*timgp).
+/// If (*timgp)==NULL, no operation is performed.
+/// Ensures: (*timgp)==NULL.
+void TransitionImageDestroy(TransitionImage* timgp);
+
+/// Get the color of pixel (x, y) of a transition image, in O(log runs).
+/// Requires: x < width and y < height.
+int TransitionImagePixel(const TransitionImage timg, uint32 x, uint32 y);
+
+/// Count the BLACK pixels of a transition image.
+uint64 TransitionImageCountBlack(const TransitionImage timg);
+
+/// Apply a boolean operation (OP_AND, OP_OR or OP_XOR) to two transition
+/// images.
+/// Requires: the images must be of the same size.
+/// On success, a new transition image is returned.
+/// (The caller is responsible for destroying the returned image!)
+TransitionImage TransitionImageOp(const TransitionImage timg1,
+                                  const TransitionImage timg2, uint8 op);
+
 #endif
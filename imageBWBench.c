@@ -0,0 +1,277 @@
+// imageBWBench - Complexity scaling harness for the imageBW module.
+//
+// For each operation, two sweeps are made over synthetic images:
+//   width: the width grows, with a fixed number of runs per row;
+//   runs:  the number of runs per row grows, with a fixed width.
+// Each point measures the time per call, the instrumentation counters and
+// the peak memory allocated by the call.  Then, the slope of log(cost)
+// against log(width) or log(runs) is fitted by least squares: it is the
+// empirical exponent of the cost in that parameter.
+// Operations on RLE rows should cost O(runs), so their time slope should be
+// near 0 in the width sweep and near 1 in the runs sweep.  Operations whose
+// slope exceeds the expected exponent by more than a tolerance are flagged.
+//
+// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+// 2024
+
+#include <inttypes.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "imageBW.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageBWBench [-quick] [-csv FILE] [OPERATION]...\n"
+    "  Measure how the cost of each OPERATION (default: all) scales with\n"
+    "  the image width and with the number of runs per row, and flag\n"
+    "  operations that scale worse than expected.\n"
+    "  -quick     Use fewer and smaller sizes.\n"
+    "  -csv FILE  Write every measurement to FILE.\n"
+    "  Exits with status 1 if any operation is flagged.\n"
+    ;
+
+#define HEIGHT 256          // rows of every benchmark image
+#define FIXED_RUNS 32       // runs per row in the width sweep
+#define FIXED_WIDTH 65536   // width in the runs sweep
+#define MIN_TIME 0.01       // seconds of repeated calls per measurement
+#define REPEATS 3           // measurements per point (the minimum is used)
+#define TOLERANCE 0.3       // slope allowed above the expected exponent
+
+// Benchmarked operations: apply to images a (and b), destroying the result.
+
+static void BenchNEG(Image a, Image b) {
+  (void)b;
+  Image r = ImageNEG(a);
+  ImageDestroy(&r);
+}
+
+static void BenchAND(Image a, Image b) {
+  Image r = ImageAND(a, b);
+  ImageDestroy(&r);
+}
+
+static void BenchOR(Image a, Image b) {
+  Image r = ImageOR(a, b);
+  ImageDestroy(&r);
+}
+
+static void BenchXOR(Image a, Image b) {
+  Image r = ImageXOR(a, b);
+  ImageDestroy(&r);
+}
+
+static void BenchEqual(Image a, Image b) {
+  ImageIsEqual(a, b);
+}
+
+static void BenchCount(Image a, Image b) {
+  (void)b;
+  ImageCountBlack(a);
+}
+
+static void BenchHMirror(Image a, Image b) {
+  (void)b;
+  Image r = ImageHorizontalMirror(a);
+  ImageDestroy(&r);
+}
+
+static void BenchVMirror(Image a, Image b) {
+  (void)b;
+  Image r = ImageVerticalMirror(a);
+  ImageDestroy(&r);
+}
+
+static void BenchRepB(Image a, Image b) {
+  Image r = ImageReplicateAtBottom(a, b);
+  ImageDestroy(&r);
+}
+
+static void BenchRepR(Image a, Image b) {
+  Image r = ImageReplicateAtRight(a, b);
+  ImageDestroy(&r);
+}
+
+static void BenchDown(Image a, Image b) {
+  (void)b;
+  Image r = ImageDownscale(a, 2, POOL_MAJORITY);
+  ImageDestroy(&r);
+}
+
+static void BenchDelta(Image a, Image b) {
+  (void)b;
+  DeltaImage d = ImageDeltaEncode(a);
+  DeltaImageDestroy(&d);
+}
+
+typedef struct {
+  const char* name;
+  void (*fn)(Image a, Image b);
+  double width_exp;   // expected exponent in the width
+  double runs_exp;    // expected exponent in the runs per row
+} BenchOp;
+
+static const BenchOp OPS[] = {
+  {"neg", BenchNEG, 0.0, 1.0},
+  {"and", BenchAND, 0.0, 1.0},
+  {"or", BenchOR, 0.0, 1.0},
+  {"xor", BenchXOR, 0.0, 1.0},
+  {"equal", BenchEqual, 0.0, 1.0},
+  {"count", BenchCount, 0.0, 1.0},
+  {"hmirror", BenchHMirror, 0.0, 1.0},
+  {"vmirror", BenchVMirror, 0.0, 1.0},
+  {"repb", BenchRepB, 0.0, 1.0},
+  {"repr", BenchRepR, 0.0, 1.0},
+  {"down", BenchDown, 0.0, 1.0},
+  {"delta", BenchDelta, 0.0, 1.0},
+};
+#define NUMOPS (sizeof(OPS) / sizeof(OPS[0]))
+
+// Monotonic wall-clock time in seconds
+static double WallTime(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + 1.0e-9 * (double)t.tv_nsec;
+}
+
+// Number of runs of an image, per row
+static double RunsPerRow(Image img) {
+  uint64 white, black;
+  ImageRunHistogram(img, WHITE, 1, &white);
+  ImageRunHistogram(img, BLACK, 1, &black);
+  return (double)(white + black) / ImageHeight(img);
+}
+
+typedef struct {
+  double x;       // the swept parameter: width or runs per row
+  double time;    // seconds per call
+  double ops;     // instrumentation counters (pixmem + bol_ops) per call
+  double mem;     // peak bytes allocated during a call
+} Point;
+
+// Measure op on images a and b.
+static Point Measure(const BenchOp* op, Image a, Image b, double x) {
+  Point p;
+  p.x = x;
+
+  // Counters and memory of a single call
+  InstrReset();
+  size_t live = InstrMemLive();
+  op->fn(a, b);
+  p.ops = (double)(InstrCount[0] + InstrCount[1]);
+  p.mem = (double)(InstrMemPeak() - live);
+
+  // Best time per call, among some measurements of repeated calls
+  p.time = HUGE_VAL;
+  for (int r = 0; r < REPEATS; r++) {
+    long calls = 0;
+    double start = WallTime();
+    double elapsed;
+    do {
+      op->fn(a, b);
+      calls++;
+      elapsed = WallTime() - start;
+    } while (elapsed < MIN_TIME);
+    if (elapsed / calls < p.time) p.time = elapsed / calls;
+  }
+  return p;
+}
+
+// Least squares slope of log(y) against log(x), over the points with y > 0.
+// Returns NAN if there are less than two such points.
+static double Slope(const Point pts[], int n, size_t offset) {
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  int m = 0;
+  for (int i = 0; i < n; i++) {
+    double y = *(const double*)((const char*)&pts[i] + offset);
+    if (y <= 0) continue;
+    double lx = log(pts[i].x), ly = log(y);
+    sx += lx; sy += ly; sxx += lx * lx; sxy += lx * ly;
+    m++;
+  }
+  double d = m * sxx - sx * sx;
+  if (m < 2 || d == 0) return NAN;
+  return (m * sxy - sx * sy) / d;
+}
+
+// Run one sweep of op, print its slopes, and return whether it is flagged.
+//   sweep: "width" or "runs".
+static int Sweep(const BenchOp* op, const char* sweep, int quick, FILE* csv) {
+  int by_width = (strcmp(sweep, "width") == 0);
+  int npoints = quick ? 4 : 7;
+  Point pts[npoints];
+
+  for (int i = 0; i < npoints; i++) {
+    uint32 width = by_width ? (1024u << i) : FIXED_WIDTH;
+    uint32 runs = by_width ? FIXED_RUNS : (8u << i);
+    double mean = (double)width / runs;
+    Image a = ImageGenerate(width, HEIGHT, GEN_GEOMETRIC, mean, 0.5, 0.5, 1);
+    Image b = ImageGenerate(width, HEIGHT, GEN_GEOMETRIC, mean, 0.5, 0.5, 2);
+    double x = by_width ? width : RunsPerRow(a);
+    pts[i] = Measure(op, a, b, x);
+    if (csv != NULL)
+      fprintf(csv, "%s,%s,%u,%u,%.1f,%.9f,%.0f,%.0f\n", op->name, sweep,
+              width, HEIGHT, RunsPerRow(a), pts[i].time, pts[i].ops,
+              pts[i].mem);
+    ImageDestroy(&a);
+    ImageDestroy(&b);
+  }
+
+  double expected = by_width ? op->width_exp : op->runs_exp;
+  double time_slope = Slope(pts, npoints, offsetof(Point, time));
+  double ops_slope = Slope(pts, npoints, offsetof(Point, ops));
+  double mem_slope = Slope(pts, npoints, offsetof(Point, mem));
+  int worse_time = time_slope > expected + TOLERANCE;
+  int worse_mem = mem_slope > expected + TOLERANCE;
+  printf("%-10s%-8s%12.2f%12.2f%12.2f%12.2f  %s\n", op->name, sweep,
+         time_slope, ops_slope, mem_slope, expected,
+         worse_time ? (worse_mem ? "WORSE time, mem" : "WORSE time")
+                    : (worse_mem ? "WORSE mem" : "ok"));
+  fflush(stdout);
+  return worse_time || worse_mem;
+}
+
+int main(int ac, char* av[]) {
+  int quick = 0;
+  FILE* csv = NULL;
+  int k = 1;
+  for (; k < ac && av[k][0] == '-'; k++) {
+    if (strcmp(av[k], "-quick") == 0) {
+      quick = 1;
+    } else if (strcmp(av[k], "-csv") == 0 && k + 1 < ac) {
+      csv = fopen(av[++k], "w");
+      if (csv == NULL) { perror(av[k]); exit(2); }
+      fprintf(csv, "Op,Sweep,Width,Height,Runs,Time,Ops,Mem\n");
+    } else {
+      fprintf(stderr, "\n%s", USAGE);
+      return 2;
+    }
+  }
+
+  ImageInit();
+
+  printf("#%-9s%-8s%12s%12s%12s%12s  %s\n", "op", "sweep", "time_slope",
+         "ops_slope", "mem_slope", "expected", "verdict");
+  int flagged = 0;
+  int found = (k == ac);
+  for (size_t i = 0; i < NUMOPS; i++) {
+    int selected = (k == ac);
+    for (int j = k; j < ac; j++)
+      if (strcmp(av[j], OPS[i].name) == 0) selected = 1;
+    if (!selected) continue;
+    found = 1;
+    flagged += Sweep(&OPS[i], "width", quick, csv);
+    flagged += Sweep(&OPS[i], "runs", quick, csv);
+  }
+  if (csv != NULL) fclose(csv);
+  if (!found) {
+    fprintf(stderr, "\n%s", USAGE);
+    return 2;
+  }
+  printf("# %d sweeps flagged\n", flagged);
+  return (flagged > 0) ? 1 : 0;
+}
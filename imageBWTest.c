@@ -174,8 +174,7 @@ void CompareANDPerformance() {
         result = ImageAND(img1, img2);
         end = clock();
         exec_time = (double)(end - start) / CLOCKS_PER_SEC;
-        /*memory_used = PIXMEM; // para o ImageAND_Uncompressed()*/
-        memory_used = RLEMEM; // para o ImageAND_Without_Uncompress()
+        memory_used = ImageMemoryUsage(result); // memória da imagem resultante
         num_ops = BOL_OPS;
         ImageDestroy(&result); // Limpar imagem resultante
 
@@ -217,21 +216,17 @@ void ANDCompareRandomDirForPlots(const char *input_dir,
 
     while ((entry = readdir(dir)) != NULL) {
         if (entry->d_type == DT_REG) {
-            char file1_path[256], file2_path[256];
+            char file1_path[256];
 
-            // fazer o and de uma imagem com ela mesma
+            // fazer o and de uma imagem com ela mesma (basta carregá-la uma vez)
             snprintf(file1_path, sizeof(file1_path), "%s/%s", input_dir,
                      entry->d_name);
 
-            snprintf(file2_path, sizeof(file2_path), "%s/%s", input_dir,
-                     entry->d_name);
-
             img1 = ImageLoad(file1_path);
-            img2 = ImageLoad(file2_path);
+            img2 = img1;
 
-            if (!img1 || !img2) {
-                fprintf(stderr, "Failed to load images: %s, %s\n", file1_path,
-                        file2_path);
+            if (!img1) {
+                fprintf(stderr, "Failed to load image: %s\n", file1_path);
                 continue;
             }
 
@@ -246,7 +241,6 @@ void ANDCompareRandomDirForPlots(const char *input_dir,
 
             ImageDestroy(&result);
             ImageDestroy(&img1);
-            ImageDestroy(&img2);
         }
     }
 
@@ -10,10 +10,20 @@
 // 2024
 
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <glob.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "imageBW.h"
 #include "instrumentation.h"
@@ -23,11 +33,13 @@ static const char* USAGE =
     "  Apply pipeline of image processing operations to PBM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
-    "  Some operations create images, which are appended to an internal buffer:\n"
-    "      I0, I1, ..., PRED, CURR\n"
+    "  Some operations create images, which are appended to an internal buffer\n"
+    "  and numbered in order of creation: I0, I1, ...\n"
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
+    "  Images may be named, and any image may be selected as CURR again.\n"
+    "  Images that are neither named, PRED nor CURR are freed.\n"
     "\n"
     "FILES:\n"
     "  Currently, only image files in binary PBM format are accepted.\n"
@@ -36,34 +48,121 @@ static const char* USAGE =
     "OPERATIONS:\n"
     "  FILE            Load image from PBM file named FILE.\n"
     "  save FILE       Save CURR to PBM file named FILE.\n"
-    "  info            Show information on CURR (size).\n"
+    "  loadrle FILE    Load image from native RLE file named FILE.\n"
+    "  saverle FILE    Save CURR to native RLE file named FILE.\n"
+    "  loadtiff FILE   Load image from CCITT G4 TIFF file named FILE.\n"
+    "  savetiff FILE   Save CURR to CCITT G4 TIFF file named FILE.\n"
+    "  info            Show information on CURR (size, memory).\n"
+    "  as NAME         Name CURR as NAME.\n"
+    "  @NAME           Select image NAME (or image Ik) as CURR.\n"
+    "  drop NAME       Remove image NAME (or image Ik) from the buffer.\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
     "\n"              
     "  create W,H,C    Create new image with WxH pixels, color C.\n"
     "  chess W,H,E,C   Create new chessboard image with WxH pixels,"
     "                  squares with edge E, first color C.\n"
+    "  gen W,H,D,P,R,V,S\n"
+    "                  Generate new image with WxH pixels, runs with\n"
+    "                  distribution D and parameter P, density R,\n"
+    "                  vertical coherence V and random seed S.\n"
     "\n"              
     "  raw             Print RAW representation of CURR.\n"
     "  rle             Print RLE representation of CURR.\n"
     "\n"              
     "  equal           PREV == CURR?\n"
+    "  count           Count BLACK pixels of CURR.\n"
+    "  bbox            Show the bounding box of the BLACK pixels of CURR.\n"
+    "  profile         Print BLACK pixel counts per row and column of CURR.\n"
     "\n"              
     "  neg             Neg CURR.\n"
     "  and             PREV and CURR.\n"
     "  or              PREV or CURR.\n"
     "  xor             PREV xor CURR.\n"
+    "  andn NAMES      AND of the images NAMES (separated by commas).\n"
+    "  orn NAMES       OR of the images NAMES.\n"
+    "  xorn NAMES      XOR of the images NAMES.\n"
+    "  eval EXPR NAMES Evaluate boolean expression EXPR over the images NAMES,\n"
+    "                  named A, B, ..., H in EXPR (e.g. \"(A&~B)|(C^D)\").\n"
+    "  ineg            Neg CURR, in place.\n"
+    "  iand            PREV and CURR, stored in CURR (in place).\n"
+    "  ior             PREV or CURR, stored in CURR (in place).\n"
+    "  ixor            PREV xor CURR, stored in CURR (in place).\n"
     "\n"              
+    "  shift DX,DY     Translate CURR by DX columns and DY rows.\n"
+    "  blit X,Y,OP     Combine PRED into CURR at (X,Y), in place, with OP\n"
+    "                  (and, or, xor or copy).\n"
+    "\n"
     "  hmirror         Horizontal mirror CURR (flip top-bottom).\n"
     "  vmirror         Vertical mirror CURR (flip left-right).\n"
     "  repb            Replicate CURR at the bottom of PREV.\n"
     "  repr            Replicate CURR at the right of PREV.\n"
+    "  catr NAMES      Concatenate the images NAMES from left to right.\n"
+    "  catb NAMES      Concatenate the images NAMES from top to bottom.\n"
+    "  tile NX,NY      Tile CURR, NX copies across and NY copies down.\n"
+    "  crop X,Y,W,H    Copy the WxH window at (X,Y) of CURR, through a view.\n"
+    "  vequal X,Y,W,H  PREV == CURR, in their WxH windows at (X,Y)?\n"
+    "  vand X,Y,W,H    PREV and CURR, in their WxH windows at (X,Y).\n"
+    "  vor X,Y,W,H     PREV or CURR, in their WxH windows at (X,Y).\n"
+    "  vxor X,Y,W,H    PREV xor CURR, in their WxH windows at (X,Y).\n"
+    "  vsave X,Y,W,H FILE\n"
+    "                  Save the WxH window at (X,Y) of CURR to PBM file FILE.\n"
+    "\n"              
+    "  delta           Code CURR as row deltas and decode it back.\n"
+    "  dand            PREV and CURR, as row deltas.\n"
+    "  dor             PREV or CURR, as row deltas.\n"
+    "  dxor            PREV xor CURR, as row deltas.\n"
+    "  trans           Code CURR as transition positions and decode it back.\n"
+    "  tand            PREV and CURR, as transition positions.\n"
+    "  tor             PREV or CURR, as transition positions.\n"
+    "  txor            PREV xor CURR, as transition positions.\n"
+    "  tpixel X,Y      Show the color of pixel (X,Y) of CURR, by binary search\n"
+    "                  in its transition positions.\n"
+    "  down F,M        Downscale CURR by factor F, pooling mode M.\n"
+    "  pyramid L,M     Create L levels of downscaling by 2 of CURR, mode M.\n"
     "\n"              
+    "BATCH MODE:\n"
+    "  imageTool -batch PATTERN [-pair PATTERN2] [-j THREADS] [-mem MBYTES]\n"
+    "            [OPERATION [OPERAND]]...\n"
+    "  Apply the pipeline to each file matched by PATTERN (a glob pattern or\n"
+    "  a directory), loaded as I0, or to each pair of files matched by\n"
+    "  PATTERN and PATTERN2 (in sorted order), loaded as I0 and I1.\n"
+    "  Files are processed by THREADS workers (default: number of CPUs, at\n"
+    "  most 256), while their estimated memory fits in MBYTES (default: 1024).\n"
+    "  Each operation then uses CPUs / THREADS threads, unless IMAGEBW_THREADS\n"
+    "  is set.\n"
+    "  In operands, {} is replaced by the name of the file (without\n"
+    "  directory and extension).\n"
+    "\n"
+    "SERVER MODE:\n"
+    "  imageTool -server SOCKET [-j THREADS]\n"
+    "  Serve pipelines sent by clients through Unix socket SOCKET, with\n"
+    "  THREADS workers (default: number of CPUs).  Each line received is a\n"
+    "  pipeline, answered with its log and a final \"# status\" line.\n"
+    "  Image files are loaded once and kept resident while unchanged.\n"
+    "  Additional operations:\n"
+    "  keep NAME       Keep CURR resident under NAME.\n"
+    "  use NAME        Use resident image NAME (or resident FILE).\n"
+    "  forget NAME     Forget resident image NAME (or resident FILE).\n"
+    "  list            List resident images.\n"
+    "  shutdown        Stop the server.\n"
+    "  Operations raw, rle and toc print on the server output.\n"
+    "\n"
+    "  imageTool -client SOCKET [OPERATION [OPERAND]]...\n"
+    "  Send the pipeline to the server at SOCKET and print its log.\n"
+    "  Without operations, send each line of standard input.\n"
+    "\n"
     "OPERANDS:\n"
     "  FILE            A filename\n"
     "  W,H             Width and height of image or rectangular region.\n"
     "  C               Color (0 = WHITE, 1 = BLACK).\n"
     "  E               Edge length.\n"
+    "  F, L            Downscale factor, number of pyramid levels.\n"
+    "  M               Pooling mode (0 = OR, 1 = AND, 2 = MAJORITY).\n"
+    "  D, P            Run length distribution: 0 = geometric with mean P,\n"
+    "                  1 = Zipf with exponent P, 2 = fixed length P.\n"
+    "  R, V            Fraction of BLACK pixels, probability of a row\n"
+    "                  following the row above (both in [0, 1]).\n"
     "\n"
     ;
 
@@ -73,6 +172,12 @@ static char* errors[] = {
   "Insufficient images",
   "Insufficient space in buffer",
   "Invalid operand",
+  "Unknown resident image",
+  "Cannot access file",
+  "Unknown image",
+  "Resident image is read-only",
+  "Invalid image file",
+  "Image sizes do not match",
 };
 
 
@@ -84,137 +189,1439 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  if (ac <= 1) {
-    fprintf(stderr, "\n%s", USAGE);
-    return 1;
+// Resident images of the server (see server mode below)
+typedef struct Resident Resident;
+typedef struct Store Store;
+static Image StoreLoad(Store* s, const char* path, Resident** r, int* hit);
+static Image StoreUse(Store* s, const char* name, Resident** r);
+static Resident* StoreKeep(Store* s, const char* name, Image img);
+static int StoreForget(Store* s, const char* name);
+static void StoreList(Store* s, FILE* log);
+static void StoreRelease(Store* s, Resident* r);
+
+// The image buffer
+//
+// Images are appended to the buffer and numbered I0, I1, ... in order of
+// creation.  Slots may be named, and any slot may be selected again as CURR,
+// so several slots may hold the same image, which is reference counted.
+// After each operation, unnamed slots other than PRED and CURR are
+// unreachable and are removed, so that only live images take memory.
+
+typedef struct {
+  Image img;
+  int refs;               // number of slots holding img
+  Resident* res;          // server: resident entry of img, or NULL if owned
+} Held;
+
+typedef struct {
+  int id;                 // the image is I<id>
+  char* name;             // NULL, unless named
+  Held* held;
+} Slot;
+
+typedef struct {
+  Slot* slot;             // slot[n-1] is CURR, slot[n-2] is PRED
+  int n, cap;
+  int next_id;            // id of the next image created
+  Store* store;           // server: the resident images, or NULL
+  FILE* log;
+} Buffer;
+
+static void BufferInit(Buffer* b, Store* store, FILE* log) {
+  b->slot = NULL;
+  b->n = b->cap = 0;
+  b->next_id = 0;
+  b->store = store;
+  b->log = log;
+}
+
+// Append a slot holding held with given id.
+static void BufferAppend(Buffer* b, Held* held, int id) {
+  if (b->n == b->cap) {
+    b->cap = (b->cap > 0) ? 2 * b->cap : 16;
+    b->slot = realloc(b->slot, b->cap * sizeof(Slot));
+    if (b->slot == NULL) { perror("realloc"); exit(2); }
   }
-  
-  FILE *log = stdout;   // where to send log messages
+  held->refs++;
+  b->slot[b->n].id = id;
+  b->slot[b->n].name = NULL;
+  b->slot[b->n].held = held;
+  b->n++;
+}
 
-  ImageInit();
+// Append new image img, as I<next_id>.  (res is its resident entry, if any.)
+static void BufferPush(Buffer* b, Image img, Resident* res) {
+  Held* held = malloc(sizeof(*held));
+  if (held == NULL) { perror("malloc"); exit(2); }
+  held->img = img;
+  held->refs = 0;
+  held->res = res;
+  BufferAppend(b, held, b->next_id++);
+}
+
+// Image in the slot i positions from the top: 1 for CURR, 2 for PRED.
+static Image BufferTop(const Buffer* b, int i) {
+  return b->slot[b->n - i].held->img;
+}
+
+static int BufferTopId(const Buffer* b, int i) {
+  return b->slot[b->n - i].id;
+}
+
+// May CURR be changed in place?  (Resident images are shared.)
+static int BufferTopWritable(const Buffer* b) {
+  return b->slot[b->n - 1].held->res == NULL;
+}
 
+// Remove slot i, destroying its image if no other slot holds it.
+static void BufferRemove(Buffer* b, int i) {
+  Slot* s = &b->slot[i];
+  if (--s->held->refs == 0) {
+    if (s->held->res != NULL) {
+      StoreRelease(b->store, s->held->res);
+    } else {
+      fprintf(b->log, "ImageDestroy(I%d)\n", s->id);
+      ImageDestroy(&s->held->img);
+    }
+    free(s->held);
+  }
+  free(s->name);
+  memmove(s, s + 1, (b->n - i - 1) * sizeof(Slot));
+  b->n--;
+}
+
+// Remove the unnamed slots below PRED.
+static void BufferCollect(Buffer* b) {
+  for (int i = b->n - 3; i >= 0; i--)
+    if (b->slot[i].name == NULL) BufferRemove(b, i);
+}
+
+// Remove all slots, from the top.
+static void BufferClear(Buffer* b) {
+  while (b->n > 0) BufferRemove(b, b->n - 1);
+  free(b->slot);
+  b->slot = NULL;
+  b->cap = 0;
+}
+
+// Find the topmost slot named key, or holding image key = "I<id>".
+// Returns its index, or -1 if there is none.
+static int BufferFind(const Buffer* b, const char* key) {
+  for (int i = b->n - 1; i >= 0; i--)
+    if (b->slot[i].name != NULL && strcmp(b->slot[i].name, key) == 0)
+      return i;
+  int id;
+  char c;
+  if (sscanf(key, "I%d%c", &id, &c) == 1)
+    for (int i = b->n - 1; i >= 0; i--)
+      if (b->slot[i].id == id) return i;
+  return -1;
+}
+
+// Create a view of img from an operand "X,Y,W,H".
+// Returns NULL if the operand is invalid or the window is not inside img.
+static ImageView ParseView(const char* arg, Image img) {
+  uint32 x, y, w, h;
+  if (sscanf(arg, "%u,%u,%u,%u", &x, &y, &w, &h) != 4) return NULL;
+  if (w < 1 || x > (uint32)ImageWidth(img) || w > (uint32)ImageWidth(img) - x)
+    return NULL;
+  if (h < 1 || y > (uint32)ImageHeight(img) ||
+      h > (uint32)ImageHeight(img) - y)
+    return NULL;
+  return ImageViewCreate(img, x, y, w, h);
+}
+
+// The operands of each operation are checked before it is applied, as the
+// module asserts its preconditions, while the batch and the server modes
+// must go on with the other files and clients.  Invalid input files are
+// rejected by the module loaders, which return NULL.
+// (The module still exits when memory is exhausted and on write errors.)
+
+// Can file path be written?  (It is created, if it did not exist.)
+static int Writable(const char* path) {
+  FILE* f = fopen(path, "ab");
+  return f != NULL && fclose(f) == 0;
+}
+
+// Can an image of w x h pixels be created?
+static int ValidSize(uint64 w, uint64 h) {
+  return w > 0 && w <= INT32_MAX && h > 0 && h <= INT32_MAX;
+}
+
+// Are img1 and img2 of the same size?
+static int SameSize(Image img1, Image img2) {
+  return ImageWidth(img1) == ImageWidth(img2) &&
+         ImageHeight(img1) == ImageHeight(img2);
+}
+
+// Apply the pipeline of operations av[k..ac-1] to the image buffer b.
+// New images are appended to the buffer.
+// Returns 0 on success, or the index of the error message in errors[].
+static int RunPipeline(int ac, char* av[], int k, Buffer* b) {
   int err = 0;
+  FILE* log = b->log;
+  Store* store = b->store;
   uint32 w, h;
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];       // the images
-  int n = 0;          // number of images created
-
-  int k = 1;
   while (k < ac) {
+    // Time each operation in a region named after it
+    // (or "load", for file names)
+    InstrRegionBegin(strpbrk(av[k], "./") == NULL ? av[k] : "load");
     if (strcmp(av[k], "info") == 0) {
-      if (n < 1) { err = 2; break; }  // enough input images?
-      fprintf(log, "Info on I%d\n", n-1);
-      w = ImageWidth(img[n-1]);
-      h = ImageHeight(img[n-1]);
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      fprintf(log, "Info on I%d\n", BufferTopId(b, 1));
+      w = ImageWidth(BufferTop(b, 1));
+      h = ImageHeight(BufferTop(b, 1));
       fprintf(log, "# Size: %ux%u\n", w, h);
+      fprintf(log, "# Memory: %zu bytes\n", ImageMemoryUsage(BufferTop(b, 1)));
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
+      InstrRegionReset();
     } else if (strcmp(av[k], "toc") == 0) {
       InstrPrint();
+    } else if (strcmp(av[k], "as") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      int i = BufferFind(b, av[k]);
+      if (i >= 0 && b->slot[i].name != NULL) {  // move name to CURR
+        free(b->slot[i].name);
+        b->slot[i].name = NULL;
+      }
+      fprintf(log, "I%d as %s\n", BufferTopId(b, 1), av[k]);
+      free(b->slot[b->n-1].name);
+      b->slot[b->n-1].name = strdup(av[k]);
+    } else if (av[k][0] == '@') {
+      int i = BufferFind(b, av[k] + 1);
+      if (i < 0) { err = 7; break; }
+      fprintf(log, "%s -> I%d\n", av[k], b->slot[i].id);
+      BufferAppend(b, b->slot[i].held, b->slot[i].id);
+    } else if (strcmp(av[k], "drop") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      int i = BufferFind(b, av[k]);
+      if (i < 0) { err = 7; break; }
+      fprintf(log, "Drop(%s)\n", av[k]);
+      BufferRemove(b, i);
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }  // enough arguments?
-      if (n >= N) { err = 3; break; } // enough space for output?
       uint32 c;  // color
       if (sscanf(av[k], "%u,%u,%u", &w, &h, &c) != 3) { err = 4; break; }
-      if (c > 1) { err = 4; break; }   // precondition check!
-      fprintf(log, "ImageCreate(%u, %u, %u) -> I%d\n", w, h, c, n);
-      img[n] = ImageCreate(w, h, (uint8)c);
-      //x if (img[n] == NULL) { err = 999; break; }
-      n++;
+      // precondition checks!
+      if (c > 1 || !ValidSize(w, h)) { err = 4; break; }
+      fprintf(log, "ImageCreate(%u, %u, %u) -> I%d\n", w, h, c, b->next_id);
+      BufferPush(b, ImageCreate(w, h, (uint8)c), NULL);
     } else if (strcmp(av[k], "chess") == 0) {
       if (++k >= ac) { err = 1; break; }  // enough arguments?
-      if (n >= N) { err = 3; break; } // enough space for output?
       uint32 edge;  // square edge length
       uint32 c;  // color
       if (sscanf(av[k], "%u,%u,%u,%u", &w, &h, &edge, &c) != 4) { err = 4; break; }
-      if (c > 1) { err = 4; break; }   // precondition check!
-      fprintf(log, "ImageCreateChessBoard(%u, %u, %u, %u) -> I%d\n", w, h, edge, c, n);
-      img[n] = ImageCreateChessboard(w, h, edge, (uint8)c);;
-      n++;
+      // precondition checks!
+      if (c > 1 || !ValidSize(w, h)) { err = 4; break; }
+      if (edge < 1 || w % edge != 0 || h % edge != 0) { err = 4; break; }
+      fprintf(log, "ImageCreateChessBoard(%u, %u, %u, %u) -> I%d\n",
+              w, h, edge, c, b->next_id);
+      BufferPush(b, ImageCreateChessboard(w, h, edge, (uint8)c), NULL);
+    } else if (strcmp(av[k], "gen") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      uint32 d;  // distribution
+      double p, r, v;  // parameter, density, coherence
+      uint64 seed;
+      if (sscanf(av[k], "%u,%u,%u,%lf,%lf,%lf,%" SCNu64, &w, &h, &d, &p, &r,
+                 &v, &seed) != 7) { err = 4; break; }
+      // precondition checks!
+      if (d > 2 || !ValidSize(w, h)) { err = 4; break; }
+      if (d == GEN_ZIPF ? !(p > 0.0) : !(p >= 1.0)) { err = 4; break; }
+      if (!(r >= 0.0 && r <= 1.0 && v >= 0.0 && v <= 1.0)) { err = 4; break; }
+      fprintf(log, "ImageGenerate(%u, %u, %u, %g, %g, %g, %" PRIu64 ") -> I%d\n",
+              w, h, d, p, r, v, seed, b->next_id);
+      BufferPush(b, ImageGenerate(w, h, (uint8)d, p, r, v, seed), NULL);
     } else if (strcmp(av[k], "raw") == 0) {
-      if (n < 1) { err = 2; break; }  // enough input images?
-      fprintf(log, "ImageRAWPrint(I%d)\n", n-1);
-      ImageRAWPrint(img[n-1]);
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      fprintf(log, "ImageRAWPrint(I%d)\n", BufferTopId(b, 1));
+      ImageRAWPrint(BufferTop(b, 1));
     } else if (strcmp(av[k], "rle") == 0) {
-      if (n < 1) { err = 2; break; }  // enough input images?
-      fprintf(log, "ImageRLEPrint(I%d)\n", n-1);
-      ImageRLEPrint(img[n-1]);
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      fprintf(log, "ImageRLEPrint(I%d)\n", BufferTopId(b, 1));
+      ImageRLEPrint(BufferTop(b, 1));
     } else if (strcmp(av[k], "equal") == 0) {
-      if (n < 2) { err = 2; break; }  // enough input images?
-      fprintf(log, "ImageIsEqual(I%d, I%d) -> ", n-2, n-1);
-      int eq = ImageIsEqual(img[n-2], img[n-1]);
+      if (b->n < 2) { err = 2; break; }  // enough input images?
+      fprintf(log, "ImageIsEqual(I%d, I%d) -> ",
+              BufferTopId(b, 2), BufferTopId(b, 1));
+      int eq = ImageIsEqual(BufferTop(b, 2), BufferTop(b, 1));
       fprintf(log, "%d\n", eq);
+    } else if (strcmp(av[k], "count") == 0) {
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      fprintf(log, "ImageCountBlack(I%d) -> %" PRIu64 "\n", BufferTopId(b, 1),
+              ImageCountBlack(BufferTop(b, 1)));
+    } else if (strcmp(av[k], "bbox") == 0) {
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      uint32 x0, y0, x1, y1;
+      ImageBoundingBox(BufferTop(b, 1), &x0, &y0, &x1, &y1);
+      fprintf(log, "ImageBoundingBox(I%d) -> %u,%u %u,%u\n",
+              BufferTopId(b, 1), x0, y0, x1, y1);
+      fprintf(log, "ImageBlankRows(I%d) -> %u\n", BufferTopId(b, 1),
+              ImageBlankRows(BufferTop(b, 1)));
+    } else if (strcmp(av[k], "profile") == 0) {
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      Image img = BufferTop(b, 1);
+      int id = BufferTopId(b, 1);
+      w = ImageWidth(img);
+      h = ImageHeight(img);
+      uint32* counts = malloc((w > h ? w : h) * sizeof(uint32));
+      if (counts == NULL) { perror("malloc"); exit(2); }
+      fprintf(log, "ImageRowProfile(I%d) ->", id);
+      ImageRowProfile(img, counts);
+      for (uint32 i = 0; i < h; i++) fprintf(log, " %u", counts[i]);
+      fprintf(log, "\nImageColumnProfile(I%d) ->", id);
+      ImageColumnProfile(img, counts);
+      for (uint32 i = 0; i < w; i++) fprintf(log, " %u", counts[i]);
+      fprintf(log, "\n");
+      free(counts);
     } else if (strcmp(av[k], "neg") == 0) {
-      if (n < 1) { err = 2; break; }  // enough input images?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageNEG(I%d) -> I%d\n", n-1, n);
-      img[n] = ImageNEG(img[n-1]);
-      n++;
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      fprintf(log, "ImageNEG(I%d) -> I%d\n", BufferTopId(b, 1), b->next_id);
+      BufferPush(b, ImageNEG(BufferTop(b, 1)), NULL);
     } else if (strcmp(av[k], "and") == 0) {
-      if (n < 2) { err = 2; break; }  // enough input images?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageAND(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageAND(img[n-2], img[n-1]);
-      n++;
+      if (b->n < 2) { err = 2; break; }  // enough input images?
+      // precondition check!
+      if (!SameSize(BufferTop(b, 2), BufferTop(b, 1))) { err = 10; break; }
+      fprintf(log, "ImageAND(I%d, I%d) -> I%d\n",
+              BufferTopId(b, 2), BufferTopId(b, 1), b->next_id);
+      BufferPush(b, ImageAND(BufferTop(b, 2), BufferTop(b, 1)), NULL);
     } else if (strcmp(av[k], "or") == 0) {
-      if (n < 2) { err = 2; break; }  // enough input images?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageOR(img[n-2], img[n-1]);
-      n++;
+      if (b->n < 2) { err = 2; break; }  // enough input images?
+      // precondition check!
+      if (!SameSize(BufferTop(b, 2), BufferTop(b, 1))) { err = 10; break; }
+      fprintf(log, "ImageOR(I%d, I%d) -> I%d\n",
+              BufferTopId(b, 2), BufferTopId(b, 1), b->next_id);
+      BufferPush(b, ImageOR(BufferTop(b, 2), BufferTop(b, 1)), NULL);
     } else if (strcmp(av[k], "xor") == 0) {
-      if (n < 2) { err = 2; break; }  // enough input images?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageXOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageXOR(img[n-2], img[n-1]);
-      n++;
+      if (b->n < 2) { err = 2; break; }  // enough input images?
+      // precondition check!
+      if (!SameSize(BufferTop(b, 2), BufferTop(b, 1))) { err = 10; break; }
+      fprintf(log, "ImageXOR(I%d, I%d) -> I%d\n",
+              BufferTopId(b, 2), BufferTopId(b, 1), b->next_id);
+      BufferPush(b, ImageXOR(BufferTop(b, 2), BufferTop(b, 1)), NULL);
+    } else if (strcmp(av[k], "andn") == 0 || strcmp(av[k], "orn") == 0 ||
+               strcmp(av[k], "xorn") == 0 || strcmp(av[k], "catr") == 0 ||
+               strcmp(av[k], "catb") == 0) {
+      const char* op = av[k];
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      // the images named in the operand
+      char* names = strdup(av[k]);
+      Image* imgs = malloc((strlen(names) / 2 + 1) * sizeof(Image));
+      if (names == NULL || imgs == NULL) { perror("malloc"); exit(2); }
+      uint32 n = 0;
+      char* save;
+      for (char* name = strtok_r(names, ",", &save); name != NULL;
+           name = strtok_r(NULL, ",", &save)) {
+        int i = BufferFind(b, name);
+        if (i < 0) { err = 7; break; }
+        imgs[n++] = b->slot[i].held->img;
+      }
+      if (err == 0 && n == 0) err = 4;
+      // precondition checks!
+      uint64 width = 0, height = 0;  // of the concatenation
+      for (uint32 i = 0; err == 0 && i < n; i++) {
+        if (op[0] != 'c' && !SameSize(imgs[i], imgs[0])) err = 10;
+        if (op[3] == 'r' && ImageHeight(imgs[i]) != ImageHeight(imgs[0]))
+          err = 10;
+        if (op[3] == 'b' && ImageWidth(imgs[i]) != ImageWidth(imgs[0]))
+          err = 10;
+        width += (uint64)ImageWidth(imgs[i]);
+        height += (uint64)ImageHeight(imgs[i]);
+      }
+      if (err == 0 && op[3] == 'r' && !ValidSize(width, 1)) err = 4;
+      if (err == 0 && op[3] == 'b' && !ValidSize(1, height)) err = 4;
+      if (err == 0) {
+        fprintf(log, "Image%s(%s) -> I%d\n",
+                op[0] == 'a' ? "ANDMany" : op[0] == 'o' ? "ORMany"
+                : op[0] == 'x' ? "XORMany"
+                : op[3] == 'r' ? "ConcatRight" : "ConcatBottom",
+                av[k], b->next_id);
+        Image img = op[0] == 'a' ? ImageANDMany(imgs, n)
+                    : op[0] == 'o' ? ImageORMany(imgs, n)
+                    : op[0] == 'x' ? ImageXORMany(imgs, n)
+                    : op[3] == 'r' ? ImageConcatRight(imgs, n)
+                    : ImageConcatBottom(imgs, n);
+        BufferPush(b, img, NULL);
+      }
+      free(imgs);
+      free(names);
+      if (err > 0) break;
+    } else if (strcmp(av[k], "eval") == 0) {
+      if (k + 2 >= ac) { err = 1; break; }  // enough arguments?
+      const char* expr = av[++k];
+      // the images named in the second operand
+      char* names = strdup(av[++k]);
+      if (names == NULL) { perror("strdup"); exit(2); }
+      Image imgs[8];
+      uint32 n = 0;
+      char* save;
+      for (char* name = strtok_r(names, ",", &save); name != NULL;
+           name = strtok_r(NULL, ",", &save)) {
+        int i = BufferFind(b, name);
+        if (i < 0) { err = 7; break; }
+        if (n == 8) { err = 4; break; }
+        imgs[n++] = b->slot[i].held->img;
+      }
+      free(names);
+      if (err > 0) break;
+      uint8 table[32];
+      if (n == 0 || !ImageCompileExpression(expr, n, table)) { err = 4; break; }
+      uint32 same = 1;   // precondition check!
+      for (uint32 i = 1; i < n; i++) same = same && SameSize(imgs[i], imgs[0]);
+      if (!same) { err = 10; break; }
+      fprintf(log, "ImageEvaluate(\"%s\", %s) -> I%d\n", expr, av[k],
+              b->next_id);
+      BufferPush(b, ImageApplyTable(imgs, n, table), NULL);
+    } else if (strcmp(av[k], "ineg") == 0) {
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      if (!BufferTopWritable(b)) { err = 8; break; }
+      fprintf(log, "ImageNEGInPlace(I%d)\n", BufferTopId(b, 1));
+      ImageNEGInPlace(BufferTop(b, 1));
+    } else if (strcmp(av[k], "iand") == 0) {
+      if (b->n < 2) { err = 2; break; }  // enough input images?
+      if (!BufferTopWritable(b)) { err = 8; break; }
+      // precondition check!
+      if (!SameSize(BufferTop(b, 2), BufferTop(b, 1))) { err = 10; break; }
+      fprintf(log, "ImageANDInto(I%d, I%d, I%d)\n", BufferTopId(b, 1),
+              BufferTopId(b, 2), BufferTopId(b, 1));
+      ImageANDInto(BufferTop(b, 1), BufferTop(b, 2), BufferTop(b, 1));
+    } else if (strcmp(av[k], "ior") == 0) {
+      if (b->n < 2) { err = 2; break; }  // enough input images?
+      if (!BufferTopWritable(b)) { err = 8; break; }
+      // precondition check!
+      if (!SameSize(BufferTop(b, 2), BufferTop(b, 1))) { err = 10; break; }
+      fprintf(log, "ImageORInto(I%d, I%d, I%d)\n", BufferTopId(b, 1),
+              BufferTopId(b, 2), BufferTopId(b, 1));
+      ImageORInto(BufferTop(b, 1), BufferTop(b, 2), BufferTop(b, 1));
+    } else if (strcmp(av[k], "ixor") == 0) {
+      if (b->n < 2) { err = 2; break; }  // enough input images?
+      if (!BufferTopWritable(b)) { err = 8; break; }
+      // precondition check!
+      if (!SameSize(BufferTop(b, 2), BufferTop(b, 1))) { err = 10; break; }
+      fprintf(log, "ImageXORInto(I%d, I%d, I%d)\n", BufferTopId(b, 1),
+              BufferTopId(b, 2), BufferTopId(b, 1));
+      ImageXORInto(BufferTop(b, 1), BufferTop(b, 2), BufferTop(b, 1));
+    } else if (strcmp(av[k], "shift") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      int dx, dy;  // columns and rows to move
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 4; break; }
+      fprintf(log, "ImageTranslate(I%d, %d, %d) -> I%d\n", BufferTopId(b, 1),
+              dx, dy, b->next_id);
+      BufferPush(b, ImageTranslate(BufferTop(b, 1), dx, dy), NULL);
+    } else if (strcmp(av[k], "blit") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (b->n < 2) { err = 2; break; }  // enough input images?
+      if (!BufferTopWritable(b)) { err = 8; break; }
+      int x, y;  // position of PRED in CURR
+      char name[8];  // the operation
+      if (sscanf(av[k], "%d,%d,%7s", &x, &y, name) != 3) { err = 4; break; }
+      uint8 op = strcmp(name, "and") == 0 ? OP_AND
+                 : strcmp(name, "or") == 0 ? OP_OR
+                 : strcmp(name, "xor") == 0 ? OP_XOR
+                 : strcmp(name, "copy") == 0 ? OP_COPY : 0;
+      // precondition check!
+      if (op == 0 || BufferTop(b, 1) == BufferTop(b, 2)) { err = 4; break; }
+      fprintf(log, "ImageBlit(I%d, I%d, %d, %d, %s)\n", BufferTopId(b, 1),
+              BufferTopId(b, 2), x, y, name);
+      ImageBlit(BufferTop(b, 1), BufferTop(b, 2), x, y, op);
     } else if (strcmp(av[k], "hmirror") == 0) {
-      if (n < 1) { err = 2; break; }  // enough input images?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageHorizontalMirror(I%d) -> I%d\n", n-1, n);
-      img[n] = ImageHorizontalMirror(img[n-1]);
-      n++;
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      fprintf(log, "ImageHorizontalMirror(I%d) -> I%d\n",
+              BufferTopId(b, 1), b->next_id);
+      BufferPush(b, ImageHorizontalMirror(BufferTop(b, 1)), NULL);
     } else if (strcmp(av[k], "vmirror") == 0) {
-      if (n < 1) { err = 2; break; }  // enough input images?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageVerticalMirror(I%d) -> I%d\n", n-1, n);
-      img[n] = ImageVerticalMirror(img[n-1]);
-      n++;
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      fprintf(log, "ImageVerticalMirror(I%d) -> I%d\n",
+              BufferTopId(b, 1), b->next_id);
+      BufferPush(b, ImageVerticalMirror(BufferTop(b, 1)), NULL);
     } else if (strcmp(av[k], "repb") == 0) {
-      if (n < 2) { err = 2; break; }  // enough input images?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageReplicateAtBottom(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageReplicateAtBottom(img[n-2], img[n-1]);
-      n++;
+      if (b->n < 2) { err = 2; break; }  // enough input images?
+      // precondition checks!
+      if (ImageWidth(BufferTop(b, 2)) != ImageWidth(BufferTop(b, 1))) {
+        err = 10;
+        break;
+      }
+      if (!ValidSize(1, (uint64)ImageHeight(BufferTop(b, 2)) +
+                        (uint64)ImageHeight(BufferTop(b, 1)))) {
+        err = 4;
+        break;
+      }
+      fprintf(log, "ImageReplicateAtBottom(I%d, I%d) -> I%d\n",
+              BufferTopId(b, 2), BufferTopId(b, 1), b->next_id);
+      BufferPush(b, ImageReplicateAtBottom(BufferTop(b, 2), BufferTop(b, 1)),
+                 NULL);
     } else if (strcmp(av[k], "repr") == 0) {
-      if (n < 2) { err = 2; break; }  // enough input images?
-      if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageReplicateAtRight(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageReplicateAtRight(img[n-2], img[n-1]);
-      n++;
+      if (b->n < 2) { err = 2; break; }  // enough input images?
+      // precondition checks!
+      if (ImageHeight(BufferTop(b, 2)) != ImageHeight(BufferTop(b, 1))) {
+        err = 10;
+        break;
+      }
+      if (!ValidSize((uint64)ImageWidth(BufferTop(b, 2)) +
+                     (uint64)ImageWidth(BufferTop(b, 1)), 1)) {
+        err = 4;
+        break;
+      }
+      fprintf(log, "ImageReplicateAtRight(I%d, I%d) -> I%d\n",
+              BufferTopId(b, 2), BufferTopId(b, 1), b->next_id);
+      BufferPush(b, ImageReplicateAtRight(BufferTop(b, 2), BufferTop(b, 1)),
+                 NULL);
+    } else if (strcmp(av[k], "tile") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      uint32 nx, ny;  // number of copies across and down
+      if (sscanf(av[k], "%u,%u", &nx, &ny) != 2) { err = 4; break; }
+      // precondition check!
+      if (!ValidSize((uint64)nx * (uint64)ImageWidth(BufferTop(b, 1)),
+                     (uint64)ny * (uint64)ImageHeight(BufferTop(b, 1)))) {
+        err = 4;
+        break;
+      }
+      fprintf(log, "ImageTile(I%d, %u, %u) -> I%d\n", BufferTopId(b, 1), nx,
+              ny, b->next_id);
+      BufferPush(b, ImageTile(BufferTop(b, 1), nx, ny), NULL);
+    } else if (strcmp(av[k], "crop") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      ImageView view = ParseView(av[k], BufferTop(b, 1));
+      if (view == NULL) { err = 4; break; }   // precondition check!
+      fprintf(log, "ImageViewCountBlack(I%d[%s]) -> %" PRIu64 "\n",
+              BufferTopId(b, 1), av[k], ImageViewCountBlack(view));
+      fprintf(log, "ImageViewCopy(I%d[%s]) -> I%d\n", BufferTopId(b, 1),
+              av[k], b->next_id);
+      BufferPush(b, ImageViewCopy(view), NULL);
+      ImageViewDestroy(&view);
+    } else if (strcmp(av[k], "vequal") == 0 || strcmp(av[k], "vand") == 0 ||
+               strcmp(av[k], "vor") == 0 || strcmp(av[k], "vxor") == 0) {
+      const char* op = av[k];
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (b->n < 2) { err = 2; break; }  // enough input images?
+      ImageView view1 = ParseView(av[k], BufferTop(b, 2));
+      ImageView view2 = ParseView(av[k], BufferTop(b, 1));
+      if (view1 == NULL || view2 == NULL) {   // precondition check!
+        ImageViewDestroy(&view1);
+        ImageViewDestroy(&view2);
+        err = 4;
+        break;
+      }
+      if (op[1] == 'e') {
+        fprintf(log, "ImageViewIsEqual(I%d[%s], I%d[%s]) -> %d\n",
+                BufferTopId(b, 2), av[k], BufferTopId(b, 1), av[k],
+                ImageViewIsEqual(view1, view2));
+      } else {
+        uint8 bop = op[1] == 'a' ? OP_AND : op[1] == 'o' ? OP_OR : OP_XOR;
+        fprintf(log, "ImageViewOp(I%d[%s], I%d[%s], %s) -> I%d\n",
+                BufferTopId(b, 2), av[k], BufferTopId(b, 1), av[k], op + 1,
+                b->next_id);
+        BufferPush(b, ImageViewOp(view1, view2, bop), NULL);
+      }
+      ImageViewDestroy(&view1);
+      ImageViewDestroy(&view2);
+    } else if (strcmp(av[k], "vsave") == 0) {
+      if (k + 2 >= ac) { err = 1; break; }  // enough arguments?
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      if (!Writable(av[k + 2])) { err = 6; break; }
+      ImageView view = ParseView(av[++k], BufferTop(b, 1));
+      if (view == NULL) { err = 4; break; }   // precondition check!
+      fprintf(log, "ImageViewSave(I%d[%s], \"%s\")\n", BufferTopId(b, 1),
+              av[k], av[k + 1]);
+      ImageViewSave(view, av[++k]);
+      ImageViewDestroy(&view);
+    } else if (strcmp(av[k], "delta") == 0) {
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      DeltaImage dimg = ImageDeltaEncode(BufferTop(b, 1));
+      fprintf(log, "ImageDeltaEncode(I%d) -> %zu bytes\n", BufferTopId(b, 1),
+              DeltaImageSize(dimg));
+      fprintf(log, "DeltaImageCountBlack(I%d) -> %" PRIu64 "\n",
+              BufferTopId(b, 1), DeltaImageCountBlack(dimg));
+      fprintf(log, "ImageDeltaDecode() -> I%d\n", b->next_id);
+      BufferPush(b, ImageDeltaDecode(dimg), NULL);
+      DeltaImageDestroy(&dimg);
+    } else if (strcmp(av[k], "dand") == 0 || strcmp(av[k], "dor") == 0 ||
+               strcmp(av[k], "dxor") == 0) {
+      if (b->n < 2) { err = 2; break; }  // enough input images?
+      // precondition check!
+      if (!SameSize(BufferTop(b, 2), BufferTop(b, 1))) { err = 10; break; }
+      uint8 op = av[k][1] == 'a' ? OP_AND : av[k][1] == 'o' ? OP_OR : OP_XOR;
+      DeltaImage dimg1 = ImageDeltaEncode(BufferTop(b, 2));
+      DeltaImage dimg2 = ImageDeltaEncode(BufferTop(b, 1));
+      DeltaImage dimg = DeltaImageOp(dimg1, dimg2, op);
+      fprintf(log, "DeltaImageOp(I%d, I%d, %s) -> I%d\n",
+              BufferTopId(b, 2), BufferTopId(b, 1), av[k] + 1, b->next_id);
+      BufferPush(b, ImageDeltaDecode(dimg), NULL);
+      DeltaImageDestroy(&dimg);
+      DeltaImageDestroy(&dimg2);
+      DeltaImageDestroy(&dimg1);
+    } else if (strcmp(av[k], "trans") == 0) {
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      TransitionImage timg = ImageToTransitions(BufferTop(b, 1));
+      fprintf(log, "TransitionImageCountBlack(I%d) -> %" PRIu64 "\n",
+              BufferTopId(b, 1), TransitionImageCountBlack(timg));
+      fprintf(log, "TransitionImageToImage() -> I%d\n", b->next_id);
+      BufferPush(b, TransitionImageToImage(timg), NULL);
+      TransitionImageDestroy(&timg);
+    } else if (strcmp(av[k], "tand") == 0 || strcmp(av[k], "tor") == 0 ||
+               strcmp(av[k], "txor") == 0) {
+      if (b->n < 2) { err = 2; break; }  // enough input images?
+      // precondition check!
+      if (!SameSize(BufferTop(b, 2), BufferTop(b, 1))) { err = 10; break; }
+      uint8 op = av[k][1] == 'a' ? OP_AND : av[k][1] == 'o' ? OP_OR : OP_XOR;
+      TransitionImage timg1 = ImageToTransitions(BufferTop(b, 2));
+      TransitionImage timg2 = ImageToTransitions(BufferTop(b, 1));
+      TransitionImage timg = TransitionImageOp(timg1, timg2, op);
+      fprintf(log, "TransitionImageOp(I%d, I%d, %s) -> I%d\n",
+              BufferTopId(b, 2), BufferTopId(b, 1), av[k] + 1, b->next_id);
+      BufferPush(b, TransitionImageToImage(timg), NULL);
+      TransitionImageDestroy(&timg);
+      TransitionImageDestroy(&timg2);
+      TransitionImageDestroy(&timg1);
+    } else if (strcmp(av[k], "tpixel") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      uint32 x, y;  // the pixel
+      if (sscanf(av[k], "%u,%u", &x, &y) != 2) { err = 4; break; }
+      // precondition check!
+      if (x >= (uint32)ImageWidth(BufferTop(b, 1)) ||
+          y >= (uint32)ImageHeight(BufferTop(b, 1))) { err = 4; break; }
+      TransitionImage timg = ImageToTransitions(BufferTop(b, 1));
+      fprintf(log, "TransitionImagePixel(I%d, %u, %u) -> %d\n",
+              BufferTopId(b, 1), x, y, TransitionImagePixel(timg, x, y));
+      TransitionImageDestroy(&timg);
+    } else if (strcmp(av[k], "down") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      uint32 f, m;  // factor and pooling mode
+      if (sscanf(av[k], "%u,%u", &f, &m) != 2) { err = 4; break; }
+      if (f < 1 || m > 2) { err = 4; break; }   // precondition check!
+      // larger factors give the same 1x1 image
+      uint32 fmax = ImageWidth(BufferTop(b, 1));
+      if (fmax < (uint32)ImageHeight(BufferTop(b, 1)))
+        fmax = ImageHeight(BufferTop(b, 1));
+      if (f > fmax) f = fmax;
+      fprintf(log, "ImageDownscale(I%d, %u, %u) -> I%d\n",
+              BufferTopId(b, 1), f, m, b->next_id);
+      BufferPush(b, ImageDownscale(BufferTop(b, 1), f, (uint8)m), NULL);
+    } else if (strcmp(av[k], "pyramid") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      uint32 levels, m;  // number of levels and pooling mode
+      if (sscanf(av[k], "%u,%u", &levels, &m) != 2) { err = 4; break; }
+      if (m > 2) { err = 4; break; }   // precondition check!
+      // no more levels than needed to reach 1x1
+      uint32 pw = ImageWidth(BufferTop(b, 1));
+      uint32 ph = ImageHeight(BufferTop(b, 1));
+      uint32 top = 0;
+      for (; pw > 1 || ph > 1; top++) {
+        pw = (pw + 1) / 2;
+        ph = (ph + 1) / 2;
+      }
+      if (levels > top) levels = top;
+      fprintf(log, "ImagePyramid(I%d, %u, %u) -> I%d..I%d\n",
+              BufferTopId(b, 1), m, levels,
+              b->next_id, b->next_id + (int)levels - 1);
+      Image* pyramid = malloc(levels * sizeof(Image));
+      if (pyramid == NULL && levels > 0) { perror("malloc"); exit(2); }
+      ImagePyramid(BufferTop(b, 1), (uint8)m, levels, pyramid);
+      for (uint32 i = 0; i < levels; i++) BufferPush(b, pyramid[i], NULL);
+      free(pyramid);
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }  // enough input images?
-      fprintf(log, "ImageSave(I%d, \"%s\")\n", n-1, av[k]);
-      ImageSave(img[n-1], av[k]);
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      if (!Writable(av[k])) { err = 6; break; }
+      fprintf(log, "ImageSave(I%d, \"%s\")\n", BufferTopId(b, 1), av[k]);
+      ImageSave(BufferTop(b, 1), av[k]);
+    } else if (strcmp(av[k], "loadrle") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (access(av[k], R_OK) != 0) { err = 6; break; }
+      Image img = ImageLoadRLE(av[k]);
+      if (img == NULL) { err = 9; break; }
+      fprintf(log, "ImageLoadRLE(\"%s\") -> I%d\n", av[k], b->next_id);
+      BufferPush(b, img, NULL);
+    } else if (strcmp(av[k], "saverle") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      if (!Writable(av[k])) { err = 6; break; }
+      fprintf(log, "ImageSaveRLE(I%d, \"%s\")\n", BufferTopId(b, 1), av[k]);
+      ImageSaveRLE(BufferTop(b, 1), av[k]);
+    } else if (strcmp(av[k], "loadtiff") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (access(av[k], R_OK) != 0) { err = 6; break; }
+      Image img = ImageLoadTIFF(av[k]);
+      if (img == NULL) { err = 9; break; }
+      fprintf(log, "ImageLoadTIFF(\"%s\") -> I%d\n", av[k], b->next_id);
+      BufferPush(b, img, NULL);
+    } else if (strcmp(av[k], "savetiff") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      if (!Writable(av[k])) { err = 6; break; }
+      fprintf(log, "ImageSaveTIFF(I%d, \"%s\")\n", BufferTopId(b, 1), av[k]);
+      ImageSaveTIFF(BufferTop(b, 1), av[k]);
+    } else if (store != NULL && strcmp(av[k], "keep") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (b->n < 1) { err = 2; break; }  // enough input images?
+      Held* held = b->slot[b->n-1].held;
+      if (held->res != NULL) { err = 4; break; }  // already resident?
+      fprintf(log, "Keep(I%d, \"%s\")\n", BufferTopId(b, 1), av[k]);
+      held->res = StoreKeep(store, av[k], held->img);
+    } else if (store != NULL && strcmp(av[k], "use") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      Resident* res;
+      Image img = StoreUse(store, av[k], &res);
+      if (img == NULL) { err = 5; break; }
+      fprintf(log, "Use(\"%s\") -> I%d\n", av[k], b->next_id);
+      BufferPush(b, img, res);
+    } else if (store != NULL && strcmp(av[k], "forget") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      fprintf(log, "Forget(\"%s\")\n", av[k]);
+      if (!StoreForget(store, av[k])) { err = 5; break; }
+    } else if (store != NULL && strcmp(av[k], "list") == 0) {
+      StoreList(store, log);
+    } else if (store != NULL) {  // image file, shared with other clients
+      if (access(av[k], R_OK) != 0) { err = 6; break; }
+      Resident* res;
+      int hit;
+      Image img = StoreLoad(store, av[k], &res, &hit);
+      if (img == NULL) { err = (errno == EINVAL) ? 9 : 6; break; }
+      fprintf(log, "ImageLoad(\"%s\") -> I%d%s\n", av[k], b->next_id,
+              hit ? " (resident)" : "");
+      BufferPush(b, img, res);
     } else {  // image file
-      if (n >= N) { err = 3; break; }
-      fprintf(log, "ImageLoad(\"%s\") -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
-      //x if (img[n] == NULL) { err = 999; break; }
-      n++;
+      if (access(av[k], R_OK) != 0) { err = 6; break; }
+      Image img = ImageLoad(av[k]);
+      if (img == NULL) { err = 9; break; }
+      fprintf(log, "ImageLoad(\"%s\") -> I%d\n", av[k], b->next_id);
+      BufferPush(b, img, NULL);
     }
+    BufferCollect(b);
+    InstrRegionEnd();
     k++;
   }
+  if (err > 0) InstrRegionEnd();
+
+  return err;
+}
+
+// Batch mode
+//
+// The pipeline is applied to every file matched by a pattern (or to every
+// pair of files matched by two patterns), which are loaded as I0 (and I1).
+// Files are processed concurrently by a pool of worker threads.
+// The memory used by the files in flight is bounded by a budget.  Each job
+// is charged the worst case for loading its input files, and then a
+// multiple of the memory of the loaded images, for the pipeline.
+// Each operation uses the processors left over by the workers.
+// The log of each file is written at once, when the file is done.
+
+#define BATCH_LOAD_FACTOR 40  // worst-case image memory per byte of PBM file
+#define BATCH_MEM_FACTOR 4    // pipeline memory per byte of the input images
+#define BATCH_MAX_THREADS 256
+
+typedef struct {
+  // The pipeline
+  int ac;
+  char** av;
+  int first;              // index of the first operation in av
+  // The input files
+  char** files1;
+  char** files2;          // NULL, unless processing pairs of files
+  size_t nfiles;
+  size_t mem_budget;      // bytes
+  FILE* log;
+  // Shared state of the workers, protected by lock
+  pthread_mutex_t lock;
+  pthread_cond_t mem_freed;
+  size_t next;            // next file to process
+  size_t mem_used;        // memory charged to the files in flight
+  int failed;             // number of files with errors
+} Batch;
+
+static int CompareStrings(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int IsRegularFile(const char* path) {
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// List the regular files in directory pattern, or matched by glob pattern.
+// Returns a sorted array of nfiles strings. (Caller must free them.)
+static char** ListFiles(const char* pattern, size_t* nfiles) {
+  char** files = NULL;
+  size_t n = 0, cap = 0;
+  struct stat st;
+  if (stat(pattern, &st) == 0 && S_ISDIR(st.st_mode)) {
+    DIR* dir = opendir(pattern);
+    if (dir == NULL) { perror(pattern); exit(2); }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+      size_t len = strlen(pattern) + strlen(entry->d_name) + 2;
+      char* path = malloc(len);
+      if (path == NULL) { perror("malloc"); exit(2); }
+      snprintf(path, len, "%s/%s", pattern, entry->d_name);
+      if (!IsRegularFile(path)) { free(path); continue; }
+      if (n == cap) {
+        cap = (cap > 0) ? 2*cap : 64;
+        files = realloc(files, cap * sizeof(char*));
+        if (files == NULL) { perror("realloc"); exit(2); }
+      }
+      files[n++] = path;
+    }
+    closedir(dir);
+  } else {
+    glob_t g;
+    if (glob(pattern, 0, NULL, &g) == 0) {
+      files = malloc(g.gl_pathc * sizeof(char*));
+      if (files == NULL) { perror("malloc"); exit(2); }
+      for (size_t i = 0; i < g.gl_pathc; i++)
+        if (IsRegularFile(g.gl_pathv[i]))
+          files[n++] = strdup(g.gl_pathv[i]);
+    }
+    globfree(&g);
+  }
+  qsort(files, n, sizeof(char*), CompareStrings);
+  *nfiles = n;
+  return files;
+}
+
+// Size of a file in bytes (0 if unknown)
+static size_t FileSize(const char* path) {
+  struct stat st;
+  return (path != NULL && stat(path, &st) == 0) ? (size_t)st.st_size : 0;
+}
+
+// Monotonic wall-clock time in seconds
+static double WallTime(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + 1.0e-9 * (double)t.tv_nsec;
+}
+
+// Copy arg, replacing "{}" with the name of file, without directory
+// and extension.  (Caller must free the result.)
+static char* ExpandArg(const char* arg, const char* file) {
+  const char* mark = strstr(arg, "{}");
+  if (mark == NULL) return strdup(arg);
+  const char* base = strrchr(file, '/');
+  base = (base != NULL) ? base + 1 : file;
+  const char* dot = strrchr(base, '.');
+  size_t baselen = (dot != NULL && dot != base) ? (size_t)(dot - base)
+                                                : strlen(base);
+  size_t len = strlen(arg) - 2 + baselen + 1;
+  char* res = malloc(len);
+  if (res == NULL) { perror("malloc"); exit(2); }
+  snprintf(res, len, "%.*s%.*s%s", (int)(mark - arg), arg,
+           (int)baselen, base, mark + 2);
+  return res;
+}
+
+// Change the memory charged to a job from *charged to mem bytes,
+// waiting until there is room for it in the budget.
+// (The old charge is given up while waiting, so that jobs growing at the
+// same time do not wait for each other; a job alone always goes on.)
+static void BatchCharge(Batch* b, size_t* charged, size_t mem) {
+  if (mem > b->mem_budget) mem = b->mem_budget;
+  pthread_mutex_lock(&b->lock);
+  b->mem_used -= *charged;
+  if (mem < *charged) pthread_cond_broadcast(&b->mem_freed);
+  while (mem > *charged && b->mem_used > 0 &&
+         b->mem_used + mem > b->mem_budget)
+    pthread_cond_wait(&b->mem_freed, &b->lock);
+  b->mem_used += mem;
+  *charged = mem;
+  pthread_mutex_unlock(&b->lock);
+}
+
+// Process one file (or pair of files): the job i of the batch.
+static void BatchJob(Batch* b, size_t i) {
+  const char* file1 = b->files1[i];
+  const char* file2 = (b->files2 != NULL) ? b->files2[i] : NULL;
+
+  // Wait until there is room to load the files
+  size_t mem = 0;
+  size_t size = FileSize(file1) + FileSize(file2);
+  BatchCharge(b, &mem, (size <= SIZE_MAX / BATCH_LOAD_FACTOR)
+                           ? BATCH_LOAD_FACTOR * size : SIZE_MAX);
+
+  InstrTraceBegin(file1);
+  double start = WallTime();
+  char* text = NULL;
+  size_t textlen = 0;
+  FILE* log = open_memstream(&text, &textlen);
+  if (log == NULL) { perror("open_memstream"); exit(2); }
+
+  // The operands of this job, with {} expanded
+  char** av = malloc(b->ac * sizeof(char*));
+  if (av == NULL) { perror("malloc"); exit(2); }
+  for (int k = b->first; k < b->ac; k++)
+    av[k] = ExpandArg(b->av[k], file1);
+
+  int err = 9;   // unless both files are valid
+  Image img1 = ImageLoad(file1);
+  Image img2 = (file2 != NULL) ? ImageLoad(file2) : NULL;
+  if (img1 != NULL && (file2 == NULL || img2 != NULL)) {
+    // Charge the pipeline by the memory of the images actually loaded
+    size = ImageMemoryUsage(img1);
+    if (img2 != NULL) size += ImageMemoryUsage(img2);
+    BatchCharge(b, &mem, (size <= SIZE_MAX / BATCH_MEM_FACTOR)
+                             ? BATCH_MEM_FACTOR * size : SIZE_MAX);
+    Buffer buf;
+    BufferInit(&buf, NULL, log);
+    fprintf(log, "ImageLoad(\"%s\") -> I%d\n", file1, buf.next_id);
+    BufferPush(&buf, img1, NULL);
+    if (file2 != NULL) {
+      fprintf(log, "ImageLoad(\"%s\") -> I%d\n", file2, buf.next_id);
+      BufferPush(&buf, img2, NULL);
+    }
+    err = RunPipeline(b->ac, av, b->first, &buf);
+    BufferClear(&buf);
+  } else {
+    if (img1 != NULL) ImageDestroy(&img1);
+    if (img2 != NULL) ImageDestroy(&img2);
+  }
+  if (err > 0) fprintf(log, "# %s: %s\n", file1, errors[err]);
+  fprintf(log, "# %s: %.3f ms\n", file1, 1000.0 * (WallTime() - start));
+  fclose(log);
+  InstrTraceEnd(file1);
+
+  for (int k = b->first; k < b->ac; k++) free(av[k]);
+  free(av);
+
+  BatchCharge(b, &mem, 0);
+  pthread_mutex_lock(&b->lock);
+  fwrite(text, 1, textlen, b->log);
+  fflush(b->log);
+  if (err > 0) b->failed++;
+  pthread_mutex_unlock(&b->lock);
+  free(text);
+}
+
+static void* BatchWorker(void* arg) {
+  Batch* b = arg;
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    size_t i = b->next++;
+    pthread_mutex_unlock(&b->lock);
+    if (i >= b->nfiles) break;
+    BatchJob(b, i);
+  }
+  return NULL;
+}
+
+// Run the batch mode:
+//   -batch PATTERN [-pair PATTERN2] [-j THREADS] [-mem MBYTES] OPERATIONS...
+static int RunBatch(int ac, char* av[], FILE* log) {
+  if (ac < 3) { fprintf(stderr, "%s\n", errors[1]); return 101; }
+  Batch b;
+  b.ac = ac;
+  b.av = av;
+  b.files1 = ListFiles(av[2], &b.nfiles);
+  b.files2 = NULL;
+  b.log = log;
+  long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+  long nthreads = nprocs;
+  long mem_mb = 1024;
+
+  int k = 3;
+  for (; k + 1 < ac && av[k][0] == '-'; k += 2) {
+    if (strcmp(av[k], "-pair") == 0) {
+      size_t n2;
+      b.files2 = ListFiles(av[k+1], &n2);
+      if (n2 != b.nfiles) {
+        fprintf(stderr, "%s and %s match different numbers of files\n",
+                av[2], av[k+1]);
+        return 104;
+      }
+    } else if (strcmp(av[k], "-j") == 0) {
+      nthreads = atol(av[k+1]);
+    } else if (strcmp(av[k], "-mem") == 0) {
+      mem_mb = atol(av[k+1]);
+    } else {
+      fprintf(stderr, "%s: %s\n", errors[4], av[k]);
+      return 104;
+    }
+  }
+  if (nthreads > BATCH_MAX_THREADS) nthreads = BATCH_MAX_THREADS;
+  if (nthreads < 1 || mem_mb < 1 || (size_t)mem_mb > SIZE_MAX >> 20) {
+    fprintf(stderr, "%s\n", errors[4]);
+    return 104;
+  }
+  b.mem_budget = (size_t)mem_mb << 20;
+  // the workers share the processors (unless IMAGEBW_THREADS is set)
+  if (getenv("IMAGEBW_THREADS") == NULL)
+    ImageSetThreads((nprocs > nthreads) ? (uint32)(nprocs / nthreads) : 1);
+  b.first = k;
+  b.next = 0;
+  b.mem_used = 0;
+  b.failed = 0;
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.mem_freed, NULL);
+
+  double start = WallTime();
+  pthread_t tid[nthreads];
+  for (long t = 0; t < nthreads; t++)
+    pthread_create(&tid[t], NULL, BatchWorker, &b);
+  for (long t = 0; t < nthreads; t++)
+    pthread_join(tid[t], NULL);
+  fprintf(log, "# batch: %zu files, %d failed, %ld threads, %.3f ms\n",
+          b.nfiles, b.failed, nthreads, 1000.0 * (WallTime() - start));
+
+  pthread_mutex_destroy(&b.lock);
+  pthread_cond_destroy(&b.mem_freed);
+  for (size_t i = 0; i < b.nfiles; i++) {
+    free(b.files1[i]);
+    if (b.files2 != NULL) free(b.files2[i]);
+  }
+  free(b.files1);
+  free(b.files2);
+  return (b.failed > 0) ? 100 : 0;
+}
+
+// Server mode
+//
+// The server listens on a Unix socket and serves each connection with one
+// worker of a pool of threads.  Each line received is a pipeline, applied
+// to a fresh image buffer, and answered with its log followed by a line
+//   # status ERR (MESSAGE), TIME ms
+// Images loaded from files are kept resident in a store shared by all
+// workers, and reused while the file is unchanged.  Clients may also keep
+// images they created resident, under a name.
+// Resident images are never modified and are reference counted: an image
+// forgotten (or replaced) while in use is destroyed only when released.
+
+#define SERVER_MAX_LINE 4096
+#define SERVER_MAX_ARGS 256
+#define SERVER_MAX_THREADS 256
+
+struct Resident {
+  char* name;
+  Image img;
+  int is_file;                // loaded from file name?
+  struct timespec mtime;      // modification time and
+  off_t size;                 // size of the file, when loaded
+  int refs;                   // references: the store and the pipelines
+  Resident* next;
+};
+
+struct Store {
+  pthread_mutex_t lock;
+  Resident* head;
+};
+
+// Find resident named name.  (Call with lock held.)
+static Resident* StoreFind(Store* s, const char* name) {
+  Resident* r = s->head;
+  while (r != NULL && strcmp(r->name, name) != 0) r = r->next;
+  return r;
+}
+
+// Drop a reference to r, and destroy it when none remain.
+// (Call with lock held.)
+static void StoreUnref(Resident* r) {
+  if (--r->refs > 0) return;
+  ImageDestroy(&r->img);
+  free(r->name);
+  free(r);
+}
+
+// Remove r from the store.  (Call with lock held.)
+static void StoreDetach(Store* s, Resident* r) {
+  Resident** p = &s->head;
+  while (*p != r) p = &(*p)->next;
+  *p = r->next;
+  StoreUnref(r);
+}
+
+// Add a new resident, with a reference held by the caller,
+// replacing any other resident with the same name.  (Call with lock held.)
+static Resident* StoreAdd(Store* s, const char* name, Image img) {
+  Resident* old = StoreFind(s, name);
+  if (old != NULL) StoreDetach(s, old);
+  Resident* r = malloc(sizeof(*r));
+  if (r == NULL) { perror("malloc"); exit(2); }
+  r->name = strdup(name);
+  r->img = img;
+  r->is_file = 0;
+  r->refs = 2;
+  r->next = s->head;
+  s->head = r;
+  return r;
+}
+
+static int SameFile(const Resident* r, const struct stat* st) {
+  return r->is_file && r->size == st->st_size &&
+         r->mtime.tv_sec == st->st_mtim.tv_sec &&
+         r->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Get the image in PBM file path, loading it only if not resident or
+// changed since loaded.  Sets *r to the resident entry and *hit to whether
+// it was resident already.
+// Returns NULL if the file cannot be accessed or is not a valid PBM file
+// (with errno EINVAL).
+static Image StoreLoad(Store* s, const char* path, Resident** r, int* hit) {
+  struct stat st;
+  if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) ||
+      access(path, R_OK) != 0) {
+    errno = EACCES;  // EINVAL is for invalid files
+    return NULL;
+  }
+
+  pthread_mutex_lock(&s->lock);
+  Resident* e = StoreFind(s, path);
+  if (e != NULL && SameFile(e, &st)) {
+    e->refs++;
+    pthread_mutex_unlock(&s->lock);
+    *r = e;
+    *hit = 1;
+    return e->img;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  // Load without the lock, so that other clients are not held up
+  Image img = ImageLoad(path);
+  if (img == NULL) return NULL;
+
+  pthread_mutex_lock(&s->lock);
+  e = StoreFind(s, path);
+  if (e != NULL && SameFile(e, &st)) {  // loaded meanwhile by another client
+    e->refs++;
+    pthread_mutex_unlock(&s->lock);
+    ImageDestroy(&img);
+  } else {
+    e = StoreAdd(s, path, img);
+    e->is_file = 1;
+    e->mtime = st.st_mtim;
+    e->size = st.st_size;
+    pthread_mutex_unlock(&s->lock);
+  }
+  *r = e;
+  *hit = 0;
+  return e->img;
+}
+
+// Get the resident image named name, setting *r to its entry.
+// Returns NULL if there is none.
+static Image StoreUse(Store* s, const char* name, Resident** r) {
+  pthread_mutex_lock(&s->lock);
+  Resident* e = StoreFind(s, name);
+  if (e != NULL) e->refs++;
+  pthread_mutex_unlock(&s->lock);
+  *r = e;
+  return (e != NULL) ? e->img : NULL;
+}
+
+// Keep img resident under name.  The store takes ownership of img.
+// Returns the entry, with a reference held by the caller.
+static Resident* StoreKeep(Store* s, const char* name, Image img) {
+  pthread_mutex_lock(&s->lock);
+  Resident* e = StoreAdd(s, name, img);
+  pthread_mutex_unlock(&s->lock);
+  return e;
+}
+
+// Forget the resident image named name.
+// Returns 0 if there is none.
+static int StoreForget(Store* s, const char* name) {
+  pthread_mutex_lock(&s->lock);
+  Resident* e = StoreFind(s, name);
+  if (e != NULL) StoreDetach(s, e);
+  pthread_mutex_unlock(&s->lock);
+  return e != NULL;
+}
+
+static void StoreRelease(Store* s, Resident* r) {
+  pthread_mutex_lock(&s->lock);
+  StoreUnref(r);
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void StoreList(Store* s, FILE* log) {
+  pthread_mutex_lock(&s->lock);
+  for (Resident* r = s->head; r != NULL; r = r->next)
+    fprintf(log, "# %s: %ux%u, %zu bytes, %s, %d users\n", r->name,
+            ImageWidth(r->img), ImageHeight(r->img), ImageMemoryUsage(r->img),
+            r->is_file ? "file" : "kept", r->refs - 1);
+  pthread_mutex_unlock(&s->lock);
+}
+
+typedef struct {
+  Store store;
+  int listen_fd;
+  volatile int stopping;
+  // Queue of accepted connections, protected by lock
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  int* queue;
+  size_t qhead, qlen, qcap;
+  int closed;             // no more connections
+} Server;
+
+// Split line into words, in place.  Returns the number of words.
+static int SplitWords(char* line, char* words[], int max) {
+  int n = 0;
+  char* save;
+  for (char* w = strtok_r(line, " \t\r\n", &save); w != NULL && n < max;
+       w = strtok_r(NULL, " \t\r\n", &save))
+    words[n++] = w;
+  return n;
+}
+
+// Serve the pipelines sent through connection fd, until it is closed.
+static void ServeConnection(Server* srv, int fd) {
+  FILE* in = fdopen(fd, "r");
+  FILE* out = fdopen(dup(fd), "w");
+  if (in == NULL || out == NULL) { perror("fdopen"); exit(2); }
+  char line[SERVER_MAX_LINE];
+  char* av[SERVER_MAX_ARGS];
+
+  while (fgets(line, sizeof(line), in) != NULL) {
+    int ac = SplitWords(line, av, SERVER_MAX_ARGS);
+    if (ac == 1 && strcmp(av[0], "shutdown") == 0) {
+      srv->stopping = 1;
+      shutdown(srv->listen_fd, SHUT_RDWR);  // wake up accept
+      fprintf(out, "# status 0 (%s), 0.000 ms\n", errors[0]);
+      fflush(out);
+      break;
+    }
+
+    double start = WallTime();
+    Buffer buf;
+    BufferInit(&buf, &srv->store, out);
+    int err = RunPipeline(ac, av, 0, &buf);
+    BufferClear(&buf);
+    fprintf(out, "# status %d (%s), %.3f ms\n", err, errors[err],
+            1000.0 * (WallTime() - start));
+    if (fflush(out) != 0) break;  // client gone
+  }
+  fclose(out);
+  fclose(in);
+}
+
+static void* ServerWorker(void* arg) {
+  Server* srv = arg;
+  for (;;) {
+    pthread_mutex_lock(&srv->lock);
+    while (srv->qlen == 0 && !srv->closed)
+      pthread_cond_wait(&srv->ready, &srv->lock);
+    if (srv->qlen == 0) {
+      pthread_mutex_unlock(&srv->lock);
+      break;
+    }
+    int fd = srv->queue[srv->qhead];
+    srv->qhead = (srv->qhead + 1) % srv->qcap;
+    srv->qlen--;
+    pthread_mutex_unlock(&srv->lock);
+    ServeConnection(srv, fd);
+  }
+  return NULL;
+}
+
+// Add connection fd to the queue of the workers.
+static void ServerEnqueue(Server* srv, int fd) {
+  pthread_mutex_lock(&srv->lock);
+  if (srv->qlen == srv->qcap) {
+    size_t cap = (srv->qcap > 0) ? 2 * srv->qcap : 16;
+    int* q = malloc(cap * sizeof(int));
+    if (q == NULL) { perror("malloc"); exit(2); }
+    for (size_t i = 0; i < srv->qlen; i++)
+      q[i] = srv->queue[(srv->qhead + i) % srv->qcap];
+    free(srv->queue);
+    srv->queue = q;
+    srv->qhead = 0;
+    srv->qcap = cap;
+  }
+  srv->queue[(srv->qhead + srv->qlen) % srv->qcap] = fd;
+  srv->qlen++;
+  pthread_cond_signal(&srv->ready);
+  pthread_mutex_unlock(&srv->lock);
+}
+
+// Fill addr with the Unix socket address of path.
+// Returns 0 if path is too long.
+static int SocketAddress(const char* path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) return 0;
+  strcpy(addr->sun_path, path);
+  return 1;
+}
+
+// Run the server mode:
+//   -server SOCKET [-j THREADS]
+static int RunServer(int ac, char* av[], FILE* log) {
+  if (ac < 3) { fprintf(stderr, "%s\n", errors[1]); return 101; }
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int k = 3; k < ac; k += 2) {
+    if (strcmp(av[k], "-j") == 0 && k + 1 < ac) {
+      nthreads = atol(av[k+1]);
+    } else {
+      fprintf(stderr, "%s: %s\n", errors[4], av[k]);
+      return 104;
+    }
+  }
+  if (nthreads > SERVER_MAX_THREADS) nthreads = SERVER_MAX_THREADS;
+  struct sockaddr_un addr;
+  if (nthreads < 1 || !SocketAddress(av[2], &addr)) {
+    fprintf(stderr, "%s\n", errors[4]);
+    return 104;
+  }
+
+  Server srv;
+  srv.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (srv.listen_fd < 0) { perror("socket"); exit(2); }
+  unlink(av[2]);   // stale socket of a previous server
+  if (bind(srv.listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(srv.listen_fd, SOMAXCONN) != 0) {
+    perror(av[2]);
+    exit(2);
+  }
+  signal(SIGPIPE, SIG_IGN);   // clients may go away at any time
+  pthread_mutex_init(&srv.store.lock, NULL);
+  srv.store.head = NULL;
+  srv.stopping = 0;
+  pthread_mutex_init(&srv.lock, NULL);
+  pthread_cond_init(&srv.ready, NULL);
+  srv.queue = NULL;
+  srv.qhead = srv.qlen = srv.qcap = 0;
+  srv.closed = 0;
+
+  pthread_t tid[nthreads];
+  for (long t = 0; t < nthreads; t++)
+    pthread_create(&tid[t], NULL, ServerWorker, &srv);
+  fprintf(log, "# server: listening on %s, %ld threads\n", av[2], nthreads);
+  fflush(log);
+
+  while (!srv.stopping) {
+    int fd = accept(srv.listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (srv.stopping) break;
+      perror("accept");
+      exit(2);
+    }
+    ServerEnqueue(&srv, fd);
+  }
+
+  // Let the workers finish the connections already accepted
+  pthread_mutex_lock(&srv.lock);
+  srv.closed = 1;
+  pthread_cond_broadcast(&srv.ready);
+  pthread_mutex_unlock(&srv.lock);
+  for (long t = 0; t < nthreads; t++)
+    pthread_join(tid[t], NULL);
+  close(srv.listen_fd);
+  unlink(av[2]);
+
+  while (srv.store.head != NULL) StoreDetach(&srv.store, srv.store.head);
+  pthread_mutex_destroy(&srv.store.lock);
+  pthread_mutex_destroy(&srv.lock);
+  pthread_cond_destroy(&srv.ready);
+  free(srv.queue);
+  fprintf(log, "# server: stopped\n");
+  return 0;
+}
+
+// Send line to the server and copy its answer to log.
+// Returns the status of the pipeline, or -1 if the connection failed.
+static int ClientRequest(FILE* in, FILE* out, const char* line, FILE* log) {
+  fprintf(out, "%s\n", line);
+  if (fflush(out) != 0) return -1;
+  char buf[SERVER_MAX_LINE];
+  while (fgets(buf, sizeof(buf), in) != NULL) {
+    int err;
+    fputs(buf, log);
+    if (sscanf(buf, "# status %d", &err) == 1) return err;
+  }
+  return -1;
+}
+
+// Run the client mode:
+//   -client SOCKET [OPERATIONS...]
+static int RunClient(int ac, char* av[], FILE* log) {
+  if (ac < 3) { fprintf(stderr, "%s\n", errors[1]); return 101; }
+  struct sockaddr_un addr;
+  if (!SocketAddress(av[2], &addr)) {
+    fprintf(stderr, "%s\n", errors[4]);
+    return 104;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) { perror("socket"); exit(2); }
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    perror(av[2]);
+    exit(2);
+  }
+  FILE* in = fdopen(fd, "r");
+  FILE* out = fdopen(dup(fd), "w");
+  if (in == NULL || out == NULL) { perror("fdopen"); exit(2); }
+
+  char line[SERVER_MAX_LINE];
+  int err = 0;
+  if (ac > 3) {   // one pipeline, from the arguments
+    size_t len = 0;
+    line[0] = '\0';
+    for (int k = 3; k < ac; k++) {
+      int m = snprintf(line + len, sizeof(line) - len, "%s%s",
+                       (k > 3) ? " " : "", av[k]);
+      if (m < 0 || (size_t)m >= sizeof(line) - len) {
+        fprintf(stderr, "%s\n", errors[4]);
+        return 104;
+      }
+      len += m;
+    }
+    err = ClientRequest(in, out, line, log);
+  } else {        // one pipeline per line of input
+    while (err >= 0 && fgets(line, sizeof(line), stdin) != NULL) {
+      line[strcspn(line, "\n")] = '\0';
+      err = ClientRequest(in, out, line, log);
+    }
+  }
+  fclose(out);
+  fclose(in);
+
+  if (err < 0) {
+    fprintf(stderr, "%s: connection closed\n", av[2]);
+    return 2;
+  }
+  if (err > 0) {
+    fprintf(stderr, "%s\n", errors[err]);
+    return 100 + err;
+  }
+  return 0;
+}
+
+int main(int ac, char* av[]) {
+  if (ac <= 1) {
+    fprintf(stderr, "\n%s", USAGE);
+    return 1;
+  }
   
-  // Destroy remaining images
-  while (n > 0) {
-    fprintf(log, "ImageDestroy(I%d)\n", n-1);
-    ImageDestroy(&img[--n]);
+  FILE *log = stdout;   // where to send log messages
+
+  if (strcmp(av[1], "-client") == 0) {
+    return RunClient(ac, av, log);
+  }
+
+  ImageInit();
+
+  if (strcmp(av[1], "-batch") == 0) {
+    return RunBatch(ac, av, log);
   }
+  if (strcmp(av[1], "-server") == 0) {
+    return RunServer(ac, av, log);
+  }
+
+  // The image buffer
+  Buffer buf;
+  BufferInit(&buf, NULL, log);
+
+  int err = RunPipeline(ac, av, 1, &buf);
+  
+  // Destroy remaining images
+  BufferClear(&buf);
 
   if (err > 0) {
     fprintf(stderr, "%s\n", errors[err]);
@@ -18,10 +18,21 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time, calibrated time and counters
+///
+/// Memory allocated with InstrMalloc/InstrRealloc (and released with
+/// InstrFree) is accounted for: the live bytes, the peak of live bytes and
+/// the number of allocations since the last reset are also shown.
 
 #include "instrumentation.h"
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#if defined(__linux__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -42,6 +53,22 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
+double thread_cpu_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -66,6 +93,19 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+double wall_time(void) {
+  return cpu_time();  // cpu_time() is already a wall clock here
+}
+
+double thread_cpu_time(void) {
+  FILETIME creation, exit, kernel, user;
+  GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+  ULARGE_INTEGER t;
+  t.LowPart = user.dwLowDateTime;
+  t.HighPart = user.dwHighDateTime;
+  return 1.0e-7 * (double)t.QuadPart;  // units of 100ns
+}
+
 #endif
 
 /// Array of operation counters:
@@ -79,60 +119,553 @@ char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
 /// Cpu_time read on previous reset (~seconds)
 double InstrTime;  ///extern
 
+/// Wall_time read on previous reset (~seconds)
+double InstrWallTime;  ///extern
+
 /// Calibrated Time Unit (in seconds, initially 1s)
+/// (Valid after InstrGetCTU is called.)
 double InstrCTU = 1.0;  ///extern
 
+// The calibration is lazy: InstrCalibrate only requests it, and it is done
+// when the CTU is first needed, typically by InstrPrint.
+// The CTU measured is cached in a file per host, so that it is measured
+// only once in each machine: $INSTRCTU_CACHE if defined (an empty value
+// disables the cache), or else ~/.cache/instrctu-HOSTNAME, if that
+// directory exists (it is not created).
+// The CTU measured goes to stderr, as it may be needed in the middle of
+// the output of a program.
+
+#define CALIB_ITERS 500000    // iterations of each run of the kernel
+#define CALIB_RUNS 5          // runs of the kernel (the median is used)
+#define CALIB_UNIT 40000000   // iterations in a CTU
+
+static int CalibRequested = 0;
+static pthread_once_t CalibOnce = PTHREAD_ONCE_INIT;
+
+// Time CALIB_ITERS iterations of a loop of basic memory and arithmetic
+// operations, in seconds.
+static double CalibKernel(void) {
+  const int size = 4*1024;     // 2^12!
+  const int mask = size - 1;
+  int array[size];  // alloc array in stack, not initialized on purpose
+  double time = cpu_time();
+  srand((unsigned int)(time*1e9));
+  for (int n = 0; n < CALIB_ITERS; n++) {
+    int i = rand() & mask;
+    int j = rand() & mask;
+    int k = rand() & mask;
+    array[k] ^= array[i] + array[j] + i*j;
+  }
+  return cpu_time() - time;
+}
+
+static int CompareDoubles(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Name of the calibration cache file into path.  Returns 0 if disabled.
+static int CalibCachePath(char* path, size_t size) {
+  const char* val = getenv("INSTRCTU_CACHE");
+  if (val != NULL) {
+    snprintf(path, size, "%s", val);
+    return val[0] != '\0';
+  }
+#if defined(__linux__) || defined(__APPLE__)
+  const char* home = getenv("HOME");
+  char host[256];
+  if (home == NULL || gethostname(host, sizeof(host)) != 0) return 0;
+  host[sizeof(host) - 1] = '\0';
+  snprintf(path, size, "%s/.cache/instrctu-%s", home, host);
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+static void CalibMeasure(void) {
+  char path[4096];
+  int cached = CalibCachePath(path, sizeof(path));
+  if (cached) {
+    FILE* f = fopen(path, "r");
+    double ctu;
+    if (f != NULL) {
+      int ok = fscanf(f, "%lf", &ctu) == 1 && ctu > 0.0;
+      fclose(f);
+      if (ok) {
+        InstrCTU = ctu;
+        fprintf(stderr, "# export INSTRCTU=%.3f  # (From %s)\n", InstrCTU,
+                path);
+        return;
+      }
+    }
+  }
+
+  // Median of some short runs, scaled to the unit
+  double t[CALIB_RUNS];
+  for (int r = 0; r < CALIB_RUNS; r++) t[r] = CalibKernel();
+  qsort(t, CALIB_RUNS, sizeof(double), CompareDoubles);
+  InstrCTU = t[CALIB_RUNS / 2] * ((double)CALIB_UNIT / CALIB_ITERS);
+  fprintf(stderr, "# export INSTRCTU=%.3f  # (To bypass calibration)\n",
+          InstrCTU);
+
+  if (cached) {
+    FILE* f = fopen(path, "w");
+    if (f != NULL) {
+      fprintf(f, "%.6f\n", InstrCTU);
+      fclose(f);
+    }
+  }
+}
+
 /// Find the Calibrated Time Unit (CTU).
-/// Run and time a loop of basic memory and arithmetic operations to set
+/// The CTU is the time of a loop of basic memory and arithmetic operations,
 /// a reasonably cpu-independent time unit.
 /// If environment variable INSTRCTU is defined, get CTU from there
 /// and bypass the calibration loop entirely.
+/// Otherwise, the calibration is deferred until the CTU is needed.
 void InstrCalibrate(void) { ///
+  InstrWallTime = wall_time();  // until the first InstrReset
   char *val = getenv("INSTRCTU");
   if (val != NULL) {
     InstrCTU = atof(val);
+    printf("# export INSTRCTU=%.3f  # (To bypass calibration)\n", InstrCTU);
   }
   else {
-    const int size = 4*1024;     // 2^12!
-    const int mask = size - 1;
-    int array[size];  // alloc array in stack, not initialized on purpose
-    double time = cpu_time();
-    srand((unsigned int)(time*1e9));
-    for (int n = 0; n < 40000000; n++) {
-      int i = rand() & mask;
-      int j = rand() & mask;
-      int k = rand() & mask;
-      array[k] ^= array[i] + array[j] + i*j;
-      //printf("%d %d %d\n", i, j, k);  // debug
-    }
-    InstrCTU = cpu_time() - time;
+    CalibRequested = 1;
+  }
+}
+
+/// Get the CTU, calibrating it first if needed.
+double InstrGetCTU(void) { ///
+  if (CalibRequested) pthread_once(&CalibOnce, CalibMeasure);
+  return InstrCTU;
+}
+
+//
+// Hardware performance counters (GNU/Linux only)
+//
+// If environment variable INSTRPERF is defined, InstrReset starts some
+// perf_event_open counters for this process (and the threads it creates),
+// and InstrPrint stops and shows them.  Counters that cannot be opened (e.g.
+// not allowed by /proc/sys/kernel/perf_event_paranoid) are reported and
+// left out.  When the kernel multiplexes more counters than the hardware
+// has, a counter only runs part of the time: its value is scaled up to the
+// whole time and marked with a *.  The counters are closed at exit.
+
+#define NUMPERF 5
+
+static const char* PerfName[NUMPERF] = {
+  "cycles", "instructions", "cache_misses", "branch_misses", "page_faults",
+};
+
+static int PerfFd[NUMPERF];
+static int PerfState = 0;   // 0: not initialized, 1: enabled, -1: disabled
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+static int PerfOpen(unsigned type, unsigned long long config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.inherit = 1;          // count the threads created meanwhile
+  attr.exclude_kernel = (type == PERF_TYPE_HARDWARE);
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void PerfClose(void) {
+  for (int i = 0; i < NUMPERF; i++)
+    if (PerfFd[i] >= 0) close(PerfFd[i]);
+}
+
+static void PerfInit(void) {
+  static const unsigned type[NUMPERF] = {
+    PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+    PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE,
+  };
+  static const unsigned long long config[NUMPERF] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+    PERF_COUNT_SW_PAGE_FAULTS,
+  };
+  PerfState = -1;
+  if (getenv("INSTRPERF") == NULL) return;
+  for (int i = 0; i < NUMPERF; i++) {
+    PerfFd[i] = PerfOpen(type[i], config[i]);
+    if (PerfFd[i] >= 0)
+      PerfState = 1;
+    else
+      fprintf(stderr, "# perf counter %s unavailable: %s\n", PerfName[i],
+              strerror(errno));
   }
-  printf("# export INSTRCTU=%.3f  # (To bypass calibration)\n", InstrCTU);
+  if (PerfState > 0) atexit(PerfClose);
+}
+
+static void PerfStart(void) {
+  for (int i = 0; i < NUMPERF; i++) {
+    if (PerfFd[i] < 0) continue;
+    ioctl(PerfFd[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(PerfFd[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+static void PerfStop(void) {
+  for (int i = 0; i < NUMPERF; i++)
+    if (PerfFd[i] >= 0) ioctl(PerfFd[i], PERF_EVENT_IOC_DISABLE, 0);
+}
+
+// Read counter i into *value, scaled if it was multiplexed (then sets
+// *scaled).  Returns 0 if not available or never scheduled.
+static int PerfRead(int i, unsigned long long* value, int* scaled) {
+  unsigned long long v[3];  // value, time enabled, time running
+  if (PerfFd[i] < 0 || read(PerfFd[i], v, sizeof(v)) != sizeof(v) ||
+      v[2] == 0)
+    return 0;
+  *scaled = v[2] < v[1];
+  *value = *scaled ? (unsigned long long)((double)v[0] * v[1] / v[2]) : v[0];
+  return 1;
+}
+
+#else
+
+static void PerfInit(void) { PerfState = -1; }
+static void PerfStart(void) { }
+static void PerfStop(void) { }
+static int PerfRead(int i, unsigned long long* value, int* scaled) {
+  (void)i; (void)value; (void)scaled;
+  return 0;
 }
 
-/// Reset counters to zero and store cpu_time.
+#endif
+
+// Memory accounting state (updated concurrently by all threads)
+static atomic_size_t MemLive;
+static atomic_size_t MemPeak;
+static atomic_ulong MemAllocs;
+
+/// Reset counters to zero and store cpu_time and wall_time.
+/// The peak of memory restarts from the memory currently allocated.
 void InstrReset(void) { ///
   for (int i = 0; i < NUMCOUNTERS; i++)
     InstrCount[i] = 0ul;
+  atomic_store(&MemPeak, atomic_load(&MemLive));
+  atomic_store(&MemAllocs, 0ul);
+  if (PerfState == 0) PerfInit();
+  if (PerfState > 0) PerfStart();
   InstrTime = cpu_time();
+  InstrWallTime = wall_time();
 }
 
 // Print times and all named counter values
 void InstrPrint(void) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
+  double walltime = wall_time() - InstrWallTime;
   // compute time in calibrated time units:
-  double caltime = time / InstrCTU;
+  double caltime = time / InstrGetCTU();
 
-  printf("#%14.15s\t%15.15s", "time", "caltime");
+  printf("#%14.15s\t%15.15s\t%15.15s", "time", "caltime", "walltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15.15s", InstrName[i]);
+  printf("\t%15.15s\t%15.15s\t%15.15s", "memlive", "mempeak", "allocs");
+  if (PerfState > 0) {
+    for (int i = 0; i < NUMPERF; i++)
+      printf("\t%15.15s", PerfName[i]);
+    printf("\t%15.15s", "ipc");
+  }
   puts("");
-  printf("%15.6f\t%15.6f", time, caltime);
+  printf("%15.6f\t%15.6f\t%15.6f", time, caltime, walltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15lu", InstrCount[i]);  
+  printf("\t%15zu\t%15zu\t%15lu", InstrMemLive(), InstrMemPeak(),
+         InstrMemAllocs());
+  if (PerfState > 0) {
+    unsigned long long value[NUMPERF];
+    int ok[NUMPERF];
+    PerfStop();
+    for (int i = 0; i < NUMPERF; i++) {
+      int scaled = 0;
+      ok[i] = PerfRead(i, &value[i], &scaled);
+      if (ok[i] && scaled)
+        printf("\t%14llu*", value[i]);
+      else if (ok[i])
+        printf("\t%15llu", value[i]);
+      else
+        printf("\t%15s", "-");
+    }
+    if (ok[0] && ok[1] && value[0] > 0)
+      printf("\t%15.3f", (double)value[1] / (double)value[0]);
+    else
+      printf("\t%15s", "-");
+  }
   puts("");
+  InstrRegionPrint();
+}
+
+// Each block allocated is preceded by a header with its size,
+// padded to keep the block aligned as malloc would.
+typedef union {
+  size_t size;
+  max_align_t align;
+} MemHeader;
+
+void InstrMemAccount(long delta) { ///
+  if (delta < 0) {
+    atomic_fetch_sub(&MemLive, (size_t)-delta);
+    return;
+  }
+  size_t live = atomic_fetch_add(&MemLive, (size_t)delta) + (size_t)delta;
+  size_t peak = atomic_load(&MemPeak);
+  while (live > peak &&
+         !atomic_compare_exchange_weak(&MemPeak, &peak, live))
+    ;
 }
 
+void* InstrMalloc(size_t size) { ///
+  MemHeader* h = malloc(sizeof(MemHeader) + size);
+  if (h == NULL) return NULL;
+  h->size = size;
+  atomic_fetch_add(&MemAllocs, 1ul);
+  InstrMemAccount((long)size);
+  return h + 1;
+}
+
+void* InstrRealloc(void* ptr, size_t size) { ///
+  if (ptr == NULL) return InstrMalloc(size);
+  MemHeader* h = (MemHeader*)ptr - 1;
+  size_t old_size = h->size;
+  h = realloc(h, sizeof(MemHeader) + size);
+  if (h == NULL) return NULL;
+  h->size = size;
+  InstrMemAccount((long)size - (long)old_size);
+  return h + 1;
+}
+
+void InstrFree(void* ptr) { ///
+  if (ptr == NULL) return;
+  MemHeader* h = (MemHeader*)ptr - 1;
+  InstrMemAccount(-(long)h->size);
+  free(h);
+}
+
+size_t InstrAllocSize(const void* ptr) { ///
+  return ((const MemHeader*)ptr - 1)->size;
+}
+
+size_t InstrMemLive(void) { ///
+  return atomic_load(&MemLive);
+}
+
+size_t InstrMemPeak(void) { ///
+  return atomic_load(&MemPeak);
+}
+
+unsigned long InstrMemAllocs(void) { ///
+  return atomic_load(&MemAllocs);
+}
+
+//
+// Timing regions
+//
+// Each thread has a stack of open regions.  A region is identified by its
+// path: the names of the enclosing regions and its own, joined by '/'.
+// The durations of all closed regions are kept, per path, until the next
+// reset, to compute their aggregates.
+
+#define MAX_REGION_DEPTH 32
+#define MAX_REGION_PATH 256
+
+typedef struct {
+  char path[MAX_REGION_PATH];
+  const char* name;
+  double wall, cpu;     // times when the region was opened
+} OpenRegion;
+
+static _Thread_local OpenRegion RegionStack[MAX_REGION_DEPTH];
+static _Thread_local int RegionDepth = 0;
+
+typedef struct {
+  char* path;
+  size_t count, cap;
+  double* wall;         // wall time of each occurrence
+  double cpu;           // total thread cpu time
+} RegionStats;
+
+static pthread_mutex_t RegionLock = PTHREAD_MUTEX_INITIALIZER;
+static RegionStats* Regions = NULL;
+static size_t NumRegions = 0, CapRegions = 0;
+
+void InstrRegionBegin(const char* name) { ///
+  if (RegionDepth >= MAX_REGION_DEPTH) {  // too deep: not timed
+    RegionDepth++;
+    return;
+  }
+  OpenRegion* r = &RegionStack[RegionDepth];
+  size_t len = 0;
+  if (RegionDepth > 0) {  // the parent path, then "/"
+    const char* parent = RegionStack[RegionDepth - 1].path;
+    len = strlen(parent);
+    if (len > MAX_REGION_PATH - 2) len = MAX_REGION_PATH - 2;  // truncated
+    memcpy(r->path, parent, len);
+    r->path[len++] = '/';
+  }
+  snprintf(r->path + len, MAX_REGION_PATH - len, "%s", name);
+  RegionDepth++;
+  r->name = name;
+  InstrTraceBegin(name);
+  r->cpu = thread_cpu_time();
+  r->wall = wall_time();
+}
+
+void InstrRegionEnd(void) { ///
+  double wall = wall_time();
+  double cpu = thread_cpu_time();
+  if (RegionDepth == 0) return;  // unbalanced
+  if (--RegionDepth >= MAX_REGION_DEPTH) return;
+  OpenRegion* r = &RegionStack[RegionDepth];
+  InstrTraceEnd(r->name);
+
+  // Malloc is used, to keep the regions out of the memory accounting
+  pthread_mutex_lock(&RegionLock);
+  size_t i = 0;
+  while (i < NumRegions && strcmp(Regions[i].path, r->path) != 0) i++;
+  if (i == NumRegions) {
+    if (NumRegions == CapRegions) {
+      CapRegions = (CapRegions > 0) ? 2 * CapRegions : 16;
+      Regions = realloc(Regions, CapRegions * sizeof(RegionStats));
+      if (Regions == NULL) { perror("realloc"); exit(2); }
+    }
+    Regions[i].path = strdup(r->path);
+    Regions[i].count = Regions[i].cap = 0;
+    Regions[i].wall = NULL;
+    Regions[i].cpu = 0.0;
+    NumRegions++;
+  }
+  RegionStats* st = &Regions[i];
+  if (st->count == st->cap) {
+    st->cap = (st->cap > 0) ? 2 * st->cap : 16;
+    st->wall = realloc(st->wall, st->cap * sizeof(double));
+    if (st->wall == NULL) { perror("realloc"); exit(2); }
+  }
+  st->wall[st->count++] = wall - r->wall;
+  st->cpu += cpu - r->cpu;
+  pthread_mutex_unlock(&RegionLock);
+}
+
+void InstrRegionReset(void) { ///
+  pthread_mutex_lock(&RegionLock);
+  for (size_t i = 0; i < NumRegions; i++) {
+    free(Regions[i].path);
+    free(Regions[i].wall);
+  }
+  NumRegions = 0;
+  pthread_mutex_unlock(&RegionLock);
+}
+
+// Percentile p (in [0, 1]) of n sorted values, by the nearest rank.
+static double Percentile(const double v[], size_t n, double p) {
+  size_t k = (size_t)(p * (double)n + 0.999999);
+  return v[(k > 0) ? k - 1 : 0];
+}
+
+void InstrRegionPrint(void) { ///
+  pthread_mutex_lock(&RegionLock);
+  if (NumRegions > 0) {
+    printf("#%-29.29s\t%8s\t%12s\t%12s\t%12s\t%12s\t%12s\t%12s\t%12s\n",
+           "region", "count", "total_ms", "min_ms", "p50_ms", "p90_ms",
+           "p99_ms", "max_ms", "cpu_ms");
+  }
+  for (size_t i = 0; i < NumRegions; i++) {
+    RegionStats* st = &Regions[i];
+    qsort(st->wall, st->count, sizeof(double), CompareDoubles);
+    double total = 0.0;
+    for (size_t j = 0; j < st->count; j++) total += st->wall[j];
+    printf(" %-29.29s\t%8zu\t%12.3f\t%12.3f\t%12.3f\t%12.3f\t%12.3f"
+           "\t%12.3f\t%12.3f\n", st->path, st->count, 1e3 * total,
+           1e3 * st->wall[0], 1e3 * Percentile(st->wall, st->count, 0.50),
+           1e3 * Percentile(st->wall, st->count, 0.90),
+           1e3 * Percentile(st->wall, st->count, 0.99),
+           1e3 * st->wall[st->count - 1], 1e3 * st->cpu);
+  }
+  pthread_mutex_unlock(&RegionLock);
+}
+
+//
+// Tracing
+//
+// If environment variable INSTRTRACE names a file, begin and end events
+// of regions (and of other traced spans) are written to it, in the Chrome
+// trace-event JSON format, which Perfetto (ui.perfetto.dev) and
+// chrome://tracing can open.  The file is completed at exit.
+
+static FILE* TraceFile = NULL;
+static double TraceStart;
+static pthread_once_t TraceOnce = PTHREAD_ONCE_INIT;
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+static long TraceTid(void) { return (long)syscall(SYS_gettid); }
+static long TracePid(void) { return (long)getpid(); }
+#else
+static _Thread_local char TraceTidMark;
+static long TraceTid(void) { return (long)((size_t)&TraceTidMark & 0xffffff); }
+static long TracePid(void) { return 1; }
+#endif
+
+static void TraceClose(void) {
+  // The last event closes the array of events
+  fprintf(TraceFile, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,"
+          "\"args\":{\"name\":\"imageBW\"}}\n]\n", TracePid());
+  fclose(TraceFile);
+}
+
+static void TraceInit(void) {
+  const char* path = getenv("INSTRTRACE");
+  if (path == NULL || path[0] == '\0') return;
+  TraceFile = fopen(path, "w");
+  if (TraceFile == NULL) {
+    perror(path);
+    return;
+  }
+  TraceStart = wall_time();
+  fprintf(TraceFile, "[\n");
+  atexit(TraceClose);
+}
+
+// Write an event of phase ph ('B' or 'E') for span name.
+static void TraceEvent(char ph, const char* name) {
+  pthread_once(&TraceOnce, TraceInit);
+  if (TraceFile == NULL) return;
+  double ts = 1e6 * (wall_time() - TraceStart);  // microseconds
+  char buf[MAX_REGION_PATH];
+  size_t n = 0;
+  for (const char* c = name; *c != '\0' && n + 2 < sizeof(buf); c++) {
+    if (*c == '"' || *c == '\\') buf[n++] = '\\';
+    buf[n++] = ((unsigned char)*c < ' ') ? ' ' : *c;
+  }
+  buf[n] = '\0';
+  // A single fprintf, so that events of different threads do not mix
+  fprintf(TraceFile, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+          "\"pid\":%ld,\"tid\":%ld},\n", buf, ph, ts, TracePid(), TraceTid());
+}
+
+void InstrTraceBegin(const char* name) { ///
+  TraceEvent('B', name);
+}
+
+void InstrTraceEnd(const char* name) { ///
+  TraceEvent('E', name);
+}
@@ -1,6 +1,8 @@
 #ifndef _INSTRUMENTATION_H
 #define _INSTRUMENTATION_H
 
+#include <stddef.h>
+
 /// A generic instrumentation module.
 ///
 /// João Manuel Rodrigues, AED, 2023, 2024
@@ -21,10 +23,20 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time, calibrated time and counters
+///
+/// Memory allocated with InstrMalloc/InstrRealloc (and released with
+/// InstrFree) is accounted for: the live bytes, the peak of live bytes and
+/// the number of allocations since the last reset are also shown.
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Monotonic wall-clock time in seconds
+double wall_time(void) ; ///
+
+/// Cpu time of the calling thread in seconds
+double thread_cpu_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
@@ -37,20 +49,100 @@ extern char* InstrName[NUMCOUNTERS];  ///extern
 /// Cpu_time read on previous reset (~seconds)
 extern double InstrTime;  ///extern
 
+/// Wall_time read on previous reset (~seconds)
+extern double InstrWallTime;  ///extern
+
 /// Calibrated Time Unit (in seconds, initially 1s)
+/// (Valid after InstrGetCTU is called.)
 extern double InstrCTU;  ///extern
 
 /// Find the Calibrated Time Unit (CTU).
-/// Run and time a loop of basic memory and arithmetic operations to set
+/// The CTU is the time of a loop of basic memory and arithmetic operations,
 /// a reasonably cpu-independent time unit.
 /// If environment variable INSTRCTU is defined, get CTU from there
 /// and bypass the calibration loop entirely.
+/// Otherwise, the calibration is deferred until the CTU is needed, and the
+/// CTU measured is cached per host (see INSTRCTU_CACHE in instrumentation.c).
+/// Also stores wall_time, the origin of InstrPrint until InstrReset.
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Get the CTU, calibrating it first if needed.
+double InstrGetCTU(void) ;
+
+/// Reset counters to zero and store cpu_time and wall_time.
+/// If environment variable INSTRPERF is defined, also (re)start the hardware
+/// performance counters: cycles, instructions, cache misses, branch misses
+/// and page faults.  Those that are not available are reported (on stderr)
+/// and skipped.
 void InstrReset(void) ;
 
+/// Print times (cpu, calibrated and wall), counters, and the aggregates of
+/// timing regions, if any.
+/// The hardware counters are stopped until the next InstrReset; those that
+/// were multiplexed are scaled to the whole time and marked with a *.
 void InstrPrint(void) ;
 
+/// Timing regions
+///
+/// InstrRegionBegin("name");
+/// ...  // may contain other regions
+/// InstrRegionEnd();
+///
+/// Regions are nested per thread and identified by their path, e.g.
+/// "outer/inner".  For each path, InstrPrint shows the number of
+/// occurrences and their total, minimum, percentile and maximum wall times,
+/// and the total cpu time of the thread(s) that ran them.
+
+/// Open a region named name in the calling thread.
+void InstrRegionBegin(const char* name) ;
+
+/// Close the innermost region open in the calling thread.
+void InstrRegionEnd(void) ;
+
+/// Forget the aggregates of all regions.
+/// (Not done by InstrReset, which may be called inside a region.)
+void InstrRegionReset(void) ;
+
+/// Print the aggregates of all regions.  (Also done by InstrPrint.)
+void InstrRegionPrint(void) ;
+
+/// Tracing
+///
+/// If environment variable INSTRTRACE is set to a file name, a timeline of
+/// the regions of all threads (and of other spans marked with the functions
+/// below) is written to that file, as Chrome trace-event JSON.  It can be
+/// opened in Perfetto (https://ui.perfetto.dev) or chrome://tracing.
+/// Without INSTRTRACE, these functions do nothing.
+
+/// Mark the beginning of a span named name in the calling thread.
+void InstrTraceBegin(const char* name) ;
+
+/// Mark the end of the innermost span, named name, of the calling thread.
+void InstrTraceEnd(const char* name) ;
+
+/// Memory accounting
+
+/// Allocate, reallocate and free memory, like malloc, realloc and free,
+/// while counting it.  (Must not be mixed with those!)
+void* InstrMalloc(size_t size) ;
+void* InstrRealloc(void* ptr, size_t size) ;
+void InstrFree(void* ptr) ;
+
+/// Usable size of block ptr, allocated with InstrMalloc or InstrRealloc.
+size_t InstrAllocSize(const void* ptr) ;
+
+/// Account for delta bytes of memory obtained otherwise (e.g. mmap),
+/// negative when released.
+void InstrMemAccount(long delta) ;
+
+/// Bytes currently allocated.
+size_t InstrMemLive(void) ;
+
+/// Peak of bytes allocated, since the last reset.
+size_t InstrMemPeak(void) ;
+
+/// Number of allocations, since the last reset.
+unsigned long InstrMemAllocs(void) ;
+
 #endif
 